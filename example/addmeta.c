@@ -89,3 +89,25 @@ TEST_FUNCTION(complex, hash)
   TINU_ASSERT_TRUE(g_hash_table_lookup(self, "val3") == (gpointer)3);
   TINU_ASSERT_TRUE(g_hash_table_lookup(self, "val4") == (gpointer)4);
 }
+
+TEST_SETUP(complex, lookup)
+{
+  GHashTable *self = g_hash_table_new(g_str_hash, g_str_equal);
+
+  g_hash_table_insert(self, "val1", (gpointer)1);
+  return self;
+}
+
+TEST_CLEANUP(complex, lookup)
+{
+  g_hash_table_destroy((GHashTable *)context);
+}
+
+TINU_BENCHMARK(complex, lookup)
+{
+  GHashTable *self = (GHashTable *)context;
+  guint64 i;
+
+  for (i = 0; i < tinu_benchmark_iterations(bench); i++)
+    g_hash_table_lookup(self, "val1");
+}
@@ -133,6 +133,28 @@ test_hash_1(gpointer context)
   TINU_ASSERT_TRUE(g_hash_table_lookup(self, "val4") == (gpointer)4);
 }
 
+gpointer
+bench_hash_setup(TestCase *test_case G_GNUC_UNUSED)
+{
+  return test_hash_1_setup();
+}
+
+void
+bench_hash_cleanup(TestCase *test_case G_GNUC_UNUSED, gpointer context)
+{
+  test_hash_1_cleanup(context);
+}
+
+void
+bench_hash_lookup(TestCase *test_case G_GNUC_UNUSED, Benchmark *bench, gpointer context)
+{
+  GHashTable *self = (GHashTable *)context;
+  guint64 i;
+
+  for (i = 0; i < tinu_benchmark_iterations(bench); i++)
+    g_hash_table_lookup(self, "val3");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -167,5 +189,9 @@ main(int argc, char *argv[])
   /* A bit more complex test */
   tinu_test_add("complex", "hash", test_hash_1_setup, test_hash_1_cleanup, test_hash_1);
 
+  /* Benchmarks are run as test cases too, setup and cleanup wrap all the samples */
+  tinu_benchmark_add("complex", "hash_lookup", bench_hash_setup, bench_hash_cleanup,
+                     bench_hash_lookup, NULL, NULL);
+
   return tinu_main(&argc, &argv);
 }
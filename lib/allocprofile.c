@@ -0,0 +1,337 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+#include <pthread.h>
+
+#include <glib.h>
+
+#include <tinu/allocprofile.h>
+#include <tinu/leakwatch.h>
+#include <tinu/log.h>
+
+/* Site counters are weighted by the number of allocations a sampled
+ * allocation stands for, so they are kept as doubles until the end */
+typedef struct _AllocProfileSite
+{
+  BacktraceId       m_trace;
+
+  gdouble           m_allocs;
+  gdouble           m_bytes;
+  gdouble           m_reallocs;
+  gdouble           m_realloc_bytes;
+  gdouble           m_frees;
+  gdouble           m_lifetime;
+
+  gdouble           m_live_blocks;
+  gdouble           m_live_bytes;
+} AllocProfileSite;
+
+/* A block allocated while profiling */
+typedef struct _AllocProfileBlock
+{
+  AllocProfileSite *m_site;
+  /* Allocation clock when the block was allocated */
+  guint64           m_birth;
+  gdouble           m_weight;
+  /* Estimated size of the block */
+  gdouble           m_live_bytes;
+} AllocProfileBlock;
+
+struct _AllocProfile
+{
+  gpointer          m_handle;
+
+  /* Events are delivered from any thread, snapshots are taken meanwhile.
+   * A pthread lock, the glib one may allocate memory. */
+  pthread_mutex_t   m_lock;
+
+  /* Number of allocations seen */
+  guint64           m_clock;
+
+  /* BacktraceId -> AllocProfileSite */
+  GHashTable       *m_sites;
+  /* Pointer -> AllocProfileBlock */
+  GHashTable       *m_blocks;
+};
+
+static gdouble
+_alloc_profile_weight(gsize size)
+{
+  return size ? (gdouble)tinu_leakwatch_scale(size) / size : 1.0;
+}
+
+static AllocProfileSite *
+_alloc_profile_site(AllocProfile *self, BacktraceId trace)
+{
+  AllocProfileSite *site = g_hash_table_lookup(self->m_sites, GUINT_TO_POINTER(trace));
+
+  if (!site)
+    {
+      site = g_new0(AllocProfileSite, 1);
+      site->m_trace = trace;
+      g_hash_table_insert(self->m_sites, GUINT_TO_POINTER(trace), site);
+    }
+
+  return site;
+}
+
+static void
+_alloc_profile_realloc(AllocProfileSite *site, gsize size)
+{
+  gdouble weight = _alloc_profile_weight(size);
+
+  site->m_bytes += weight * size;
+  site->m_reallocs += weight;
+  site->m_realloc_bytes += weight * size;
+}
+
+static void
+_alloc_profile_resize(AllocProfileBlock *block, gsize size)
+{
+  gdouble live_bytes = tinu_leakwatch_scale(size);
+
+  block->m_site->m_live_bytes += live_bytes - block->m_live_bytes;
+  block->m_live_bytes = live_bytes;
+}
+
+static void
+_alloc_profile_release(AllocProfile *self, AllocProfileBlock *block)
+{
+  block->m_site->m_live_blocks -= block->m_weight;
+  block->m_site->m_live_bytes -= block->m_live_bytes;
+  block->m_site->m_frees += block->m_weight;
+  block->m_site->m_lifetime += block->m_weight * (self->m_clock - block->m_birth);
+}
+
+static void
+_alloc_profile_apply(AllocProfile *self, LeakwatchOperation operation,
+                     gpointer oldptr, gpointer ptr, gsize size, BacktraceId trace)
+{
+  AllocProfileBlock *block = NULL;
+
+  if (oldptr)
+    {
+      block = g_hash_table_lookup(self->m_blocks, oldptr);
+      if (block)
+        g_hash_table_steal(self->m_blocks, oldptr);
+    }
+
+  switch (tinu_leakwatch_operation_kind(operation))
+    {
+      case LEAKWATCH_OPERATION_FREE :
+        if (block)
+          {
+            _alloc_profile_release(self, block);
+            g_free(block);
+          }
+        return;
+
+      case LEAKWATCH_OPERATION_REALLOC :
+        /* The reallocation of a profiled block is charged to the site
+         * that allocated it, the block lives on */
+        if (block)
+          {
+            /* Sampled on its own, like any other allocation */
+            if (trace != BACKTRACE_ID_NONE)
+              _alloc_profile_realloc(block->m_site, size);
+
+            if (ptr)
+              {
+                _alloc_profile_resize(block, size);
+                g_hash_table_insert(self->m_blocks, ptr, block);
+              }
+            else
+              {
+                _alloc_profile_release(self, block);
+                g_free(block);
+              }
+            return;
+          }
+        break;
+
+      default :
+        break;
+    }
+
+  /* Allocations that were not sampled carry no stack */
+  if (!ptr || trace == BACKTRACE_ID_NONE)
+    return;
+
+  block = g_new(AllocProfileBlock, 1);
+  block->m_site = _alloc_profile_site(self, trace);
+  block->m_birth = self->m_clock++;
+  block->m_weight = _alloc_profile_weight(size);
+  block->m_live_bytes = 0;
+
+  block->m_site->m_live_blocks += block->m_weight;
+  _alloc_profile_resize(block, size);
+
+  block->m_site->m_allocs += block->m_weight;
+  block->m_site->m_bytes += block->m_weight * size;
+  /* A block allocated before profiling was reallocated */
+  if (oldptr)
+    {
+      block->m_site->m_reallocs += block->m_weight;
+      block->m_site->m_realloc_bytes += block->m_weight * size;
+    }
+
+  g_hash_table_insert(self->m_blocks, ptr, block);
+}
+
+static void
+_alloc_profile_callback(LeakwatchOperation operation,
+  gpointer oldptr, gpointer ptr, gsize size,
+  BacktraceId trace,
+  gpointer user_data)
+{
+  AllocProfile *self = (AllocProfile *)user_data;
+
+  pthread_mutex_lock(&self->m_lock);
+  _alloc_profile_apply(self, operation, oldptr, ptr, size, trace);
+  pthread_mutex_unlock(&self->m_lock);
+}
+
+static gint
+_alloc_profile_compare(gconstpointer a, gconstpointer b)
+{
+  const AllocSite *x = (const AllocSite *)a;
+  const AllocSite *y = (const AllocSite *)b;
+
+  if (x->m_bytes != y->m_bytes)
+    return (x->m_bytes < y->m_bytes) - (x->m_bytes > y->m_bytes);
+
+  return (x->m_allocs < y->m_allocs) - (x->m_allocs > y->m_allocs);
+}
+
+AllocProfile *
+alloc_profile_start(void)
+{
+  AllocProfile *self;
+
+  /* The profiler does not profile itself */
+  tinu_leakwatch_suspend();
+
+  self = g_new0(AllocProfile, 1);
+  pthread_mutex_init(&self->m_lock, NULL);
+  self->m_sites = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  self->m_blocks = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  self->m_handle = tinu_register_watch(_alloc_profile_callback, self);
+
+  tinu_leakwatch_resume();
+  return self;
+}
+
+static GArray *
+_alloc_profile_sites(AllocProfile *self)
+{
+  GArray *res;
+  GHashTableIter iter;
+  AllocProfileSite *site;
+  AllocSite entry;
+
+  res = g_array_sized_new(FALSE, FALSE, sizeof(AllocSite), g_hash_table_size(self->m_sites));
+  g_hash_table_iter_init(&iter, self->m_sites);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&site))
+    {
+      entry.m_trace = site->m_trace;
+      entry.m_allocs = (guint64)(site->m_allocs + 0.5);
+      entry.m_bytes = (guint64)(site->m_bytes + 0.5);
+      entry.m_reallocs = (guint64)(site->m_reallocs + 0.5);
+      entry.m_realloc_bytes = (guint64)(site->m_realloc_bytes + 0.5);
+      entry.m_frees = (guint64)(site->m_frees + 0.5);
+      entry.m_lifetime = site->m_frees > 0 ? site->m_lifetime / site->m_frees : 0.0;
+      entry.m_live_blocks = (guint64)MAX(site->m_live_blocks + 0.5, 0);
+      entry.m_live_bytes = (guint64)MAX(site->m_live_bytes + 0.5, 0);
+      g_array_append_val(res, entry);
+    }
+  g_array_sort(res, _alloc_profile_compare);
+
+  return res;
+}
+
+GArray *
+alloc_profile_snapshot(AllocProfile *self)
+{
+  GArray *res;
+
+  tinu_leakwatch_suspend();
+
+  tinu_leakwatch_flush();
+  pthread_mutex_lock(&self->m_lock);
+  res = _alloc_profile_sites(self);
+  pthread_mutex_unlock(&self->m_lock);
+
+  tinu_leakwatch_resume();
+  return res;
+}
+
+GArray *
+alloc_profile_stop(AllocProfile *self)
+{
+  GArray *res;
+
+  tinu_leakwatch_suspend();
+
+  tinu_unregister_watch(self->m_handle);
+  res = _alloc_profile_sites(self);
+
+  g_hash_table_destroy(self->m_blocks);
+  g_hash_table_destroy(self->m_sites);
+  pthread_mutex_destroy(&self->m_lock);
+  g_free(self);
+
+  tinu_leakwatch_resume();
+  return res;
+}
+
+void
+alloc_profile_dump(GArray *sites, guint limit, gint priority)
+{
+  AllocSite *site;
+  guint i;
+
+  if (!limit || limit > sites->len)
+    limit = sites->len;
+
+  for (i = 0; i < limit; i++)
+    {
+      site = &g_array_index(sites, AllocSite, i);
+
+      log_format(priority, "Allocation site",
+                 msg_tag_int("rank", i + 1),
+                 msg_tag_printf("allocs", "%" G_GUINT64_FORMAT, site->m_allocs),
+                 msg_tag_printf("bytes", "%" G_GUINT64_FORMAT, site->m_bytes),
+                 msg_tag_printf("reallocs", "%" G_GUINT64_FORMAT, site->m_reallocs),
+                 msg_tag_printf("realloc_bytes", "%" G_GUINT64_FORMAT, site->m_realloc_bytes),
+                 msg_tag_printf("freed", "%" G_GUINT64_FORMAT, site->m_frees),
+                 msg_tag_printf("lifetime", "%.1f allocs", site->m_lifetime), NULL);
+      backtrace_dump_log(backtrace_lookup(site->m_trace), "    ", priority);
+    }
+}
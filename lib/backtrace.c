@@ -34,158 +34,1552 @@
 #include <execinfo.h>
 
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include <glib.h>
 
 #include <tinu/utils.h>
 #include <tinu/backtrace.h>
 #include <tinu/log.h>
+#include <tinu/leakwatch.h>
 
 //#include <config.h>
 
 #ifdef ELFDEBUG_ENABLED
+#include <link.h>
+#include <elf.h>
+#include <unistd.h>
+
 #include <tinu/dwarf.h>
 
-static gboolean g_backtrace_init = FALSE;
-static DwarfHandle *g_backtrace_dwarf;
+gchar *(*g_demangler)(const gchar *function) = g_strdup;
+
+/*
+ * Line information of every loaded module (the executable and the shared
+ * libraries). The debug information of a module is loaded the first time
+ * one of its frames is resolved, and shared by every module with the same
+ * build id (or path if it has none). Addresses are looked up relative to
+ * the load bias of their module, so position independent executables and
+ * libraries resolve as well.
+ */
+#define BACKTRACE_DEBUG_DIR              "/usr/lib/debug/.build-id"
+
+typedef struct _BacktraceModule
+{
+  gpointer                m_addr;
+  guintptr                m_bias;
+  const gchar            *m_name;
+  gchar                   m_build_id[41];
+} BacktraceModule;
+
+static gsize g_backtrace_init = 0;
+
+/* Directory of the symbolization cache, NULL if not used */
+static gchar *g_backtrace_symbol_cache = NULL;
+
+/* Key -> DwarfHandle, NULL for modules without debug information */
+static GHashTable *g_backtrace_dwarf = NULL;
+static pthread_mutex_t g_backtrace_dwarf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_backtrace_cleanup_handle(gpointer key G_GNUC_UNUSED, gpointer value, gpointer user_data G_GNUC_UNUSED)
+{
+  if (value)
+    dw_destroy((DwarfHandle *)value);
+}
+
+static void
+_backtrace_cleanup()
+{
+  pthread_mutex_lock(&g_backtrace_dwarf_lock);
+  g_hash_table_foreach(g_backtrace_dwarf, _backtrace_cleanup_handle, NULL);
+  g_hash_table_destroy(g_backtrace_dwarf);
+  g_backtrace_dwarf = NULL;
+  pthread_mutex_unlock(&g_backtrace_dwarf_lock);
+}
+
+static inline void
+_backtrace_init()
+{
+  if (g_once_init_enter(&g_backtrace_init))
+    {
+      g_backtrace_dwarf = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+      atexit(_backtrace_cleanup);
+      g_once_init_leave(&g_backtrace_init, 1);
+    }
+}
+
+static void
+_backtrace_module_build_id(BacktraceModule *module, const struct dl_phdr_info *info, const ElfW(Phdr) *phdr)
+{
+  const guint8 *note = (const guint8 *)(info->dlpi_addr + phdr->p_vaddr);
+  const guint8 *end = note + phdr->p_memsz;
+  const ElfW(Nhdr) *header;
+  const guint8 *desc;
+  guint32 i;
+
+  while (note + sizeof(ElfW(Nhdr)) <= end)
+    {
+      header = (const ElfW(Nhdr) *)note;
+      desc = note + sizeof(ElfW(Nhdr)) + ((header->n_namesz + 3) & ~3);
+
+      if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 &&
+          memcmp(note + sizeof(ElfW(Nhdr)), "GNU", 4) == 0)
+        {
+          for (i = 0; i < header->n_descsz && i < (sizeof(module->m_build_id) - 1) / 2; i++)
+            sprintf(module->m_build_id + i * 2, "%02x", desc[i]);
+          return;
+        }
+
+      note = desc + ((header->n_descsz + 3) & ~3);
+    }
+}
+
+static int
+_backtrace_module_find(struct dl_phdr_info *info, size_t size G_GNUC_UNUSED, void *data)
+{
+  BacktraceModule *module = (BacktraceModule *)data;
+  guintptr addr = (guintptr)module->m_addr;
+  const ElfW(Phdr) *phdr;
+  gboolean found = FALSE;
+  gint i;
+
+  for (i = 0; i < info->dlpi_phnum && !found; i++)
+    {
+      phdr = &info->dlpi_phdr[i];
+      found = (phdr->p_type == PT_LOAD &&
+               addr >= info->dlpi_addr + phdr->p_vaddr &&
+               addr < info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz);
+    }
+
+  if (!found)
+    return 0;
+
+  module->m_bias = info->dlpi_addr;
+  module->m_name = info->dlpi_name;
+  for (i = 0; i < info->dlpi_phnum && !module->m_build_id[0]; i++)
+    {
+      if (info->dlpi_phdr[i].p_type == PT_NOTE)
+        _backtrace_module_build_id(module, info, &info->dlpi_phdr[i]);
+    }
+
+  return 1;
+}
+
+static DwarfHandle *
+_backtrace_module_load(const BacktraceModule *module, const gchar *path)
+{
+  const gchar *build_id = module->m_build_id[0] ? module->m_build_id : NULL;
+  DwarfHandle *res = NULL;
+  gchar *debug_file;
+
+  /* Separate debug information installed for the build id */
+  if (module->m_build_id[0])
+    {
+      debug_file = g_strdup_printf(BACKTRACE_DEBUG_DIR "/%.2s/%s.debug",
+                                   module->m_build_id, module->m_build_id + 2);
+      if (access(debug_file, R_OK) == 0)
+        res = dw_new_cached(debug_file, build_id, g_backtrace_symbol_cache);
+      g_free(debug_file);
+    }
+
+  if (!res)
+    res = dw_new_cached(path, build_id, g_backtrace_symbol_cache);
+
+  return res;
+}
+
+/* Line information of the module of 'addr' and its load bias */
+static DwarfHandle *
+_backtrace_module_dwarf(gpointer addr, guintptr *bias)
+{
+  BacktraceModule module;
+  const gchar *path;
+  gpointer key, value;
+  DwarfHandle *res;
+
+  _backtrace_init();
+
+  memset(&module, 0, sizeof(module));
+  module.m_addr = addr;
+  if (!dl_iterate_phdr(_backtrace_module_find, &module))
+    return NULL;
+
+  /* The executable has no name, the vdso has no file */
+  if (module.m_name && module.m_name[0] == '/')
+    path = module.m_name;
+  else if (!module.m_name || !module.m_name[0])
+    path = "/proc/self/exe";
+  else
+    return NULL;
+
+  *bias = module.m_bias;
+
+  pthread_mutex_lock(&g_backtrace_dwarf_lock);
+  if (g_hash_table_lookup_extended(g_backtrace_dwarf, module.m_build_id[0] ? module.m_build_id : path,
+                                   &key, &value))
+    {
+      pthread_mutex_unlock(&g_backtrace_dwarf_lock);
+      return (DwarfHandle *)value;
+    }
+
+  /* Loading only reads the unit ranges, done with the lock held so a
+   * module is not loaded twice */
+  res = _backtrace_module_load(&module, path);
+  g_hash_table_insert(g_backtrace_dwarf, g_strdup(module.m_build_id[0] ? module.m_build_id : path), res);
+  pthread_mutex_unlock(&g_backtrace_dwarf_lock);
+
+  return res;
+}
+
+static inline gboolean
+_backtrace_get_lineinfo(const BacktraceEntry *entry, const gchar **file, guint32 *lineno)
+{
+  DwarfHandle *dwarf;
+  DwarfEntry dw_entry;
+  guintptr bias;
+
+  if (!(dwarf = _backtrace_module_dwarf(entry->m_ptr, &bias)))
+    return FALSE;
+
+  if (!dw_lookup(dwarf, entry->m_ptr - bias, &dw_entry))
+    return FALSE;
+
+  *file = g_quark_to_string(dw_entry.m_source);
+  *lineno = dw_entry.m_lineno;
+  return TRUE;
+}
+
+/* Name of the function from the symbol table of its module, for the
+ * functions not exported */
+static inline gboolean
+_backtrace_get_symbol(gpointer addr, const gchar **name, gsize *offset)
+{
+  DwarfHandle *dwarf;
+  guintptr bias;
+
+  if (!(dwarf = _backtrace_module_dwarf(addr, &bias)))
+    return FALSE;
+
+  return dw_lookup_symbol(dwarf, addr - bias, name, offset);
+}
+#else
+#define _backtrace_init()
+#define _backtrace_get_symbol(addr, name, offset) FALSE
+#define g_demangler g_strdup
+#endif
+
+#define MAX_BUF_SIZE      4096
+
+/* Reference count of interned backtraces, which are never freed */
+#define BACKTRACE_REFCNT_INTERNED        -1
+
+struct _Backtrace
+{
+  gint                    m_refcnt;
+
+  guint32                 m_length;
+  gpointer               *m_symbols;
+};
+
+/*
+ * Backtrace store. Interned backtraces are kept in chunks indexed by
+ * their id (chunks are never moved, so looking up an id needs no
+ * locking) and an open addressing hash table maps the frames to the id.
+ *
+ * The hash table is read without locking as well: slots are only ever
+ * filled in, and when it grows the new table is published after it is
+ * fully built. The old tables are kept, a reader still probing one of
+ * them at worst misses and retries under the lock.
+ */
+#define BACKTRACE_STORE_CHUNK_SIZE       4096
+#define BACKTRACE_STORE_CHUNKS           1024
+#define BACKTRACE_STORE_MIN_SLOTS        1024
+
+typedef struct _BacktraceStoreEntry
+{
+  Backtrace               m_trace;
+  guint32                 m_hash;
+  gpointer                m_frames[];
+} BacktraceStoreEntry;
+
+typedef struct _BacktraceStoreTable
+{
+  guint32                 m_mask;
+  volatile guint32        m_slots[];
+} BacktraceStoreTable;
+
+static BacktraceStoreEntry **g_backtrace_store[BACKTRACE_STORE_CHUNKS];
+static BacktraceStoreTable *volatile g_backtrace_store_table = NULL;
+static volatile guint32 g_backtrace_store_count = 0;
+
+/* Only taken when a new backtrace is added. This is a pthread lock
+ * because the store is used from the interposed allocator. */
+static pthread_mutex_t g_backtrace_store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_backtrace_store_once = PTHREAD_ONCE_INIT;
+
+static Backtrace g_backtrace_empty = { BACKTRACE_REFCNT_INTERNED, 0, NULL };
+
+struct _DumpLogUserData
+{
+  gint                     m_priority;
+  const gchar             *m_prefix;
+};
+
+/*
+ * Symbol cache. Every address is resolved (dladdr(), demangling and the
+ * line lookup) only once, the results are kept for the lifetime of the
+ * process with their strings interned. Addresses dladdr() can not resolve
+ * are cached as well.
+ */
+typedef struct _BacktraceSymbol
+{
+  BacktraceEntry          m_entry;
+  gboolean                m_valid;
+
+  /* NULL if the line is unknown */
+  const gchar            *m_source;
+  guint32                 m_line;
+} BacktraceSymbol;
+
+static GHashTable *g_backtrace_symbols = NULL;
+static pthread_mutex_t g_backtrace_symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static BacktraceSymbol *
+_backtrace_symbol_resolve(const gpointer addr)
+{
+  BacktraceSymbol *res = g_new0(BacktraceSymbol, 1);
+  Dl_info info;
+  gchar *function = NULL;
+  gsize offset;
+
+  res->m_entry.m_ptr = addr;
+  if (dladdr(addr, &info) == 0)
+    return res;
+
+  res->m_valid = TRUE;
+  res->m_entry.m_offset = addr - info.dli_saddr;
+  if (!info.dli_sname && _backtrace_get_symbol(addr, &info.dli_sname, &offset))
+    res->m_entry.m_offset = offset;
+
+  if (info.dli_sname && (function = g_demangler(info.dli_sname)))
+    {
+      res->m_entry.m_function = (gchar *)g_intern_string(function);
+      g_free(function);
+    }
+  else
+    res->m_entry.m_function = (gchar *)g_intern_static_string("<unknown>");
+  res->m_entry.m_file = (gchar *)g_intern_string(info.dli_fname);
+
+  return res;
+}
+
+/* Add a resolved symbol to the cache. Symbols are resolved without
+ * holding the lock, the first result of racing threads is kept. */
+static BacktraceSymbol *
+_backtrace_symbol_store(BacktraceSymbol *symbol)
+{
+  BacktraceSymbol *res;
+
+  pthread_mutex_lock(&g_backtrace_symbols_lock);
+  if (!g_backtrace_symbols)
+    g_backtrace_symbols = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  res = (BacktraceSymbol *)g_hash_table_lookup(g_backtrace_symbols, symbol->m_entry.m_ptr);
+  if (!res)
+    {
+      g_hash_table_insert(g_backtrace_symbols, symbol->m_entry.m_ptr, symbol);
+      res = symbol;
+      symbol = NULL;
+    }
+  pthread_mutex_unlock(&g_backtrace_symbols_lock);
+
+  g_free(symbol);
+  return res;
+}
+
+static const BacktraceSymbol *
+_backtrace_symbol(const gpointer addr)
+{
+  BacktraceSymbol *res = NULL, *symbol;
+
+  if (!addr)
+    return NULL;
+
+  pthread_mutex_lock(&g_backtrace_symbols_lock);
+  if (g_backtrace_symbols)
+    res = (BacktraceSymbol *)g_hash_table_lookup(g_backtrace_symbols, addr);
+  pthread_mutex_unlock(&g_backtrace_symbols_lock);
+
+  if (res)
+    return res;
+
+  /* The cache is not a leak of the test resolving the frame */
+  tinu_leakwatch_suspend();
+
+  symbol = _backtrace_symbol_resolve(addr);
+#ifdef ELFDEBUG_ENABLED
+  if (!symbol->m_valid ||
+      !_backtrace_get_lineinfo(&symbol->m_entry, &symbol->m_source, &symbol->m_line))
+    symbol->m_source = NULL;
+#endif
+
+  res = _backtrace_symbol_store(symbol);
+  tinu_leakwatch_resume();
+  return res;
+}
+
+#ifdef ELFDEBUG_ENABLED
+/* Resolve the frames of a backtrace missing from the cache together, so
+ * their lines are looked up in a single pass over the line table */
+static void
+_backtrace_symbols_prefetch(const Backtrace *trace)
+{
+  BacktraceSymbol *symbol;
+  DwarfHandle **modules, *dwarf;
+  DwarfEntry *lines, *results;
+  gpointer *missing, *addrs;
+  guintptr *biases;
+  guint32 *group;
+  guint32 i, j, count = 0, grouped;
+
+  if (trace->m_length < 2)
+    return;
+
+  tinu_leakwatch_suspend();
+
+  missing = g_new(gpointer, trace->m_length);
+  pthread_mutex_lock(&g_backtrace_symbols_lock);
+  for (i = 0; i < trace->m_length; i++)
+    {
+      if (trace->m_symbols[i] &&
+          (!g_backtrace_symbols || !g_hash_table_lookup(g_backtrace_symbols, trace->m_symbols[i])))
+        missing[count++] = trace->m_symbols[i];
+    }
+  pthread_mutex_unlock(&g_backtrace_symbols_lock);
+
+  if (count)
+    {
+      modules = g_new(DwarfHandle *, count);
+      biases = g_new(guintptr, count);
+      addrs = g_new(gpointer, count);
+      group = g_new(guint32, count);
+      lines = g_new0(DwarfEntry, count);
+      results = g_new(DwarfEntry, count);
+
+      for (i = 0; i < count; i++)
+        modules[i] = _backtrace_module_dwarf(missing[i], &biases[i]);
+
+      /* One batch for the frames of each module */
+      for (i = 0; i < count; i++)
+        {
+          if (!(dwarf = modules[i]))
+            continue;
+
+          for (j = i, grouped = 0; j < count; j++)
+            {
+              if (modules[j] == dwarf)
+                {
+                  group[grouped] = j;
+                  addrs[grouped++] = missing[j] - biases[j];
+                  modules[j] = NULL;
+                }
+            }
+
+          dw_lookup_batch(dwarf, addrs, results, grouped);
+          for (j = 0; j < grouped; j++)
+            lines[group[j]] = results[j];
+        }
+
+      for (i = 0; i < count; i++)
+        {
+          symbol = _backtrace_symbol_resolve(missing[i]);
+          if (symbol->m_valid && lines[i].m_source)
+            {
+              symbol->m_source = g_quark_to_string(lines[i].m_source);
+              symbol->m_line = lines[i].m_lineno;
+            }
+
+          _backtrace_symbol_store(symbol);
+        }
+
+      g_free(modules);
+      g_free(biases);
+      g_free(addrs);
+      g_free(group);
+      g_free(lines);
+      g_free(results);
+    }
+
+  g_free(missing);
+  tinu_leakwatch_resume();
+}
+#else
+#define _backtrace_symbols_prefetch(trace)
+#endif
+
+static inline const BacktraceEntry *
+_backtrace_resolve_info(const gpointer addr)
+{
+  const BacktraceSymbol *symbol = _backtrace_symbol(addr);
+
+  return (symbol && symbol->m_valid ? &symbol->m_entry : NULL);
+}
+
+static void
+_backtrace_dump_log_callback(const BacktraceEntry *entry, gpointer user_data)
+{
+  struct _DumpLogUserData *self = (struct _DumpLogUserData *)user_data;
+  const gchar *src = NULL;
+  guint32 line = 0;
+
+  if (entry == BACKTRACE_ENTRY_INVALID)
+    {
+      log_format(self->m_priority, self->m_prefix,
+                msg_tag_str("error", "invalid frame"), NULL);
+      return;
+    }
+
+  backtrace_resolv_lines(entry, &src, &line);
+
+  log_format(self->m_priority, self->m_prefix,
+            msg_tag_str("function", entry->m_function),
+            msg_tag_str("file", entry->m_file),
+            msg_tag_hex("offset", entry->m_offset),
+            msg_tag_ptr("ptr", entry->m_ptr),
+            msg_tag_printf("location", "%s:%d", src, line), NULL);
+}
+
+struct _DumpFileUserData
+{
+  FILE                 *m_file;
+  gint                  m_indent;
+};
+
+static void
+_backtrace_dump_file_callback(const BacktraceEntry *entry, gpointer user_data)
+{
+  struct _DumpFileUserData *self = (struct _DumpFileUserData *)user_data;
+
+  const gchar *src = NULL;
+  guint32 line = 0;
+
+  if (entry == BACKTRACE_ENTRY_INVALID)
+    {
+      fprintf(self->m_file, "%*c<invalid frame>\n", self->m_indent, ' ');
+      return;
+    }
+
+  if (entry->m_function)
+    fprintf(self->m_file, "%*c%s\n", self->m_indent, ' ', entry->m_function);
+  else
+    fprintf(self->m_file, "%*c<file: %s>\n", self->m_indent, ' ', entry->m_file);
+
+  if (backtrace_resolv_lines(entry, &src, &line))
+    fprintf(self->m_file, "\tlocation: %s:%d\n", src, line);
+}
+
+/*
+ * Unwinders. The frame pointer and the .eh_frame unwinders walk the stack
+ * of the calling thread themselves and stop at the requested depth. They
+ * allocate no memory and take no locks, so they are async-signal-safe;
+ * the .eh_frame one only with _dl_find_object(), see
+ * _backtrace_cfi_eh_frame_hdr(). backtrace() of the C library is the
+ * portable default.
+ */
+static BacktraceUnwinder g_backtrace_unwinder = BACKTRACE_UNWINDER_LIBC;
+
+/* Frames walked into a buffer on the stack before falling back to the heap */
+#define BACKTRACE_STACK_FRAMES           128
+
+/* Sanity limit of the distance of two frames on the stack */
+#define BACKTRACE_MAX_FRAME_SIZE         (16 * 1024 * 1024)
+
+#if defined(__x86_64__) && defined(__linux__)
+#define BACKTRACE_NATIVE_UNWINDERS       1
+
+#include <link.h>
+#include <ucontext.h>
+
+typedef struct _BacktraceRegs
+{
+  guintptr                m_ip;
+  guintptr                m_sp;
+  guintptr                m_bp;
+
+  /* The instruction pointer is not a return address (innermost frame or
+   * a frame interrupted by a signal) */
+  gboolean                m_exact;
+} BacktraceRegs;
+
+/* Read the registers at the point of the macro */
+#define BACKTRACE_REGS_CURRENT(regs)                                    \
+  do {                                                                  \
+    __asm__ volatile("lea 0(%%rip), %0\n\t"                             \
+                     "mov %%rsp, %1\n\t"                                \
+                     "mov %%rbp, %2"                                    \
+                     : "=r"((regs).m_ip), "=r"((regs).m_sp), "=r"((regs).m_bp)); \
+    (regs).m_exact = TRUE;                                              \
+  } while (0)
+
+static inline gboolean
+_backtrace_frame_valid(guintptr from, guintptr to)
+{
+  return to > from && to - from <= BACKTRACE_MAX_FRAME_SIZE && (to & (sizeof(gpointer) - 1)) == 0;
+}
+
+/* Frame pointer chain, only complete in code built with
+ * -fno-omit-frame-pointer */
+static gint __attribute__((noinline))
+_backtrace_unwind_frame_pointer(gpointer *buffer, guint32 depth, guint32 skip)
+{
+  guintptr *frame = (guintptr *)__builtin_frame_address(0);
+  guintptr *next;
+  guint32 count = 0;
+
+  /* The first return address leads out of this function */
+  while (count < depth && frame[1] >= 4096)
+    {
+      if (skip)
+        skip--;
+      else
+        buffer[count++] = (gpointer)frame[1];
+
+      next = (guintptr *)frame[0];
+      if (!_backtrace_frame_valid((guintptr)frame, (guintptr)next))
+        break;
+      frame = next;
+    }
+
+  return count;
+}
+
+/*
+ * Call frame information (.eh_frame), see the DWARF standard and the LSB.
+ * Only what the x86-64 compilers emit for ordinary frames is supported:
+ * the CFA is computed from rsp or rbp, and rbp and the return address are
+ * saved relative to the CFA. Frames using DWARF expressions end the walk
+ * (except the signal trampoline, which is recognized by its code).
+ */
+#define DW_EH_PE_absptr                  0x00
+#define DW_EH_PE_uleb128                 0x01
+#define DW_EH_PE_udata2                  0x02
+#define DW_EH_PE_udata4                  0x03
+#define DW_EH_PE_udata8                  0x04
+#define DW_EH_PE_sleb128                 0x09
+#define DW_EH_PE_sdata2                  0x0a
+#define DW_EH_PE_sdata4                  0x0b
+#define DW_EH_PE_sdata8                  0x0c
+#define DW_EH_PE_pcrel                   0x10
+#define DW_EH_PE_datarel                 0x30
+#define DW_EH_PE_indirect                0x80
+#define DW_EH_PE_omit                    0xff
+
+#define DW_CFA_nop                       0x00
+#define DW_CFA_set_loc                   0x01
+#define DW_CFA_advance_loc1              0x02
+#define DW_CFA_advance_loc2              0x03
+#define DW_CFA_advance_loc4              0x04
+#define DW_CFA_offset_extended           0x05
+#define DW_CFA_restore_extended          0x06
+#define DW_CFA_undefined                 0x07
+#define DW_CFA_same_value                0x08
+#define DW_CFA_register                  0x09
+#define DW_CFA_remember_state            0x0a
+#define DW_CFA_restore_state             0x0b
+#define DW_CFA_def_cfa                   0x0c
+#define DW_CFA_def_cfa_register          0x0d
+#define DW_CFA_def_cfa_offset            0x0e
+#define DW_CFA_def_cfa_expression        0x0f
+#define DW_CFA_expression                0x10
+#define DW_CFA_offset_extended_sf        0x11
+#define DW_CFA_def_cfa_sf                0x12
+#define DW_CFA_def_cfa_offset_sf         0x13
+#define DW_CFA_val_offset                0x14
+#define DW_CFA_val_offset_sf             0x15
+#define DW_CFA_val_expression            0x16
+#define DW_CFA_GNU_args_size             0x2e
+#define DW_CFA_GNU_negative_offset_extended 0x2f
+#define DW_CFA_advance_loc               0x40
+#define DW_CFA_offset                    0x80
+#define DW_CFA_restore                   0xc0
+
+#define BACKTRACE_REG_RBP                6
+#define BACKTRACE_REG_RSP                7
+#define BACKTRACE_REG_RA                 16
+
+#define BACKTRACE_CFI_STATE_STACK        8
+
+typedef enum
+{
+  BACKTRACE_RULE_SAME,
+  BACKTRACE_RULE_UNDEFINED,
+  BACKTRACE_RULE_OFFSET,
+  BACKTRACE_RULE_VAL_OFFSET,
+  /* Anything else, the frame can not be unwound */
+  BACKTRACE_RULE_UNSUPPORTED
+} BacktraceRule;
+
+/* Unwinding rules of a range of instructions */
+typedef struct _BacktraceCfiRow
+{
+  guintptr                m_start;
+  guintptr                m_end;
+
+  guint8                  m_cfa_reg;
+  gboolean                m_cfa_valid;
+  gint64                  m_cfa_offset;
+
+  guint8                  m_bp_rule;
+  gint64                  m_bp_offset;
+  guint8                  m_ra_rule;
+  gint64                  m_ra_offset;
+} BacktraceCfiRow;
+
+/*
+ * Parsed rows are cached by the 16 byte block of the address they were
+ * looked up for, and reused for any address of the block the row covers
+ * (most of a function body is a single row). Slots are seqlocked: an
+ * odd sequence number means the slot is being written.
+ * Neither readers nor writers wait for it (they parse the FDE themselves
+ * or skip caching), so a signal handler interrupting a writer is fine.
+ */
+#define BACKTRACE_CFI_CACHE_SIZE         4096
+#define BACKTRACE_CFI_CACHE_SHIFT        4
+
+typedef struct _BacktraceCfiSlot
+{
+  volatile guint32        m_seq;
+  BacktraceCfiRow         m_row;
+} BacktraceCfiSlot;
+
+static BacktraceCfiSlot g_backtrace_cfi_cache[BACKTRACE_CFI_CACHE_SIZE];
+
+typedef struct _BacktraceCie
+{
+  const guint8           *m_instructions;
+  const guint8           *m_end;
+  guint64                 m_code_align;
+  gint64                  m_data_align;
+  guint64                 m_ra_reg;
+  guint8                  m_fde_encoding;
+  gboolean                m_augmented;
+} BacktraceCie;
+
+static inline guint64
+_backtrace_read_uleb128(const guint8 **p)
+{
+  guint64 res = 0;
+  guint shift = 0;
+  guint8 byte;
+
+  do
+    {
+      byte = *(*p)++;
+      if (shift < 64)
+        res |= (guint64)(byte & 0x7f) << shift;
+      shift += 7;
+    }
+  while (byte & 0x80);
+
+  return res;
+}
+
+static inline gint64
+_backtrace_read_sleb128(const guint8 **p)
+{
+  gint64 res = 0;
+  guint shift = 0;
+  guint8 byte;
+
+  do
+    {
+      byte = *(*p)++;
+      if (shift < 64)
+        res |= (gint64)(byte & 0x7f) << shift;
+      shift += 7;
+    }
+  while (byte & 0x80);
+
+  if (shift < 64 && (byte & 0x40))
+    res |= -((gint64)1 << shift);
+
+  return res;
+}
+
+/* End of a block prefixed with its length */
+static inline const guint8 *
+_backtrace_read_block(const guint8 **p)
+{
+  guint64 length = _backtrace_read_uleb128(p);
+
+  return *p + length;
+}
+
+/* Read an encoded pointer, FALSE if the encoding is not supported */
+static gboolean
+_backtrace_read_pointer(const guint8 **p, guint8 encoding, guintptr data_base, guintptr *result)
+{
+  const guint8 *start = *p;
+  guintptr value;
+
+  if (encoding == DW_EH_PE_omit)
+    return FALSE;
+
+  switch (encoding & 0x0f)
+    {
+      case DW_EH_PE_absptr :
+        memcpy(&value, *p, sizeof(value));
+        *p += sizeof(value);
+        break;
+
+      case DW_EH_PE_uleb128 :
+        value = _backtrace_read_uleb128(p);
+        break;
+
+      case DW_EH_PE_sleb128 :
+        value = _backtrace_read_sleb128(p);
+        break;
+
+      case DW_EH_PE_udata2 :
+        {
+          guint16 v;
+          memcpy(&v, *p, sizeof(v));
+          *p += sizeof(v);
+          value = v;
+        }
+        break;
+
+      case DW_EH_PE_sdata2 :
+        {
+          gint16 v;
+          memcpy(&v, *p, sizeof(v));
+          *p += sizeof(v);
+          value = v;
+        }
+        break;
+
+      case DW_EH_PE_udata4 :
+        {
+          guint32 v;
+          memcpy(&v, *p, sizeof(v));
+          *p += sizeof(v);
+          value = v;
+        }
+        break;
+
+      case DW_EH_PE_sdata4 :
+        {
+          gint32 v;
+          memcpy(&v, *p, sizeof(v));
+          *p += sizeof(v);
+          value = v;
+        }
+        break;
+
+      case DW_EH_PE_udata8 :
+      case DW_EH_PE_sdata8 :
+        memcpy(&value, *p, sizeof(value));
+        *p += sizeof(value);
+        break;
+
+      default :
+        return FALSE;
+    }
+
+  switch (encoding & 0x70)
+    {
+      case DW_EH_PE_absptr :
+        break;
+
+      case DW_EH_PE_pcrel :
+        value += (guintptr)start;
+        break;
+
+      case DW_EH_PE_datarel :
+        value += data_base;
+        break;
+
+      default :
+        return FALSE;
+    }
+
+  if (encoding & DW_EH_PE_indirect)
+    value = *(const guintptr *)value;
+
+  *result = value;
+  return TRUE;
+}
+
+/* Start of a CIE or FDE record, NULL at the terminator */
+static inline const guint8 *
+_backtrace_cfi_record(const guint8 *p, const guint8 **end)
+{
+  guint32 length;
+  guint64 length64;
+
+  memcpy(&length, p, sizeof(length));
+  p += sizeof(length);
+  if (length == 0)
+    return NULL;
+
+  if (length == 0xffffffff)
+    {
+      memcpy(&length64, p, sizeof(length64));
+      p += sizeof(length64);
+      *end = p + length64;
+    }
+  else
+    *end = p + length;
+
+  return p;
+}
+
+static gboolean
+_backtrace_cfi_parse_cie(const guint8 *p, BacktraceCie *cie)
+{
+  const guint8 *augmentation;
+  const guint8 *aug_end = NULL;
+  guintptr personality;
+  guint32 id;
+  guint8 version;
+
+  if (!(p = _backtrace_cfi_record(p, &cie->m_end)))
+    return FALSE;
+
+  memcpy(&id, p, sizeof(id));
+  p += sizeof(id);
+  if (id != 0)
+    return FALSE;
+
+  version = *p++;
+  augmentation = p;
+  p += strlen((const gchar *)p) + 1;
+
+  /* The obsolete "eh" augmentation carries data we can not skip */
+  if (augmentation[0] == 'e' && augmentation[1] == 'h')
+    return FALSE;
+
+  cie->m_code_align = _backtrace_read_uleb128(&p);
+  cie->m_data_align = _backtrace_read_sleb128(&p);
+  cie->m_ra_reg = (version == 1 ? *p++ : _backtrace_read_uleb128(&p));
+  cie->m_fde_encoding = DW_EH_PE_absptr;
+  cie->m_augmented = (augmentation[0] == 'z');
+
+  if (cie->m_augmented)
+    {
+      aug_end = _backtrace_read_block(&p);
+
+      for (augmentation++; *augmentation; augmentation++)
+        {
+          switch (*augmentation)
+            {
+              case 'R' :
+                cie->m_fde_encoding = *p++;
+                break;
+
+              case 'P' :
+                {
+                  guint8 encoding = *p++;
+
+                  if (!_backtrace_read_pointer(&p, encoding & ~DW_EH_PE_indirect, 0, &personality))
+                    p = aug_end;
+                }
+                break;
+
+              case 'L' :
+                p++;
+                break;
+
+              default :
+                /* 'S' and the unknown ones, the length is known anyway */
+                break;
+            }
+        }
+
+      p = aug_end;
+    }
+
+  cie->m_instructions = p;
+  return TRUE;
+}
+
+typedef struct _BacktraceCfiState
+{
+  guint8                  m_cfa_reg;
+  gboolean                m_cfa_valid;
+  gint64                  m_cfa_offset;
+  guint8                  m_bp_rule;
+  gint64                  m_bp_offset;
+  guint8                  m_ra_rule;
+  gint64                  m_ra_offset;
+} BacktraceCfiState;
+
+static inline void
+_backtrace_cfi_set_rule(const BacktraceCie *cie, BacktraceCfiState *state,
+                        guint64 reg, guint8 rule, gint64 offset)
+{
+  if (reg == BACKTRACE_REG_RBP)
+    {
+      state->m_bp_rule = rule;
+      state->m_bp_offset = offset;
+    }
+  else if (reg == cie->m_ra_reg)
+    {
+      state->m_ra_rule = rule;
+      state->m_ra_offset = offset;
+    }
+}
+
+static inline void
+_backtrace_cfi_restore_rule(const BacktraceCie *cie, BacktraceCfiState *state,
+                            const BacktraceCfiState *initial, guint64 reg)
+{
+  if (reg == BACKTRACE_REG_RBP)
+    {
+      state->m_bp_rule = initial->m_bp_rule;
+      state->m_bp_offset = initial->m_bp_offset;
+    }
+  else if (reg == cie->m_ra_reg)
+    {
+      state->m_ra_rule = initial->m_ra_rule;
+      state->m_ra_offset = initial->m_ra_offset;
+    }
+}
+
+/* Run the instructions up to the row of 'pc'. 'loc' is the address of
+ * the current row, '*next' is lowered to the start of the next row. */
+static gboolean
+_backtrace_cfi_execute(const BacktraceCie *cie, const guint8 *p, const guint8 *end,
+                       guintptr pc, guintptr *loc, guintptr *next,
+                       BacktraceCfiState *state, const BacktraceCfiState *initial)
+{
+  BacktraceCfiState stack[BACKTRACE_CFI_STATE_STACK];
+  guint32 depth = 0;
+  guint64 reg, delta;
+  guint8 op;
+
+  while (p < end)
+    {
+      op = *p++;
+      delta = 0;
+
+      switch (op & 0xc0)
+        {
+          case DW_CFA_advance_loc :
+            delta = (op & 0x3f) * cie->m_code_align;
+            goto advance;
+
+          case DW_CFA_offset :
+            _backtrace_cfi_set_rule(cie, state, op & 0x3f, BACKTRACE_RULE_OFFSET,
+                                    _backtrace_read_uleb128(&p) * cie->m_data_align);
+            continue;
+
+          case DW_CFA_restore :
+            if (!initial)
+              return FALSE;
+            _backtrace_cfi_restore_rule(cie, state, initial, op & 0x3f);
+            continue;
+        }
+
+      switch (op)
+        {
+          case DW_CFA_nop :
+            continue;
+
+          case DW_CFA_GNU_args_size :
+            _backtrace_read_uleb128(&p);
+            continue;
+
+          case DW_CFA_set_loc :
+            {
+              guintptr target;
+
+              if (!_backtrace_read_pointer(&p, cie->m_fde_encoding, 0, &target) || target < *loc)
+                return FALSE;
+              delta = target - *loc;
+            }
+            goto advance;
+
+          case DW_CFA_advance_loc1 :
+            delta = *p++ * cie->m_code_align;
+            goto advance;
+
+          case DW_CFA_advance_loc2 :
+            {
+              guint16 v;
+              memcpy(&v, p, sizeof(v));
+              p += sizeof(v);
+              delta = v * cie->m_code_align;
+            }
+            goto advance;
+
+          case DW_CFA_advance_loc4 :
+            {
+              guint32 v;
+              memcpy(&v, p, sizeof(v));
+              p += sizeof(v);
+              delta = v * cie->m_code_align;
+            }
+            goto advance;
+
+          case DW_CFA_offset_extended :
+            reg = _backtrace_read_uleb128(&p);
+            _backtrace_cfi_set_rule(cie, state, reg, BACKTRACE_RULE_OFFSET,
+                                    _backtrace_read_uleb128(&p) * cie->m_data_align);
+            continue;
+
+          case DW_CFA_offset_extended_sf :
+            reg = _backtrace_read_uleb128(&p);
+            _backtrace_cfi_set_rule(cie, state, reg, BACKTRACE_RULE_OFFSET,
+                                    _backtrace_read_sleb128(&p) * cie->m_data_align);
+            continue;
+
+          case DW_CFA_GNU_negative_offset_extended :
+            reg = _backtrace_read_uleb128(&p);
+            _backtrace_cfi_set_rule(cie, state, reg, BACKTRACE_RULE_OFFSET,
+                                    -(gint64)_backtrace_read_uleb128(&p) * cie->m_data_align);
+            continue;
+
+          case DW_CFA_val_offset :
+            reg = _backtrace_read_uleb128(&p);
+            _backtrace_cfi_set_rule(cie, state, reg, BACKTRACE_RULE_VAL_OFFSET,
+                                    _backtrace_read_uleb128(&p) * cie->m_data_align);
+            continue;
+
+          case DW_CFA_val_offset_sf :
+            reg = _backtrace_read_uleb128(&p);
+            _backtrace_cfi_set_rule(cie, state, reg, BACKTRACE_RULE_VAL_OFFSET,
+                                    _backtrace_read_sleb128(&p) * cie->m_data_align);
+            continue;
+
+          case DW_CFA_restore_extended :
+            if (!initial)
+              return FALSE;
+            _backtrace_cfi_restore_rule(cie, state, initial, _backtrace_read_uleb128(&p));
+            continue;
+
+          case DW_CFA_undefined :
+            _backtrace_cfi_set_rule(cie, state, _backtrace_read_uleb128(&p), BACKTRACE_RULE_UNDEFINED, 0);
+            continue;
+
+          case DW_CFA_same_value :
+            _backtrace_cfi_set_rule(cie, state, _backtrace_read_uleb128(&p), BACKTRACE_RULE_SAME, 0);
+            continue;
+
+          case DW_CFA_register :
+            reg = _backtrace_read_uleb128(&p);
+            _backtrace_read_uleb128(&p);
+            _backtrace_cfi_set_rule(cie, state, reg, BACKTRACE_RULE_UNSUPPORTED, 0);
+            continue;
+
+          case DW_CFA_expression :
+          case DW_CFA_val_expression :
+            reg = _backtrace_read_uleb128(&p);
+            p = _backtrace_read_block(&p);
+            _backtrace_cfi_set_rule(cie, state, reg, BACKTRACE_RULE_UNSUPPORTED, 0);
+            continue;
+
+          case DW_CFA_remember_state :
+            if (depth == BACKTRACE_CFI_STATE_STACK)
+              return FALSE;
+            stack[depth++] = *state;
+            continue;
+
+          case DW_CFA_restore_state :
+            if (depth == 0)
+              return FALSE;
+            *state = stack[--depth];
+            continue;
+
+          case DW_CFA_def_cfa :
+            state->m_cfa_reg = _backtrace_read_uleb128(&p);
+            state->m_cfa_offset = _backtrace_read_uleb128(&p);
+            state->m_cfa_valid = TRUE;
+            continue;
+
+          case DW_CFA_def_cfa_sf :
+            state->m_cfa_reg = _backtrace_read_uleb128(&p);
+            state->m_cfa_offset = _backtrace_read_sleb128(&p) * cie->m_data_align;
+            state->m_cfa_valid = TRUE;
+            continue;
+
+          case DW_CFA_def_cfa_register :
+            state->m_cfa_reg = _backtrace_read_uleb128(&p);
+            continue;
+
+          case DW_CFA_def_cfa_offset :
+            state->m_cfa_offset = _backtrace_read_uleb128(&p);
+            continue;
+
+          case DW_CFA_def_cfa_offset_sf :
+            state->m_cfa_offset = _backtrace_read_sleb128(&p) * cie->m_data_align;
+            continue;
+
+          case DW_CFA_def_cfa_expression :
+            p = _backtrace_read_block(&p);
+            state->m_cfa_valid = FALSE;
+            continue;
+
+          default :
+            return FALSE;
+        }
+
+advance:
+      if (*loc + delta > pc)
+        {
+          *next = MIN(*next, *loc + delta);
+          return TRUE;
+        }
+      *loc += delta;
+    }
+
+  return TRUE;
+}
+
+/* Find the FDE of 'pc' using the binary search table of .eh_frame_hdr */
+static const guint8 *
+_backtrace_cfi_find_fde(const guint8 *hdr, guintptr pc)
+{
+  const guint8 *p = hdr + 4;
+  const gint32 *table;
+  guintptr eh_frame, count;
+  gsize low, high, mid;
 
-extern const gchar *g_runtime_name;
+  /* Version 1 with a table of signed 32 bit offsets from the header */
+  if (hdr[0] != 1 || hdr[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4))
+    return NULL;
 
-gchar *(*g_demangler)(const gchar *function) = g_strdup;
+  if (!_backtrace_read_pointer(&p, hdr[1], (guintptr)hdr, &eh_frame) ||
+      !_backtrace_read_pointer(&p, hdr[2], (guintptr)hdr, &count) ||
+      count == 0)
+    return NULL;
 
-static void
-_backtrace_cleanup()
-{
-  dw_destroy(g_backtrace_dwarf);
+  table = (const gint32 *)p;
+  low = 0;
+  high = count;
+  while (high - low > 1)
+    {
+      mid = (low + high) / 2;
+      if ((guintptr)hdr + table[mid * 2] <= pc)
+        low = mid;
+      else
+        high = mid;
+    }
+
+  if ((guintptr)hdr + table[low * 2] > pc)
+    return NULL;
+
+  return hdr + table[low * 2 + 1];
 }
 
-static inline void
-_backtrace_init()
+static const guint8 *
+_backtrace_cfi_eh_frame_hdr(guintptr pc)
 {
-  if (!g_backtrace_init)
-    {
-      g_backtrace_init = TRUE;
-      g_backtrace_dwarf = dw_new(g_runtime_name);
+#ifdef HAVE__DL_FIND_OBJECT
+  struct dl_find_object object;
 
-      atexit(_backtrace_cleanup);
+  if (_dl_find_object((void *)pc, &object) != 0)
+    return NULL;
+
+  return (const guint8 *)object.dlfo_eh_frame;
+#else
+  /* dladdr() takes the loader lock, not async-signal-safe */
+  const ElfW(Phdr) *phdr;
+  Dl_info dlinfo;
+  ElfW(Ehdr) *ehdr;
+  gint i;
+
+  if (!dladdr((void *)pc, &dlinfo) || !dlinfo.dli_fbase)
+    return NULL;
+
+  ehdr = (ElfW(Ehdr) *)dlinfo.dli_fbase;
+  phdr = (const ElfW(Phdr) *)((const guint8 *)ehdr + ehdr->e_phoff);
+  for (i = 0; i < ehdr->e_phnum; i++)
+    {
+      if (phdr[i].p_type == PT_GNU_EH_FRAME)
+        {
+          /* Executables linked at a fixed address have no load bias */
+          if (ehdr->e_type == ET_EXEC)
+            return (const guint8 *)phdr[i].p_vaddr;
+          return (const guint8 *)dlinfo.dli_fbase + phdr[i].p_vaddr;
+        }
     }
+
+  return NULL;
+#endif
 }
 
-static inline gboolean
-_backtrace_get_lineinfo(const BacktraceEntry *entry, const gchar **file, guint32 *lineno)
+static gboolean
+_backtrace_cfi_parse(guintptr pc, BacktraceCfiRow *row)
 {
-  const DwarfEntry *dw_entry;
+  const guint8 *hdr, *fde, *p, *end;
+  BacktraceCfiState state, initial;
+  BacktraceCie cie;
+  guintptr start, range, loc;
+  gint32 cie_offset;
+
+  if (!(hdr = _backtrace_cfi_eh_frame_hdr(pc)) ||
+      !(fde = _backtrace_cfi_find_fde(hdr, pc)) ||
+      !(p = _backtrace_cfi_record(fde, &end)))
+    return FALSE;
+
+  memcpy(&cie_offset, p, sizeof(cie_offset));
+  if (cie_offset == 0 || !_backtrace_cfi_parse_cie(p - cie_offset, &cie))
+    return FALSE;
+  p += sizeof(cie_offset);
+
+  if (!_backtrace_read_pointer(&p, cie.m_fde_encoding, 0, &start) ||
+      !_backtrace_read_pointer(&p, cie.m_fde_encoding & 0x0f, 0, &range))
+    return FALSE;
 
-  if (!g_backtrace_dwarf)
+  if (pc < start || pc >= start + range)
     return FALSE;
 
-  dw_entry = dw_lookup(g_backtrace_dwarf, entry->m_ptr, 0x30);
+  if (cie.m_augmented)
+    p = _backtrace_read_block(&p);
+
+  memset(&state, 0, sizeof(state));
+  state.m_bp_rule = BACKTRACE_RULE_SAME;
+  state.m_ra_rule = BACKTRACE_RULE_UNDEFINED;
 
-  if (!dw_entry)
+  /* The initial instructions apply to the whole FDE */
+  loc = start;
+  row->m_end = start + range;
+  if (!_backtrace_cfi_execute(&cie, cie.m_instructions, cie.m_end, G_MAXUINT64 / 2, &loc, &row->m_end,
+                              &state, NULL))
     return FALSE;
 
-  *file = g_quark_to_string(dw_entry->m_source);
-  *lineno = dw_entry->m_lineno;
+  initial = state;
+  loc = start;
+  if (!_backtrace_cfi_execute(&cie, p, end, pc, &loc, &row->m_end, &state, &initial))
+    return FALSE;
+
+  row->m_start = loc;
+  row->m_cfa_reg = state.m_cfa_reg;
+  row->m_cfa_valid = state.m_cfa_valid;
+  row->m_cfa_offset = state.m_cfa_offset;
+  row->m_bp_rule = state.m_bp_rule;
+  row->m_bp_offset = state.m_bp_offset;
+  row->m_ra_rule = state.m_ra_rule;
+  row->m_ra_offset = state.m_ra_offset;
   return TRUE;
 }
-#else
-#define _backtrace_init()
-#define g_demangler g_strdup
-#endif
-
-#define MAX_BUF_SIZE      4096
 
-struct _Backtrace
+static gboolean
+_backtrace_cfi_row(guintptr pc, BacktraceCfiRow *row)
 {
-  gint                    m_refcnt;
+  guintptr block = pc >> BACKTRACE_CFI_CACHE_SHIFT;
+  BacktraceCfiSlot *slot = &g_backtrace_cfi_cache[(block * 0x9e3779b97f4a7c15ULL) >> 52];
+  guint32 seq = __atomic_load_n(&slot->m_seq, __ATOMIC_ACQUIRE);
 
-  guint32                 m_length;
-  gpointer               *m_symbols;
-};
+  if (!(seq & 1))
+    {
+      *row = slot->m_row;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->m_seq, __ATOMIC_RELAXED) == seq &&
+          row->m_start <= pc && pc < row->m_end)
+        return TRUE;
+    }
 
-struct _DumpLogUserData
+  if (!_backtrace_cfi_parse(pc, row))
+    return FALSE;
+
+  /* Skip caching if someone else is writing the slot */
+  seq = __atomic_load_n(&slot->m_seq, __ATOMIC_RELAXED);
+  if (!(seq & 1) && __atomic_compare_exchange_n(&slot->m_seq, &seq, seq + 1, FALSE,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+      slot->m_row = *row;
+      __atomic_store_n(&slot->m_seq, seq + 2, __ATOMIC_RELEASE);
+    }
+
+  return TRUE;
+}
+
+/* The rt_sigreturn trampoline: mov $15, %rax; syscall */
+static inline gboolean
+_backtrace_cfi_signal_frame(BacktraceRegs *regs)
 {
-  gint                     m_priority;
-  const gchar             *m_prefix;
-};
+  static const guint8 code[] = { 0x48, 0xc7, 0xc0, 0x0f, 0x00, 0x00, 0x00, 0x0f, 0x05 };
+  const ucontext_t *uc;
 
-static BacktraceEntry *
-_backtrace_resolve_info(const gpointer addr)
+  if (memcmp((const void *)regs->m_ip, code, sizeof(code)) != 0)
+    return FALSE;
+
+  /* The ucontext follows the popped return address of the handler */
+  uc = (const ucontext_t *)regs->m_sp;
+  regs->m_ip = uc->uc_mcontext.gregs[REG_RIP];
+  regs->m_sp = uc->uc_mcontext.gregs[REG_RSP];
+  regs->m_bp = uc->uc_mcontext.gregs[REG_RBP];
+  regs->m_exact = TRUE;
+  return TRUE;
+}
+
+/* Step to the caller of the frame */
+static gboolean
+_backtrace_cfi_step(BacktraceRegs *regs)
 {
-  Dl_info info;
-  BacktraceEntry *res = NULL;
+  BacktraceCfiRow row;
+  guintptr cfa, lookup;
+
+  /* Return addresses point after the call, which may be the first
+   * instruction of another row (or function) */
+  lookup = (regs->m_exact ? regs->m_ip : regs->m_ip - 1);
+  if (!_backtrace_cfi_row(lookup, &row))
+    return regs->m_exact == FALSE && _backtrace_cfi_signal_frame(regs);
+
+  /* The signal trampoline describes its frame with expressions */
+  if (!row.m_cfa_valid || row.m_ra_rule == BACKTRACE_RULE_UNSUPPORTED)
+    return _backtrace_cfi_signal_frame(regs);
+
+  if (row.m_cfa_reg == BACKTRACE_REG_RSP)
+    cfa = regs->m_sp + row.m_cfa_offset;
+  else if (row.m_cfa_reg == BACKTRACE_REG_RBP)
+    cfa = regs->m_bp + row.m_cfa_offset;
+  else
+    return FALSE;
 
-  if (!addr)
-    return NULL;
+  if (row.m_ra_rule != BACKTRACE_RULE_OFFSET || !_backtrace_frame_valid(regs->m_sp, cfa))
+    return FALSE;
 
-  if (dladdr(addr, &info) != 0);
+  switch (row.m_bp_rule)
     {
-      res = g_new0(BacktraceEntry, 1);
+      case BACKTRACE_RULE_SAME :
+        break;
 
-      res->m_ptr = addr;
-      res->m_offset = addr - info.dli_saddr;
-      if (info.dli_sname)
-        res->m_function = g_demangler(info.dli_sname);
-      if (!res->m_function)
-        res->m_function = g_strdup("<unknown>");
-      res->m_file = g_strdup(info.dli_fname);
+      case BACKTRACE_RULE_OFFSET :
+        regs->m_bp = *(const guintptr *)(cfa + row.m_bp_offset);
+        break;
+
+      case BACKTRACE_RULE_VAL_OFFSET :
+        regs->m_bp = cfa + row.m_bp_offset;
+        break;
+
+      default :
+        return FALSE;
     }
-  return res;
+
+  regs->m_ip = *(const guintptr *)(cfa + row.m_ra_offset);
+  regs->m_sp = cfa;
+  regs->m_exact = FALSE;
+  return regs->m_ip >= 4096;
 }
 
-static void
-_backtrace_dump_log_callback(const BacktraceEntry *entry, gpointer user_data)
+static gint __attribute__((noinline))
+_backtrace_unwind_eh_frame(gpointer *buffer, guint32 depth, guint32 skip)
 {
-  struct _DumpLogUserData *self = (struct _DumpLogUserData *)user_data;
-  const gchar *src = NULL;
-  guint32 line = 0;
+  BacktraceRegs regs;
+  guint32 count = 0;
 
-  if (entry == BACKTRACE_ENTRY_INVALID)
+  BACKTRACE_REGS_CURRENT(regs);
+
+  /* The first step leaves this function */
+  while (count < depth && _backtrace_cfi_step(&regs))
     {
-      log_format(self->m_priority, self->m_prefix,
-                msg_tag_str("error", "invalid frame"), NULL);
-      return;
+      if (skip)
+        skip--;
+      else
+        buffer[count++] = (gpointer)regs.m_ip;
     }
 
-  backtrace_resolv_lines(entry, &src, &line);
+  return count;
+}
 
-  log_format(self->m_priority, self->m_prefix,
-            msg_tag_str("function", entry->m_function),
-            msg_tag_str("file", entry->m_file),
-            msg_tag_hex("offset", entry->m_offset),
-            msg_tag_ptr("ptr", entry->m_ptr),
-            msg_tag_printf("location", "%s:%d", src, line), NULL);
+#endif
+
+static gint __attribute__((noinline))
+_backtrace_unwind_libc(gpointer *buffer, guint32 depth, guint32 skip)
+{
+  gpointer frames[BACKTRACE_STACK_FRAMES];
+  gpointer *all = frames;
+  gint count;
+
+  /* backtrace() includes this function */
+  skip++;
+  if (depth + skip > BACKTRACE_STACK_FRAMES)
+    all = g_new(gpointer, depth + skip);
+
+  count = backtrace(all, depth + skip) - skip;
+  if (count > 0)
+    memcpy(buffer, all + skip, count * sizeof(gpointer));
+
+  if (all != frames)
+    g_free(all);
+
+  return MAX(count, 0);
 }
 
-struct _DumpFileUserData
+gboolean
+backtrace_set_unwinder(BacktraceUnwinder unwinder)
 {
-  FILE                 *m_file;
-  gint                  m_indent;
-};
+#ifdef BACKTRACE_NATIVE_UNWINDERS
+  if (unwinder != BACKTRACE_UNWINDER_LIBC &&
+      unwinder != BACKTRACE_UNWINDER_FRAME_POINTER &&
+      unwinder != BACKTRACE_UNWINDER_EH_FRAME)
+    return FALSE;
+#else
+  if (unwinder != BACKTRACE_UNWINDER_LIBC)
+    return FALSE;
+#endif
 
-static void
-_backtrace_dump_file_callback(const BacktraceEntry *entry, gpointer user_data)
+  g_backtrace_unwinder = unwinder;
+  return TRUE;
+}
+
+BacktraceUnwinder
+backtrace_get_unwinder(void)
 {
-  struct _DumpFileUserData *self = (struct _DumpFileUserData *)user_data;
+  return g_backtrace_unwinder;
+}
 
-  const gchar *src = NULL;
-  guint32 line = 0;
+void
+backtrace_set_symbol_cache(const gchar *dir)
+{
+#ifdef ELFDEBUG_ENABLED
+  g_free(g_backtrace_symbol_cache);
+  g_backtrace_symbol_cache = g_strdup(dir);
+#endif
+}
 
-  if (entry == BACKTRACE_ENTRY_INVALID)
+gint __attribute__((noinline))
+backtrace_unwind(gpointer *buffer, guint32 depth, guint32 skip)
+{
+  gint res;
+
+  /* The unwinders start with the return address into this function */
+  skip++;
+  switch (g_backtrace_unwinder)
     {
-      fprintf(self->m_file, "%*c<invalid frame>\n", self->m_indent, ' ');
-      return;
-    }
+#ifdef BACKTRACE_NATIVE_UNWINDERS
+      case BACKTRACE_UNWINDER_FRAME_POINTER :
+        res = _backtrace_unwind_frame_pointer(buffer, depth, skip);
+        break;
+
+      case BACKTRACE_UNWINDER_EH_FRAME :
+        res = _backtrace_unwind_eh_frame(buffer, depth, skip);
+        break;
+#endif
 
-  if (entry->m_function)
-    fprintf(self->m_file, "%*c%s\n", self->m_indent, ' ', entry->m_function);
-  else
-    fprintf(self->m_file, "%*c<file: %s>\n", self->m_indent, ' ', entry->m_file);
+      default :
+        res = _backtrace_unwind_libc(buffer, depth, skip);
+        break;
+    }
 
-  if (backtrace_resolv_lines(entry, &src, &line))
-    fprintf(self->m_file, "\tlocation: %s:%d\n", src, line);
+  /* Keep this frame out of tail call optimization */
+  __asm__ volatile("" ::: "memory");
+  return res;
 }
 
+const NameTable BacktraceUnwinder_names[] =
+{
+  { BACKTRACE_UNWINDER_LIBC,          "libc",          4 },
+  { BACKTRACE_UNWINDER_FRAME_POINTER, "frame-pointer", 13 },
+  { BACKTRACE_UNWINDER_EH_FRAME,      "eh-frame",      8 },
+  { 0,                                NULL,            0 }
+};
+
 Backtrace *
 backtrace_create(guint32 skip)
 {
@@ -195,8 +1589,9 @@ backtrace_create(guint32 skip)
 Backtrace *
 backtrace_create_depth(guint32 depth, guint32 skip)
 {
-  gpointer buffer[MAX_DEPTH + 1];
-  guint32 nptr;
+  gpointer frames[BACKTRACE_STACK_FRAMES];
+  gpointer *buffer = frames;
+  gint nptr;
   Backtrace *res;
 
   _backtrace_init();
@@ -206,17 +1601,18 @@ backtrace_create_depth(guint32 depth, guint32 skip)
       log_warn("Requested depth exceeded maximum depth",
                 msg_tag_int("depth", depth),
                 msg_tag_int("skip", skip), NULL);
+      depth = MAX_DEPTH;
     }
 
-  if ((nptr = backtrace(buffer, MAX_DEPTH)) == -1)
+  /* Only walk as many frames as needed, on the heap only for deep stacks */
+  nptr = backtrace_unwind(frames, MIN(depth, BACKTRACE_STACK_FRAMES), skip);
+  if (nptr == BACKTRACE_STACK_FRAMES && depth > BACKTRACE_STACK_FRAMES)
     {
-      log_error("Could not create backtrace object",
-                msg_tag_int("depth", depth),
-                msg_tag_int("skip", skip), NULL);
-      return NULL;
+      buffer = g_new(gpointer, depth);
+      nptr = backtrace_unwind(buffer, depth, skip);
     }
 
-  if (nptr <= skip)
+  if (nptr <= 0)
     {
       log_warn("Backtrace empty",
                 msg_tag_int("depth", depth),
@@ -227,14 +1623,18 @@ backtrace_create_depth(guint32 depth, guint32 skip)
       res->m_refcnt = 1;
       res->m_length = 0;
       res->m_symbols = NULL;
-      return res;
+    }
+  else
+    {
+      res = t_new(Backtrace, 1);
+      res->m_refcnt = 1;
+      res->m_length = nptr;
+      res->m_symbols = g_new0(gpointer, nptr);
+      memcpy(res->m_symbols, buffer, nptr * sizeof(gpointer));
     }
 
-  res = t_new(Backtrace, 1);
-  res->m_refcnt = 1;
-  res->m_length = nptr - skip;
-  res->m_symbols = g_new0(gpointer, nptr - skip);
-  memcpy(res->m_symbols, buffer + skip, (nptr - skip) * sizeof(gpointer));
+  if (buffer != frames)
+    g_free(buffer);
 
   return res;
 }
@@ -242,25 +1642,239 @@ backtrace_create_depth(guint32 depth, guint32 skip)
 Backtrace *
 backtrace_reference(Backtrace *self)
 {
-  self->m_refcnt++;
+  if (self->m_refcnt != BACKTRACE_REFCNT_INTERNED)
+    g_atomic_int_inc(&self->m_refcnt);
   return self;
 }
 
 void
 backtrace_unreference(Backtrace *self)
 {
-  if (!self)
+  if (!self || self->m_refcnt == BACKTRACE_REFCNT_INTERNED)
     return;
 
-  self->m_refcnt--;
-
-  if (self->m_refcnt == 0)
+  if (g_atomic_int_dec_and_test(&self->m_refcnt))
     {
       t_free(self->m_symbols);
       t_free(self);
     }
 }
 
+static guint32
+_backtrace_store_hash(gpointer *frames, guint32 length)
+{
+  guint64 hash = length;
+  guint32 i;
+
+  for (i = 0; i < length; i++)
+    {
+      hash ^= (guint64)(gsize)frames[i];
+      hash *= G_GUINT64_CONSTANT(0x9E3779B97F4A7C15);
+      hash ^= hash >> 29;
+    }
+
+  return (guint32)(hash ^ (hash >> 32));
+}
+
+static inline BacktraceStoreEntry *
+_backtrace_store_get(BacktraceId id)
+{
+  return g_backtrace_store[(id - 1) / BACKTRACE_STORE_CHUNK_SIZE][(id - 1) % BACKTRACE_STORE_CHUNK_SIZE];
+}
+
+static BacktraceId
+_backtrace_store_find(BacktraceStoreTable *table, guint32 hash, gpointer *frames, guint32 length,
+                      guint32 *slot)
+{
+  BacktraceStoreEntry *entry;
+  BacktraceId id;
+  guint32 i;
+
+  for (i = hash & table->m_mask; ; i = (i + 1) & table->m_mask)
+    {
+      id = g_atomic_int_get(&table->m_slots[i]);
+      if (id == BACKTRACE_ID_NONE)
+        break;
+
+      entry = _backtrace_store_get(id);
+      if (entry->m_hash == hash && entry->m_trace.m_length == length &&
+          memcmp(entry->m_frames, frames, length * sizeof(gpointer)) == 0)
+        break;
+    }
+
+  if (slot)
+    *slot = i;
+  return id;
+}
+
+static BacktraceStoreTable *
+_backtrace_store_table_new(guint32 size)
+{
+  BacktraceStoreTable *res = (BacktraceStoreTable *)
+    g_malloc0(sizeof(BacktraceStoreTable) + size * sizeof(guint32));
+
+  res->m_mask = size - 1;
+  return res;
+}
+
+/* Must be called with the store locked */
+static void
+_backtrace_store_grow(void)
+{
+  BacktraceStoreTable *old = g_backtrace_store_table;
+  BacktraceStoreTable *table;
+  BacktraceStoreEntry *entry;
+  guint32 slot, i;
+
+  table = _backtrace_store_table_new(old ? (old->m_mask + 1) * 2 : BACKTRACE_STORE_MIN_SLOTS);
+
+  for (i = 1; i <= g_backtrace_store_count; i++)
+    {
+      entry = _backtrace_store_get(i);
+      _backtrace_store_find(table, entry->m_hash, entry->m_frames, entry->m_trace.m_length, &slot);
+      table->m_slots[slot] = i;
+    }
+
+  g_atomic_pointer_set(&g_backtrace_store_table, table);
+}
+
+static void
+_backtrace_store_atfork_prepare(void)
+{
+  pthread_mutex_lock(&g_backtrace_store_lock);
+}
+
+static void
+_backtrace_store_atfork_release(void)
+{
+  pthread_mutex_unlock(&g_backtrace_store_lock);
+}
+
+static void
+_backtrace_store_init(void)
+{
+  pthread_atfork(_backtrace_store_atfork_prepare,
+                 _backtrace_store_atfork_release, _backtrace_store_atfork_release);
+}
+
+static BacktraceId
+_backtrace_store_insert(guint32 hash, gpointer *frames, guint32 length)
+{
+  BacktraceStoreEntry *entry;
+  BacktraceId id;
+  guint32 slot;
+
+  pthread_once(&g_backtrace_store_once, _backtrace_store_init);
+
+  /* The store is shared by the whole process, not owned by a test */
+  tinu_leakwatch_suspend();
+  pthread_mutex_lock(&g_backtrace_store_lock);
+
+  if (!g_backtrace_store_table)
+    _backtrace_store_grow();
+
+  id = _backtrace_store_find(g_backtrace_store_table, hash, frames, length, &slot);
+  if (id != BACKTRACE_ID_NONE)
+    goto exit;
+
+  if (g_backtrace_store_count == BACKTRACE_STORE_CHUNKS * BACKTRACE_STORE_CHUNK_SIZE)
+    goto exit;
+
+  id = g_backtrace_store_count + 1;
+  if (!g_backtrace_store[(id - 1) / BACKTRACE_STORE_CHUNK_SIZE])
+    g_backtrace_store[(id - 1) / BACKTRACE_STORE_CHUNK_SIZE] =
+      g_new0(BacktraceStoreEntry *, BACKTRACE_STORE_CHUNK_SIZE);
+
+  entry = (BacktraceStoreEntry *)g_malloc(sizeof(BacktraceStoreEntry) + length * sizeof(gpointer));
+  entry->m_trace.m_refcnt = BACKTRACE_REFCNT_INTERNED;
+  entry->m_trace.m_length = length;
+  entry->m_trace.m_symbols = entry->m_frames;
+  entry->m_hash = hash;
+  memcpy(entry->m_frames, frames, length * sizeof(gpointer));
+
+  g_backtrace_store[(id - 1) / BACKTRACE_STORE_CHUNK_SIZE][(id - 1) % BACKTRACE_STORE_CHUNK_SIZE] = entry;
+  g_atomic_int_set(&g_backtrace_store_count, id);
+
+  /* Keep the load factor under one half */
+  if (id * 2 > g_backtrace_store_table->m_mask + 1)
+    _backtrace_store_grow();
+  else
+    g_atomic_int_set(&g_backtrace_store_table->m_slots[slot], id);
+
+exit:
+  pthread_mutex_unlock(&g_backtrace_store_lock);
+  tinu_leakwatch_resume();
+  return id;
+}
+
+static BacktraceId
+_backtrace_store_intern(gpointer *frames, guint32 length)
+{
+  BacktraceStoreTable *table = g_atomic_pointer_get(&g_backtrace_store_table);
+  guint32 hash = _backtrace_store_hash(frames, length);
+  BacktraceId id;
+
+  if (table)
+    {
+      id = _backtrace_store_find(table, hash, frames, length, NULL);
+      if (id != BACKTRACE_ID_NONE)
+        return id;
+    }
+
+  return _backtrace_store_insert(hash, frames, length);
+}
+
+BacktraceId
+backtrace_intern(const Backtrace *trace)
+{
+  if (trace->m_length == 0)
+    return BACKTRACE_ID_NONE;
+
+  return _backtrace_store_intern(trace->m_symbols, trace->m_length);
+}
+
+BacktraceId
+backtrace_intern_current(guint32 depth, guint32 skip)
+{
+  gpointer frames[BACKTRACE_STACK_FRAMES];
+  gpointer *buffer = frames;
+  BacktraceId res = BACKTRACE_ID_NONE;
+  gint nptr;
+
+  /* The frame of this function is skipped as well */
+  skip++;
+  depth = MIN(depth, MAX_DEPTH);
+  nptr = backtrace_unwind(frames, MIN(depth, BACKTRACE_STACK_FRAMES), skip);
+  if (nptr == BACKTRACE_STACK_FRAMES && depth > BACKTRACE_STACK_FRAMES)
+    {
+      buffer = g_new(gpointer, depth);
+      nptr = backtrace_unwind(buffer, depth, skip);
+    }
+
+  if (nptr > 0)
+    res = _backtrace_store_intern(buffer, nptr);
+
+  if (buffer != frames)
+    g_free(buffer);
+
+  return res;
+}
+
+const Backtrace *
+backtrace_lookup(BacktraceId id)
+{
+  if (id == BACKTRACE_ID_NONE || id > g_atomic_int_get(&g_backtrace_store_count))
+    return &g_backtrace_empty;
+
+  return &_backtrace_store_get(id)->m_trace;
+}
+
+guint32
+backtrace_intern_count(void)
+{
+  return g_atomic_int_get(&g_backtrace_store_count);
+}
+
 guint32
 backtrace_depth(const Backtrace *self)
 {
@@ -284,17 +1898,14 @@ backtrace_dump_file(const Backtrace *self, FILE *output, guint8 indent)
 void
 backtrace_dump(const Backtrace *self, DumpCallback callback, void *user_data)
 {
-  BacktraceEntry *entry;
+  const BacktraceEntry *entry;
   guint32 i;
 
+  _backtrace_symbols_prefetch(self);
   for (i = 0; i < self->m_length; i++)
     {
       if (NULL != (entry = _backtrace_resolve_info(self->m_symbols[i])))
-        {
-          callback(entry, user_data);
-          backtrace_entry_destroy(entry);
-          t_free(entry);
-        }
+        callback(entry, user_data);
       else
         callback(BACKTRACE_ENTRY_INVALID, user_data);
 
@@ -304,20 +1915,35 @@ backtrace_dump(const Backtrace *self, DumpCallback callback, void *user_data)
 BacktraceEntry *
 backtrace_line(const Backtrace *self, guint32 index)
 {
+  const BacktraceEntry *entry;
+  BacktraceEntry *res;
+
   if (index >= self->m_length)
     return NULL;
 
-  return _backtrace_resolve_info(self->m_symbols[index]);
+  if (!(entry = _backtrace_resolve_info(self->m_symbols[index])))
+    return NULL;
+
+  /* The caller owns the entry, the cached strings are copied */
+  res = g_new0(BacktraceEntry, 1);
+  res->m_ptr = entry->m_ptr;
+  res->m_offset = entry->m_offset;
+  res->m_function = g_strdup(entry->m_function);
+  res->m_file = g_strdup(entry->m_file);
+  return res;
 }
 
 gboolean
 backtrace_resolv_lines(const BacktraceEntry *entry, const gchar **src, guint32 *line)
 {
-#ifdef ELFDEBUG_ENABLED
-  return _backtrace_get_lineinfo(entry, src, line);
-#else
-  return FALSE;
-#endif
+  const BacktraceSymbol *symbol = _backtrace_symbol(entry->m_ptr);
+
+  if (!symbol || !symbol->m_source)
+    return FALSE;
+
+  *src = symbol->m_source;
+  *line = symbol->m_line;
+  return TRUE;
 }
 
 void
@@ -332,18 +1958,16 @@ msg_tag_trace(const gchar *tag, const Backtrace *trace)
 {
   MessageTag *res = t_new(MessageTag, 1);
   GString *str = g_string_new("");
-  BacktraceEntry *entry;
+  const BacktraceEntry *entry;
   guint32 i;
 
+  _backtrace_symbols_prefetch(trace);
   for (i = 0; i < trace->m_length; i++)
     {
       if ((NULL != (entry = _backtrace_resolve_info(trace->m_symbols[i]))) && entry->m_function)
         {
           g_string_append(str, entry->m_function);
           g_string_append(str, ", ");
-
-          backtrace_entry_destroy(entry);
-          t_free(entry);
         }
       else
         g_string_append(str, "???, ");
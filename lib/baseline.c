@@ -0,0 +1,313 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include <tinu/baseline.h>
+#include <tinu/log.h>
+
+/** One-sided critical value of the standard normal distribution for p = 0.01 */
+#define BASELINE_Z_CRITICAL 2.326
+
+static gchar *
+_baseline_key(StatSuiteInfo *suite, StatTestInfo *test)
+{
+  return g_strdup_printf("suite.%s.test.%s", suite->m_suite->m_name, test->m_test->m_name);
+}
+
+gboolean
+baseline_save(TestStatistics *stat, const gchar *file_name)
+{
+  FILE *file;
+  gint i, j;
+  gchar *key;
+  StatSuiteInfo *suite;
+  StatTestInfo *test;
+
+  file = fopen(file_name, "w");
+  if (!file)
+    {
+      log_error("Cannot open baseline file",
+                msg_tag_str("file", file_name),
+                msg_tag_errno(), NULL);
+      return FALSE;
+    }
+
+  fprintf(file, "baseline.version=%d\n", BASELINE_VERSION);
+
+  for (i = 0; i < stat->m_suite_info_list->len; i++)
+    {
+      suite = &g_array_index(stat->m_suite_info_list, StatSuiteInfo, i);
+
+      for (j = 0; j < suite->m_test_info_list->len; j++)
+        {
+          test = &g_array_index(suite->m_test_info_list, StatTestInfo, j);
+
+          if (!test->m_benchmark)
+            continue;
+
+          key = _baseline_key(suite, test);
+          fprintf(file, "%s.benchmark.samples=%u\n", key, test->m_benchmark->m_samples);
+          fprintf(file, "%s.benchmark.iterations=%" G_GUINT64_FORMAT "\n", key,
+                  test->m_benchmark->m_iterations);
+          fprintf(file, "%s.benchmark.mean=%.3lf\n", key, test->m_benchmark->m_mean);
+          fprintf(file, "%s.benchmark.median=%.3lf\n", key, test->m_benchmark->m_median);
+          fprintf(file, "%s.benchmark.stddev=%.3lf\n", key, test->m_benchmark->m_stddev);
+          fprintf(file, "%s.benchmark.p99=%.3lf\n", key, test->m_benchmark->m_p99);
+          fprintf(file, "%s.benchmark.min=%.3lf\n", key, test->m_benchmark->m_min);
+          fprintf(file, "%s.benchmark.max=%.3lf\n", key, test->m_benchmark->m_max);
+          g_free(key);
+        }
+    }
+
+  if (fclose(file) != 0)
+    {
+      log_error("Cannot write baseline file",
+                msg_tag_str("file", file_name),
+                msg_tag_errno(), NULL);
+      return FALSE;
+    }
+
+  log_info("Benchmark baseline saved", msg_tag_str("file", file_name), NULL);
+  return TRUE;
+}
+
+static gboolean
+_baseline_set(BenchmarkResult *result, const gchar *field, const gchar *value)
+{
+  gchar *endl;
+  gdouble number = g_ascii_strtod(value, &endl);
+
+  if (endl == value || *endl != '\0')
+    return FALSE;
+
+  if (!strcmp(field, "samples"))
+    result->m_samples = (guint32)number;
+  else if (!strcmp(field, "iterations"))
+    result->m_iterations = (guint64)number;
+  else if (!strcmp(field, "mean"))
+    result->m_mean = number;
+  else if (!strcmp(field, "median"))
+    result->m_median = number;
+  else if (!strcmp(field, "stddev"))
+    result->m_stddev = number;
+  else if (!strcmp(field, "p99"))
+    result->m_p99 = number;
+  else if (!strcmp(field, "min"))
+    result->m_min = number;
+  else if (!strcmp(field, "max"))
+    result->m_max = number;
+
+  /* Unknown fields are ignored so newer baselines can add them */
+  return TRUE;
+}
+
+static GHashTable *
+_baseline_load(const gchar *file_name)
+{
+  GHashTable *results;
+  BenchmarkResult *result;
+  FILE *file;
+  gchar line[4096];
+  gchar *value, *field;
+  gint version = -1;
+  gint lineno = 0;
+
+  file = fopen(file_name, "r");
+  if (!file)
+    {
+      log_error("Cannot open baseline file",
+                msg_tag_str("file", file_name),
+                msg_tag_errno(), NULL);
+      return NULL;
+    }
+
+  results = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  while (fgets(line, sizeof(line), file))
+    {
+      lineno++;
+      g_strchomp(line);
+
+      if (line[0] == '\0')
+        continue;
+
+      value = strchr(line, '=');
+      if (!value)
+        goto invalid;
+
+      *value++ = '\0';
+
+      if (!strcmp(line, "baseline.version"))
+        {
+          version = atoi(value);
+          continue;
+        }
+
+      field = g_strrstr(line, ".benchmark.");
+      if (!g_str_has_prefix(line, "suite.") || !field)
+        continue;
+
+      *field = '\0';
+      field += strlen(".benchmark.");
+
+      result = (BenchmarkResult *)g_hash_table_lookup(results, line);
+      if (!result)
+        {
+          result = g_new0(BenchmarkResult, 1);
+          result->m_allocs = result->m_alloc_bytes = -1;
+          g_hash_table_insert(results, g_strdup(line), result);
+        }
+
+      if (!_baseline_set(result, field, value))
+        goto invalid;
+    }
+
+  fclose(file);
+
+  if (version != BASELINE_VERSION)
+    {
+      log_error("Unsupported baseline version",
+                msg_tag_str("file", file_name),
+                msg_tag_int("version", version), NULL);
+      g_hash_table_destroy(results);
+      return NULL;
+    }
+
+  return results;
+
+invalid:
+  log_error("Invalid line in baseline file",
+            msg_tag_str("file", file_name),
+            msg_tag_int("line", lineno), NULL);
+  fclose(file);
+  g_hash_table_destroy(results);
+  return NULL;
+}
+
+static gboolean
+_baseline_significant(const BenchmarkResult *base, const BenchmarkResult *current)
+{
+  gdouble var_base, var_current, se, t, df, crit;
+
+  if (base->m_samples < 2 || current->m_samples < 2)
+    return TRUE;
+
+  var_base = base->m_stddev * base->m_stddev / base->m_samples;
+  var_current = current->m_stddev * current->m_stddev / current->m_samples;
+  se = sqrt(var_base + var_current);
+
+  if (se == 0)
+    return current->m_mean > base->m_mean;
+
+  /* Welch's t-test with the Welch-Satterthwaite degrees of freedom */
+  t = (current->m_mean - base->m_mean) / se;
+  df = (var_base + var_current) * (var_base + var_current) /
+       (var_base * var_base / (base->m_samples - 1) +
+        var_current * var_current / (current->m_samples - 1));
+
+  /* Student-t critical value from the normal one (Cornish-Fisher expansion) */
+  crit = BASELINE_Z_CRITICAL +
+         (pow(BASELINE_Z_CRITICAL, 3) + BASELINE_Z_CRITICAL) / (4 * df);
+
+  return t > crit;
+}
+
+gint
+baseline_compare(TestStatistics *stat, const gchar *file_name, gdouble threshold)
+{
+  GHashTable *baseline;
+  BenchmarkResult *base, *current;
+  StatSuiteInfo *suite;
+  StatTestInfo *test;
+  gchar *key;
+  gdouble change;
+  gint i, j;
+  gint regressions = 0;
+
+  baseline = _baseline_load(file_name);
+  if (!baseline)
+    return -1;
+
+  for (i = 0; i < stat->m_suite_info_list->len; i++)
+    {
+      suite = &g_array_index(stat->m_suite_info_list, StatSuiteInfo, i);
+
+      for (j = 0; j < suite->m_test_info_list->len; j++)
+        {
+          test = &g_array_index(suite->m_test_info_list, StatTestInfo, j);
+          current = test->m_benchmark;
+
+          if (!current)
+            continue;
+
+          key = _baseline_key(suite, test);
+          base = (BenchmarkResult *)g_hash_table_lookup(baseline, key);
+          g_free(key);
+
+          if (!base || base->m_mean <= 0)
+            {
+              log_notice("Benchmark missing from baseline",
+                         msg_tag_str("suite", suite->m_suite->m_name),
+                         msg_tag_str("test", test->m_test->m_name), NULL);
+              continue;
+            }
+
+          change = current->m_mean / base->m_mean - 1;
+
+          if (change > threshold && _baseline_significant(base, current))
+            {
+              log_error("Benchmark regression",
+                        msg_tag_str("suite", suite->m_suite->m_name),
+                        msg_tag_str("test", test->m_test->m_name),
+                        msg_tag_printf("baseline", "%.3lf ns", base->m_mean),
+                        msg_tag_printf("current", "%.3lf ns", current->m_mean),
+                        msg_tag_printf("change", "%+.1lf%%", change * 100), NULL);
+              regressions++;
+            }
+          else if (change < -threshold && _baseline_significant(current, base))
+            {
+              log_notice("Benchmark improvement",
+                         msg_tag_str("suite", suite->m_suite->m_name),
+                         msg_tag_str("test", test->m_test->m_name),
+                         msg_tag_printf("baseline", "%.3lf ns", base->m_mean),
+                         msg_tag_printf("current", "%.3lf ns", current->m_mean),
+                         msg_tag_printf("change", "%+.1lf%%", change * 100), NULL);
+            }
+        }
+    }
+
+  g_hash_table_destroy(baseline);
+  return regressions;
+}
@@ -0,0 +1,355 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include <tinu/benchmark.h>
+#include <tinu/leakwatch.h>
+#include <tinu/utils.h>
+#include <tinu/log.h>
+
+#define NSEC_PER_MSEC G_GUINT64_CONSTANT(1000000)
+
+/** Maximal number of iterations in a sample */
+#define BENCHMARK_MAX_ITERATIONS G_GUINT64_CONSTANT(1000000000)
+/** Maximal number of warm-up samples */
+#define BENCHMARK_WARMUP_SAMPLES 50
+/** Number of consecutive stable samples considered a steady state */
+#define BENCHMARK_STEADY_SAMPLES 3
+/** Relative difference allowed between stable samples */
+#define BENCHMARK_STEADY_TOLERANCE 0.05
+/** Maximal number of iterations run while counting allocations */
+#define BENCHMARK_ALLOC_ITERATIONS 100
+
+static guint32 g_benchmark_samples = 20;
+static guint64 g_benchmark_sample_time = 10 * NSEC_PER_MSEC;
+
+typedef struct _BenchmarkCase
+{
+  BenchmarkFunction   m_function;
+  gpointer            m_user_data;
+  CleanupFunction     m_user_data_cleanup;
+} BenchmarkCase;
+
+struct _Benchmark
+{
+  TestCase           *m_test;
+  BenchmarkCase      *m_case;
+  gpointer            m_context;
+
+  /** Iterations in the current sample */
+  guint64             m_iterations;
+
+  /** When the timer was paused (0 if it is running) */
+  guint64             m_paused_at;
+  /** Time spent paused in the current sample */
+  guint64             m_paused_time;
+
+  /** Allocations are counted while TRUE */
+  gboolean            m_counting;
+  guint64             m_allocs;
+  guint64             m_alloc_bytes;
+};
+
+guint64
+tinu_benchmark_iterations(Benchmark *self)
+{
+  return self->m_iterations;
+}
+
+gpointer
+tinu_benchmark_user_data(Benchmark *self)
+{
+  return self->m_case->m_user_data;
+}
+
+void
+tinu_benchmark_pause(Benchmark *self)
+{
+  if (self->m_paused_at)
+    return;
+
+  /* Allocation events are delivered late, attribute them before pausing */
+  if (self->m_counting)
+    tinu_leakwatch_flush();
+
+  self->m_paused_at = tinu_clock_ns(CLOCK_MONOTONIC);
+}
+
+void
+tinu_benchmark_resume(Benchmark *self)
+{
+  if (self->m_paused_at)
+    {
+      if (self->m_counting)
+        tinu_leakwatch_flush();
+
+      self->m_paused_time += tinu_clock_ns(CLOCK_MONOTONIC) - self->m_paused_at;
+      self->m_paused_at = 0;
+    }
+}
+
+void
+benchmark_configure(guint32 samples, guint64 sample_time)
+{
+  if (samples)
+    g_benchmark_samples = samples;
+
+  if (sample_time)
+    g_benchmark_sample_time = sample_time;
+}
+
+/* Run one sample and return the measured time in nanoseconds */
+static guint64
+_benchmark_sample(Benchmark *self, guint64 iterations)
+{
+  guint64 start;
+
+  self->m_iterations = iterations;
+  self->m_paused_at = 0;
+  self->m_paused_time = 0;
+
+  start = tinu_clock_ns(CLOCK_MONOTONIC);
+  self->m_case->m_function(self->m_test, self, self->m_context);
+  tinu_benchmark_resume(self);
+
+  return tinu_clock_ns(CLOCK_MONOTONIC) - start - self->m_paused_time;
+}
+
+/* Number of iterations needed to fill a sample, based on a previous one */
+static guint64
+_benchmark_predict(guint64 iterations, guint64 elapsed)
+{
+  gdouble res;
+
+  if (elapsed == 0)
+    return BENCHMARK_MAX_ITERATIONS;
+
+  res = (gdouble)iterations * g_benchmark_sample_time / elapsed;
+  return CLAMP((guint64)res, 1, BENCHMARK_MAX_ITERATIONS);
+}
+
+static void
+_benchmark_alloc_callback(LeakwatchOperation operation,
+  gpointer oldptr, gpointer ptr, gsize size,
+  BacktraceId trace,
+  gpointer user_data)
+{
+  Benchmark *self = (Benchmark *)user_data;
+
+  if (!self->m_counting || self->m_paused_at || tinu_leakwatch_operation_kind(operation) == LEAKWATCH_OPERATION_FREE)
+    return;
+
+  self->m_allocs++;
+  self->m_alloc_bytes += size;
+}
+
+static gint
+_benchmark_compare(gconstpointer a, gconstpointer b)
+{
+  gdouble x = *(const gdouble *)a;
+  gdouble y = *(const gdouble *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+_benchmark_statistics(gdouble *samples, guint32 count, BenchmarkResult *result)
+{
+  gdouble sum = 0.0, dev = 0.0;
+  guint32 i;
+
+  qsort(samples, count, sizeof(gdouble), _benchmark_compare);
+
+  for (i = 0; i < count; i++)
+    sum += samples[i];
+  result->m_mean = sum / count;
+
+  for (i = 0; i < count; i++)
+    dev += (samples[i] - result->m_mean) * (samples[i] - result->m_mean);
+  result->m_stddev = count > 1 ? sqrt(dev / (count - 1)) : 0.0;
+
+  if (count % 2)
+    result->m_median = samples[count / 2];
+  else
+    result->m_median = (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+
+  /* Nearest-rank percentile */
+  result->m_p99 = samples[(guint32)ceil(0.99 * count) - 1];
+  result->m_min = samples[0];
+  result->m_max = samples[count - 1];
+}
+
+static void
+_benchmark_count_allocs(Benchmark *self, guint64 iterations, BenchmarkResult *result)
+{
+  gpointer handle;
+
+  iterations = MIN(iterations, BENCHMARK_ALLOC_ITERATIONS);
+
+  self->m_allocs = 0;
+  self->m_alloc_bytes = 0;
+
+  handle = tinu_register_watch(_benchmark_alloc_callback, self);
+  self->m_counting = TRUE;
+  _benchmark_sample(self, iterations);
+  tinu_unregister_watch(handle);
+  self->m_counting = FALSE;
+
+  result->m_allocs = (gdouble)self->m_allocs / iterations;
+  result->m_alloc_bytes = (gdouble)self->m_alloc_bytes / iterations;
+}
+
+static void
+_benchmark_run(TestCase *test, gpointer context)
+{
+  Benchmark self;
+  BenchmarkResult result;
+  TestContext *test_context = tinu_test_context_current();
+  guint64 iterations = 1, elapsed;
+  gdouble *samples, previous, current;
+  guint32 i, stable = 0;
+
+  memset(&self, 0, sizeof(self));
+  self.m_test = test;
+  self.m_case = (BenchmarkCase *)test->m_user_data;
+  self.m_context = context;
+
+  if (!self.m_case->m_function)
+    return;
+
+  memset(&result, 0, sizeof(result));
+  result.m_allocs = -1.0;
+  result.m_alloc_bytes = -1.0;
+
+  /* Calibration: grow the iteration count until a sample is long enough */
+  for (;;)
+    {
+      elapsed = _benchmark_sample(&self, iterations);
+      if (elapsed >= g_benchmark_sample_time || iterations >= BENCHMARK_MAX_ITERATIONS)
+        break;
+
+      iterations = CLAMP(_benchmark_predict(iterations, elapsed) * 6 / 5,
+                         iterations + 1, MIN(iterations * 100, BENCHMARK_MAX_ITERATIONS));
+    }
+
+  /* Warm-up: run samples until the iteration time is stable */
+  previous = (gdouble)elapsed / iterations;
+  for (i = 0; i < BENCHMARK_WARMUP_SAMPLES && stable < BENCHMARK_STEADY_SAMPLES; i++)
+    {
+      iterations = _benchmark_predict(iterations, elapsed);
+      elapsed = _benchmark_sample(&self, iterations);
+      current = (gdouble)elapsed / iterations;
+
+      if (fabs(current - previous) <= BENCHMARK_STEADY_TOLERANCE * previous)
+        stable++;
+      else
+        stable = 0;
+      previous = current;
+    }
+
+  if (stable < BENCHMARK_STEADY_SAMPLES)
+    {
+      log_info("Benchmark did not reach a steady state during warm-up",
+               msg_tag_str("suite", test->m_suite->m_name),
+               msg_tag_str("case", test->m_name), NULL);
+    }
+
+  iterations = _benchmark_predict(iterations, elapsed);
+  log_debug("Benchmark calibrated",
+            msg_tag_str("suite", test->m_suite->m_name),
+            msg_tag_str("case", test->m_name),
+            msg_tag_printf("iterations", "%" G_GUINT64_FORMAT, iterations),
+            msg_tag_int("warmup", i), NULL);
+
+  samples = g_new0(gdouble, g_benchmark_samples);
+  for (i = 0; i < g_benchmark_samples; i++)
+    samples[i] = (gdouble)_benchmark_sample(&self, iterations) / iterations;
+
+  result.m_samples = g_benchmark_samples;
+  result.m_iterations = iterations;
+  _benchmark_statistics(samples, g_benchmark_samples, &result);
+  g_free(samples);
+
+  /* Leak watches are process-wide, so allocations cannot be attributed
+   * to a benchmark while other threads run test cases */
+  if (!test_context || test_context->m_threads <= 1)
+    _benchmark_count_allocs(&self, iterations, &result);
+
+  log_info("Benchmark finished",
+           msg_tag_str("suite", test->m_suite->m_name),
+           msg_tag_str("case", test->m_name),
+           msg_tag_printf("mean", "%.3lf ns", result.m_mean),
+           msg_tag_printf("median", "%.3lf ns", result.m_median),
+           msg_tag_printf("stddev", "%.3lf ns", result.m_stddev),
+           msg_tag_printf("p99", "%.3lf ns", result.m_p99), NULL);
+
+  tinu_test_emit_hook(TEST_HOOK_BENCHMARK, test, &result);
+}
+
+static void
+_benchmark_case_free(gpointer user_data)
+{
+  BenchmarkCase *self = (BenchmarkCase *)user_data;
+
+  if (self->m_user_data_cleanup)
+    self->m_user_data_cleanup(self->m_user_data);
+  g_free(self);
+}
+
+void
+benchmark_add(TestContext *self,
+              const gchar *suite_name,
+              const gchar *bench_name,
+              TestSetup setup,
+              TestCleanup cleanup,
+              BenchmarkFunction func,
+              gpointer user_data,
+              CleanupFunction user_data_cleanup)
+{
+  BenchmarkCase *bench = g_new0(BenchmarkCase, 1);
+
+  bench->m_function = func;
+  bench->m_user_data = user_data;
+  bench->m_user_data_cleanup = user_data_cleanup;
+
+  test_add_extended(self,
+                    suite_name,
+                    bench_name,
+                    setup,
+                    cleanup,
+                    _benchmark_run,
+                    bench,
+                    _benchmark_case_free);
+}
@@ -30,6 +30,7 @@
 
 #include <string.h>
 #include <cxxabi.h>
+#include <new>
 
 #include <glib.h>
 
@@ -101,11 +102,11 @@ CxxBacktrace::at(unsigned int i) const
 void
 cxx_leakwatch_callback(LeakwatchOperation operation,
                        gpointer oldptr, gpointer ptr, gsize size,
-                       Backtrace *trace,
+                       BacktraceId trace,
                        gpointer user_data)
 {
   CxxLeakwatch *self = (CxxLeakwatch *)user_data;
-  CxxBacktrace cxxtrace(trace);
+  CxxBacktrace cxxtrace(const_cast<Backtrace *>(backtrace_lookup(trace)));
 
   switch (operation)
     {
@@ -118,7 +119,27 @@ cxx_leakwatch_callback(LeakwatchOperation operation,
         break;
 
       case LEAKWATCH_OPERATION_FREE :
-        self->notify_free(ptr, cxxtrace);
+        self->notify_free(oldptr, cxxtrace);
+        break;
+
+      case LEAKWATCH_OPERATION_MMAP :
+        self->notify_map(ptr, size, cxxtrace);
+        break;
+
+      case LEAKWATCH_OPERATION_MREMAP :
+        self->notify_remap(oldptr, ptr, size, cxxtrace);
+        break;
+
+      case LEAKWATCH_OPERATION_MUNMAP :
+        self->notify_unmap(oldptr, size, cxxtrace);
+        break;
+
+      case LEAKWATCH_OPERATION_NEW :
+        self->notify_new(ptr, size, cxxtrace);
+        break;
+
+      case LEAKWATCH_OPERATION_DELETE :
+        self->notify_delete(oldptr, cxxtrace);
         break;
     }
 }
@@ -210,3 +231,90 @@ CxxTinu::~CxxTinu()
 }
 
 }
+
+/* C++ allocator: replacing the operators makes every C++ allocation
+ * visible to leakwatch (as NEW and DELETE), whatever the runtime would
+ * allocate with */
+
+static void *
+cxx_operator_new(std::size_t size, std::size_t alignment)
+{
+  gpointer res;
+
+  if (size == 0)
+    size = 1;
+
+  while (!(res = tinu_leakwatch_new(size, alignment)))
+    {
+      std::new_handler handler = std::get_new_handler();
+
+      if (!handler)
+        throw std::bad_alloc();
+
+      handler();
+    }
+
+  return res;
+}
+
+static void *
+cxx_operator_new_nothrow(std::size_t size, std::size_t alignment)
+{
+  try
+    {
+      return cxx_operator_new(size, alignment);
+    }
+  catch (std::bad_alloc &)
+    {
+      return NULL;
+    }
+}
+
+void *operator new(std::size_t size)
+{ return cxx_operator_new(size, 0); }
+void *operator new[](std::size_t size)
+{ return cxx_operator_new(size, 0); }
+void *operator new(std::size_t size, const std::nothrow_t &) throw()
+{ return cxx_operator_new_nothrow(size, 0); }
+void *operator new[](std::size_t size, const std::nothrow_t &) throw()
+{ return cxx_operator_new_nothrow(size, 0); }
+
+void operator delete(void *ptr) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete[](void *ptr) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) throw()
+{ tinu_leakwatch_delete(ptr); }
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *ptr, std::size_t) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete[](void *ptr, std::size_t) throw()
+{ tinu_leakwatch_delete(ptr); }
+#endif
+
+#ifdef __cpp_aligned_new
+void *operator new(std::size_t size, std::align_val_t alignment)
+{ return cxx_operator_new(size, (std::size_t)alignment); }
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{ return cxx_operator_new(size, (std::size_t)alignment); }
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) throw()
+{ return cxx_operator_new_nothrow(size, (std::size_t)alignment); }
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) throw()
+{ return cxx_operator_new_nothrow(size, (std::size_t)alignment); }
+
+void operator delete(void *ptr, std::align_val_t) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete[](void *ptr, std::align_val_t) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) throw()
+{ tinu_leakwatch_delete(ptr); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) throw()
+{ tinu_leakwatch_delete(ptr); }
+#endif
@@ -30,17 +30,23 @@
 
 #define _LARGEFILE64_SOURCE
 #include <libelf.h>
+#include <gelf.h>
 #include <libdwarf.h>
 
 #include <glib.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <tinu/dwarf.h>
 #include <tinu/log.h>
 
-#define DWARF_ADDR_TO_GPOINTER(addr) ((gpointer)((int)(addr)))
+#define DWARF_ADDR_TO_GPOINTER(addr) ((gpointer)(guintptr)(addr))
 
 static inline void
 _dw_dwarf_error(Dwarf_Error error, Dwarf_Ptr user_data G_GNUC_UNUSED)
@@ -48,233 +54,1161 @@ _dw_dwarf_error(Dwarf_Error error, Dwarf_Ptr user_data G_GNUC_UNUSED)
   log_error("DWARF error found", msg_tag_str("error", dwarf_errmsg(error)), NULL);
 }
 
-static void
-_dw_clean_unit(gpointer entry, gpointer data G_GNUC_UNUSED)
+static inline void
+_dw_log_error(const gchar *msg, Dwarf_Debug dbg, Dwarf_Error error)
 {
-  g_free(entry);
+  log_error(msg, msg_tag_str("error", dwarf_errmsg(error)), NULL);
+  dwarf_dealloc(dbg, error, DW_DLA_ERROR);
 }
 
-static void
-_dw_clean_handle(gpointer unit, gpointer data G_GNUC_UNUSED)
+static int
+_dw_compare_entries(const void *a, const void *b)
 {
-  DwarfCompUnit *udata = (DwarfCompUnit *)unit;
+  const DwarfEntry *entry_a = (const DwarfEntry *)a;
+  const DwarfEntry *entry_b = (const DwarfEntry *)b;
+
+  if (entry_a->m_pointer != entry_b->m_pointer)
+    return (entry_a->m_pointer < entry_b->m_pointer ? -1 : 1);
 
-  g_slist_foreach(udata->m_entries, _dw_clean_unit, NULL);
-  g_slist_free(udata->m_entries);
-  g_free(unit);
+  /* The end of a sequence comes before the next one starting there */
+  if ((entry_a->m_source == 0) != (entry_b->m_source == 0))
+    return (entry_a->m_source == 0 ? -1 : 1);
+
+  return 0;
 }
 
-static inline gboolean
-_dw_process_unit(DwarfCompUnit **res_unit, Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Error *error)
+static int
+_dw_compare_ranges(const void *a, const void *b)
+{
+  const DwarfRange *range_a = (const DwarfRange *)a;
+  const DwarfRange *range_b = (const DwarfRange *)b;
+
+  if (range_a->m_lowpc != range_b->m_lowpc)
+    return (range_a->m_lowpc < range_b->m_lowpc ? -1 : 1);
+
+  return 0;
+}
+
+/* Decode the line table of a unit into an array sorted by address */
+static gboolean
+_dw_decode_lines(Dwarf_Debug dbg, Dwarf_Die die, DwarfEntry **res_entries, guint32 *res_count,
+                 Dwarf_Error *error)
 {
   gboolean result = FALSE;
   int ret;
   gint i;
 
-  Dwarf_Signed lines;
+  Dwarf_Signed lines = 0;
   Dwarf_Line *linebuf = NULL;
 
-  DwarfCompUnit *unit;
-  Dwarf_Addr low, high;
+  GArray *entries;
+  DwarfEntry entry;
 
-  DwarfEntry *entry;
   gchar *filename;
   Dwarf_Addr lineaddr;
   Dwarf_Unsigned lineno;
-  GSList *last_entry;
+  Dwarf_Bool end_sequence;
 
-  ret = dwarf_srclines(die, &linebuf, &lines, error);
-  *res_unit = NULL;
+  *res_entries = NULL;
+  *res_count = 0;
 
+  ret = dwarf_srclines(die, &linebuf, &lines, error);
   if (ret == DW_DLV_NO_ENTRY)
     return TRUE;
 
   if (ret == DW_DLV_ERROR)
-    goto exit;
+    return FALSE;
 
-  ret = dwarf_lowpc(die, &low, error);
-  if (ret == DW_DLV_ERROR)
-    goto exit;
-  else if (ret == DW_DLV_NO_ENTRY)
+  entries = g_array_sized_new(FALSE, FALSE, sizeof(DwarfEntry), lines);
+  for (i = 0; i < lines; i++)
     {
-      result = TRUE;
-      goto exit;
+      if (dwarf_lineaddr(linebuf[i], &lineaddr, error) != DW_DLV_OK)
+        goto exit;
+
+      if (dwarf_lineendsequence(linebuf[i], &end_sequence, error) != DW_DLV_OK)
+        goto exit;
+
+      entry.m_pointer = DWARF_ADDR_TO_GPOINTER(lineaddr);
+      entry.m_source = 0;
+      entry.m_lineno = 0;
+
+      if (!end_sequence)
+        {
+          if (dwarf_linesrc(linebuf[i], &filename, error) != DW_DLV_OK)
+            goto exit;
+
+          if (dwarf_lineno(linebuf[i], &lineno, error) != DW_DLV_OK)
+            {
+              dwarf_dealloc(dbg, filename, DW_DLA_STRING);
+              goto exit;
+            }
+
+          entry.m_source = g_quark_from_string(filename);
+          entry.m_lineno = (gint)lineno;
+          dwarf_dealloc(dbg, filename, DW_DLA_STRING);
+        }
+
+      g_array_append_val(entries, entry);
     }
 
-  ret = dwarf_highpc(die, &high, error);
-  if (ret == DW_DLV_ERROR)
-    goto exit;
-  else if (ret == DW_DLV_NO_ENTRY)
+  /* Sequences are sorted, but not necessarily in order */
+  qsort(entries->data, entries->len, sizeof(DwarfEntry), _dw_compare_entries);
+
+  *res_count = entries->len;
+  *res_entries = (DwarfEntry *)g_array_free(entries, FALSE);
+  entries = NULL;
+  result = TRUE;
+
+exit:
+  if (entries)
+    g_array_free(entries, TRUE);
+  dwarf_srclines_dealloc(dbg, linebuf, lines);
+
+  return result;
+}
+
+static guint32
+_dw_add_unit(GArray *units, Dwarf_Off offset)
+{
+  DwarfCompUnit unit;
+
+  memset(&unit, 0, sizeof(unit));
+  unit.m_offset = offset;
+  unit.m_state = DWARF_UNIT_PENDING;
+  unit.m_lru_prev = DWARF_UNIT_NONE;
+  unit.m_lru_next = DWARF_UNIT_NONE;
+
+  g_array_append_val(units, unit);
+  return units->len - 1;
+}
+
+static void
+_dw_add_range(GArray *ranges, Dwarf_Addr low, Dwarf_Addr high, guint32 unit)
+{
+  DwarfRange range;
+
+  /* Code removed by the linker is left at address zero */
+  if (low == 0 || high <= low)
+    return;
+
+  range.m_lowpc = DWARF_ADDR_TO_GPOINTER(low);
+  range.m_highpc = DWARF_ADDR_TO_GPOINTER(high);
+  range.m_unit = unit;
+  g_array_append_val(ranges, range);
+}
+
+/* Ranges of the line sequences of a decoded unit, a unit may be split
+ * around the code of other units (eg. .text.startup or .text.unlikely) */
+static void
+_dw_add_sequence_ranges(GArray *ranges, const DwarfEntry *entries, guint32 count, guint32 unit)
+{
+  gpointer start = NULL;
+  guint32 i;
+
+  for (i = 0; i < count; i++)
     {
-      result = TRUE;
-      goto exit;
+      if (entries[i].m_source == 0)
+        {
+          /* Sequences following each other make a single range */
+          if (start && (i + 1 == count || entries[i + 1].m_pointer != entries[i].m_pointer))
+            {
+              _dw_add_range(ranges, (Dwarf_Addr)(guintptr)start,
+                            (Dwarf_Addr)(guintptr)entries[i].m_pointer, unit);
+              start = NULL;
+            }
+        }
+      else if (!start)
+        start = entries[i].m_pointer;
     }
+}
 
-  unit = g_new0(DwarfCompUnit, 1);
-  unit->m_entries = NULL;
-  unit->m_lowpc = DWARF_ADDR_TO_GPOINTER(low);
-  unit->m_highpc = DWARF_ADDR_TO_GPOINTER(high);
+/* Unit ranges from the .debug_aranges section, FALSE if it is missing */
+static gboolean
+_dw_read_aranges(Dwarf_Debug dbg, GArray *units, GArray *ranges, Dwarf_Error *error)
+{
+  Dwarf_Arange *aranges = NULL;
+  Dwarf_Signed count = 0, i;
+  Dwarf_Addr start;
+  Dwarf_Unsigned length;
+  Dwarf_Off offset;
+  GHashTable *unit_index;
+  gpointer index;
+  gboolean result = TRUE;
+
+  if (dwarf_get_aranges(dbg, &aranges, &count, error) != DW_DLV_OK)
+    return FALSE;
 
-  for (i = 0, last_entry = NULL; i < lines; i++)
+  /* Unit offset + 1 -> unit index + 1 */
+  unit_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (i = 0; i < count; i++)
     {
-      if (dwarf_linesrc(linebuf[i], &filename, error) != DW_DLV_OK)
-        goto exit;
+      if (dwarf_get_arange_info(aranges[i], &start, &length, &offset, error) != DW_DLV_OK)
+        {
+          result = FALSE;
+          break;
+        }
 
-      if (dwarf_lineaddr(linebuf[i], &lineaddr, error) != DW_DLV_OK)
-        goto exit;
+      if (!(index = g_hash_table_lookup(unit_index, GSIZE_TO_POINTER(offset + 1))))
+        {
+          index = GUINT_TO_POINTER(_dw_add_unit(units, offset) + 1);
+          g_hash_table_insert(unit_index, GSIZE_TO_POINTER(offset + 1), index);
+        }
 
-      if (dwarf_lineno(linebuf[i], &lineno, error) != DW_DLV_OK)
-        goto exit;
+      _dw_add_range(ranges, start, start + length, GPOINTER_TO_UINT(index) - 1);
+    }
 
-      entry = g_new0(DwarfEntry, 1);
+  g_hash_table_destroy(unit_index);
+  for (i = 0; i < count; i++)
+    dwarf_dealloc(dbg, aranges[i], DW_DLA_ARANGE);
+  dwarf_dealloc(dbg, aranges, DW_DLA_LIST);
 
-      entry->m_source = g_quark_from_string(filename);
-      entry->m_pointer = DWARF_ADDR_TO_GPOINTER(lineaddr);
-      entry->m_lineno = (gint)lineno;
+  return result;
+}
 
-      if (G_LIKELY(last_entry))
+/* Unit ranges from the unit DIEs, for the units not already in 'units'
+ * (the aranges need not list every unit). Units described with
+ * DW_AT_ranges are decoded right away, their ranges are those of their
+ * line sequences. */
+static gboolean
+_dw_read_units(Dwarf_Debug dbg, GArray *units, GArray *ranges, Dwarf_Error *error)
+{
+  Dwarf_Unsigned next_cu_header = 0;
+  Dwarf_Die die = NULL;
+  Dwarf_Addr low, high;
+  Dwarf_Half form;
+  enum Dwarf_Form_Class form_class;
+  Dwarf_Off offset;
+  DwarfCompUnit *unit;
+  GHashTable *listed;
+  guint32 index;
+  gboolean result = FALSE;
+  int ret;
+
+  /* Unit offset + 1 of the units already listed */
+  listed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (index = 0; index < units->len; index++)
+    {
+      offset = g_array_index(units, DwarfCompUnit, index).m_offset;
+      g_hash_table_insert(listed, GSIZE_TO_POINTER(offset + 1), GSIZE_TO_POINTER(offset + 1));
+    }
+
+  while (DW_DLV_OK == (ret = dwarf_next_cu_header(dbg, NULL, NULL, NULL, NULL,
+                                                  &next_cu_header, error)))
+    {
+      if (dwarf_siblingof(dbg, NULL, &die, error) != DW_DLV_OK)
+        {
+          die = NULL;
+          goto exit;
+        }
+
+      if (dwarf_dieoffset(die, &offset, error) != DW_DLV_OK)
+        goto exit;
+
+      if (g_hash_table_lookup(listed, GSIZE_TO_POINTER(offset + 1)))
+        {
+          dwarf_dealloc(dbg, die, DW_DLA_DIE);
+          continue;
+        }
+
+      index = _dw_add_unit(units, offset);
+      if (dwarf_lowpc(die, &low, error) == DW_DLV_OK &&
+          dwarf_highpc_b(die, &high, &form, &form_class, error) == DW_DLV_OK)
         {
-          last_entry->next = g_slist_append(NULL, entry);
-          last_entry = last_entry->next;
+          /* Since DWARF 4 the high address may be relative */
+          if (form_class == DW_FORM_CLASS_CONSTANT)
+            high += low;
+          _dw_add_range(ranges, low, high, index);
         }
       else
         {
-          unit->m_entries = g_slist_append(NULL, entry);
-          last_entry = unit->m_entries;
+          unit = &g_array_index(units, DwarfCompUnit, index);
+          if (!_dw_decode_lines(dbg, die, &unit->m_entries, &unit->m_count, error))
+            goto exit;
+
+          unit->m_state = DWARF_UNIT_RESIDENT;
+          _dw_add_sequence_ranges(ranges, unit->m_entries, unit->m_count, index);
         }
+
+      dwarf_dealloc(dbg, die, DW_DLA_DIE);
     }
 
-  *res_unit = unit;
-  result = TRUE;
+  die = NULL;
+  result = (ret != DW_DLV_ERROR);
 
 exit:
-  dwarf_srclines_dealloc(dbg, linebuf, lines);
-  dwarf_dealloc(dbg, die, DW_DLA_DIE);
-
+  if (die)
+    dwarf_dealloc(dbg, die, DW_DLA_DIE);
+  g_hash_table_destroy(listed);
   return result;
 }
 
+static int
+_dw_compare_symbols(const void *a, const void *b)
+{
+  const DwarfSymbol *symbol_a = (const DwarfSymbol *)a;
+  const DwarfSymbol *symbol_b = (const DwarfSymbol *)b;
+
+  if (symbol_a->m_address != symbol_b->m_address)
+    return (symbol_a->m_address < symbol_b->m_address ? -1 : 1);
+
+  return 0;
+}
+
+/* Index the function symbols of the ELF file, for the functions dladdr()
+ * can not name (the ones not exported) */
+static void
+_dw_read_symbols(DwarfHandle *self)
+{
+  GArray *symbols;
+  GString *strings;
+  DwarfSymbol symbol;
+  Elf *elf;
+  Elf_Scn *scn = NULL;
+  Elf_Data *data;
+  GElf_Shdr shdr;
+  GElf_Sym sym;
+  Elf64_Word type = SHT_DYNSYM;
+  const gchar *name;
+  gsize i, count;
+  gint fd;
+
+  /* Opened again, the descriptor of the handle may have been closed */
+  if ((fd = open(self->m_filename, O_RDONLY)) == -1)
+    return;
+
+  if (elf_version(EV_CURRENT) == EV_NONE || !(elf = elf_begin(fd, ELF_C_READ, NULL)))
+    {
+      close(fd);
+      return;
+    }
+
+  /* The full symbol table if the file is not stripped */
+  while ((scn = elf_nextscn(elf, scn)))
+    {
+      if (gelf_getshdr(scn, &shdr) && shdr.sh_type == SHT_SYMTAB)
+        type = SHT_SYMTAB;
+    }
+
+  symbols = g_array_new(FALSE, FALSE, sizeof(DwarfSymbol));
+  strings = g_string_new(NULL);
+  g_string_append_len(strings, "", 1);
+
+  while ((scn = elf_nextscn(elf, scn)))
+    {
+      if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != type || shdr.sh_entsize == 0 ||
+          !(data = elf_getdata(scn, NULL)))
+        continue;
+
+      count = shdr.sh_size / shdr.sh_entsize;
+      for (i = 0; i < count; i++)
+        {
+          if (!gelf_getsym(data, i, &sym) || GELF_ST_TYPE(sym.st_info) != STT_FUNC ||
+              sym.st_shndx == SHN_UNDEF || sym.st_value == 0 ||
+              !(name = elf_strptr(elf, shdr.sh_link, sym.st_name)) || !*name)
+            continue;
+
+          symbol.m_address = sym.st_value;
+          symbol.m_size = sym.st_size;
+          symbol.m_name = strings->len;
+          symbol.m_reserved = 0;
+          g_string_append_len(strings, name, strlen(name) + 1);
+          g_array_append_val(symbols, symbol);
+        }
+    }
+
+  elf_end(elf);
+  close(fd);
+
+  qsort(symbols->data, symbols->len, sizeof(DwarfSymbol), _dw_compare_symbols);
+
+  self->m_symbol_count = symbols->len;
+  self->m_symbols = (DwarfSymbol *)g_array_free(symbols, FALSE);
+  self->m_strings_size = strings->len;
+  self->m_strings = g_string_free(strings, FALSE);
+}
+
+static void
+_dw_load_symbols(DwarfHandle *self)
+{
+  if (g_atomic_int_get(&self->m_symbols_read))
+    return;
+
+  pthread_mutex_lock(&self->m_lock);
+  if (!self->m_symbols_read)
+    {
+      _dw_read_symbols(self);
+      g_atomic_int_set(&self->m_symbols_read, TRUE);
+    }
+  pthread_mutex_unlock(&self->m_lock);
+}
+
 DwarfHandle *
 dw_new(const gchar *name)
 {
   DwarfHandle *res = g_new0(DwarfHandle, 1);
-  int ret;
   Dwarf_Error error = NULL;
-
-  int fd;
   Dwarf_Debug dbg = NULL;
-  Dwarf_Die die = NULL;
-  Dwarf_Unsigned next_cu_header = 0;
-
-  DwarfCompUnit *unit;
 
-  GSList *last_unit = NULL;
+  GArray *units = g_array_new(FALSE, FALSE, sizeof(DwarfCompUnit));
+  GArray *ranges = g_array_new(FALSE, FALSE, sizeof(DwarfRange));
 
   res->m_filename = g_strdup(name);
-  res->m_entries = NULL;
+  res->m_lru_head = DWARF_UNIT_NONE;
+  res->m_lru_tail = DWARF_UNIT_NONE;
+  pthread_mutex_init(&res->m_lock, NULL);
 
   log_info("Loading trace info", msg_tag_str("filename", name), NULL);
 
-  fd = open(name, O_RDONLY);
-  if (fd == -1)
+  res->m_fd = open(name, O_RDONLY);
+  if (res->m_fd == -1)
     {
       log_error("Cannot open runtime file", msg_tag_str("filename", name), NULL);
       goto error;
     }
 
-  if (dwarf_init(fd, DW_DLC_READ, _dw_dwarf_error, NULL, &dbg, &error)
+  if (dwarf_init(res->m_fd, DW_DLC_READ, _dw_dwarf_error, NULL, &dbg, &error)
         != DW_DLV_OK)
     {
       if (error)
         goto error;
 
-      log_warn("File does not contain entries", NULL);
-      close(fd);
-      dwarf_finish(dbg, NULL);
+      log_info("File does not contain entries", msg_tag_str("filename", name), NULL);
+      close(res->m_fd);
+      res->m_fd = -1;
+      g_array_free(units, TRUE);
+      g_array_free(ranges, TRUE);
       return res;
     }
+  res->m_debug = dbg;
 
-  while (DW_DLV_OK == (ret = dwarf_next_cu_header(dbg, NULL, NULL, NULL, NULL,
-                                                  &next_cu_header, &error)))
-    {
-      if (dwarf_siblingof(dbg, NULL, &die, &error) != DW_DLV_OK)
-        goto error;
-
-      if (!_dw_process_unit(&unit, dbg, die, &error))
-        goto error;
+  /* Only the address ranges of the units are read here, the units left
+   * out of the aranges (or all, if they are missing) from their DIEs */
+  if (!_dw_read_aranges(dbg, units, ranges, &error) && error)
+    goto error;
 
-      if (!unit)
-        continue;
+  if (!_dw_read_units(dbg, units, ranges, &error))
+    goto error;
 
-      if (G_LIKELY(last_unit))
-        {
-          last_unit->next = g_slist_append(NULL, unit);
-          last_unit = last_unit->next;
-        }
-      else
-        {
-          res->m_entries = g_slist_append(NULL, unit);
-          last_unit = res->m_entries;
-        }
-    }
+  qsort(ranges->data, ranges->len, sizeof(DwarfRange), _dw_compare_ranges);
 
-  if (ret == DW_DLV_ERROR)
-    goto error;
+  res->m_unit_count = units->len;
+  res->m_units = (DwarfCompUnit *)g_array_free(units, FALSE);
+  res->m_range_count = ranges->len;
+  res->m_ranges = (DwarfRange *)g_array_free(ranges, FALSE);
 
-  log_info("DWARF init successfull", NULL);
+  log_info("DWARF init successfull",
+           msg_tag_int("units", res->m_unit_count),
+           msg_tag_int("ranges", res->m_range_count), NULL);
 
-  close(fd);
-  dwarf_finish(dbg, NULL);
   return res;
 
 error:
-  close(fd);
   if (error)
     {
       log_error("DWARF error", msg_tag_str("error", dwarf_errmsg(error)), NULL);
       dwarf_dealloc(NULL, error, DW_DLA_ERROR);
     }
-  if (dbg)
-    dwarf_finish(dbg, NULL);
 
+  g_array_free(units, TRUE);
+  g_array_free(ranges, TRUE);
   dw_destroy(res);
   return NULL;
 }
 
+/* Drop the state of lazy decoding */
+static void
+_dw_close(DwarfHandle *self)
+{
+  guint32 i;
+
+  for (i = 0; i < self->m_unit_count; i++)
+    g_free(self->m_units[i].m_entries);
+
+  if (self->m_debug)
+    dwarf_finish((Dwarf_Debug)self->m_debug, NULL);
+  if (self->m_fd != -1)
+    close(self->m_fd);
+
+  g_free(self->m_units);
+  g_free(self->m_ranges);
+
+  self->m_debug = NULL;
+  self->m_fd = -1;
+  self->m_units = NULL;
+  self->m_unit_count = 0;
+  self->m_ranges = NULL;
+  self->m_range_count = 0;
+}
+
 void
 dw_destroy(DwarfHandle *self)
 {
-  g_slist_foreach(self->m_entries, _dw_clean_handle, NULL);
+  _dw_close(self);
+
+  if (self->m_map)
+    munmap(self->m_map, self->m_map_size);
+  else
+    {
+      g_free(self->m_symbols);
+      g_free(self->m_strings);
+      g_free(self->m_lines);
+      g_free(self->m_files);
+    }
+
+  pthread_mutex_destroy(&self->m_lock);
   g_free(self->m_filename);
   g_free(self);
 }
 
-const DwarfEntry *
-dw_lookup(DwarfHandle *self, gpointer ptr, guint32 tolerance)
+/* Header of the symbolization cache files. The lines, the symbols, the
+ * file table and the strings follow it in this order, the sizes of the
+ * header and the records keep each of them aligned. */
+#define DWARF_CACHE_MAGIC                0x43445754
+#define DWARF_CACHE_VERSION              1
+
+typedef struct _DwarfCacheHeader
 {
-  GSList *act;
+  guint32       m_magic;
+  guint32       m_version;
+  gchar         m_build_id[48];
 
+  guint64       m_lines_offset;
+  guint64       m_line_count;
+  guint64       m_symbols_offset;
+  guint64       m_symbol_count;
+  guint64       m_files_offset;
+  guint64       m_file_count;
+  guint64       m_strings_offset;
+  guint64       m_strings_size;
+} DwarfCacheHeader;
+
+static int
+_dw_compare_lines(const void *a, const void *b)
+{
+  const DwarfLine *line_a = (const DwarfLine *)a;
+  const DwarfLine *line_b = (const DwarfLine *)b;
+
+  if (line_a->m_address != line_b->m_address)
+    return (line_a->m_address < line_b->m_address ? -1 : 1);
+
+  if ((line_a->m_file == 0) != (line_b->m_file == 0))
+    return (line_a->m_file == 0 ? -1 : 1);
+
+  return 0;
+}
+
+/* Decode every unit into one line table, the DWARF data is not needed
+ * afterwards */
+static void
+_dw_index(DwarfHandle *self)
+{
+  Dwarf_Debug dbg = (Dwarf_Debug)self->m_debug;
+  Dwarf_Error error = NULL;
+  Dwarf_Die die;
   DwarfCompUnit *unit;
-  DwarfEntry *entry;
+  DwarfEntry *entries;
+  guint32 i, j, count;
+
+  GArray *lines = g_array_new(FALSE, FALSE, sizeof(DwarfLine));
+  GArray *files = g_array_new(FALSE, FALSE, sizeof(guint32));
+  GString *strings = g_string_new_len(self->m_strings ? self->m_strings : "", self->m_strings_size);
+  GHashTable *file_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+  gpointer index;
+  const gchar *filename;
+  DwarfLine line;
+  guint32 name = 0;
+
+  if (!strings->len)
+    g_string_append_len(strings, "", 1);
 
-  /* Find compilation unit */
-  for (act = self->m_entries; act; act = act->next)
+  /* File 0 marks the end of the sequences */
+  g_array_append_val(files, name);
+
+  for (i = 0; i < self->m_unit_count; i++)
     {
-      unit = (DwarfCompUnit *)act->data;
-      if ((ptr >= unit->m_lowpc) && (ptr <= unit->m_highpc))
-        break;
+      unit = &self->m_units[i];
+      entries = unit->m_entries;
+      count = unit->m_count;
+
+      if (unit->m_state == DWARF_UNIT_PENDING)
+        {
+          die = NULL;
+          if (dwarf_offdie(dbg, unit->m_offset, &die, &error) != DW_DLV_OK ||
+              !_dw_decode_lines(dbg, die, &entries, &count, &error))
+            {
+              if (error)
+                _dw_log_error("Cannot decode the lines of a compilation unit", dbg, error);
+              if (die)
+                dwarf_dealloc(dbg, die, DW_DLA_DIE);
+              error = NULL;
+              continue;
+            }
+          dwarf_dealloc(dbg, die, DW_DLA_DIE);
+        }
+
+      for (j = 0; j < count; j++)
+        {
+          line.m_address = (guint64)(guintptr)entries[j].m_pointer;
+          line.m_file = 0;
+          line.m_lineno = entries[j].m_lineno;
+
+          if (entries[j].m_source)
+            {
+              if (!(index = g_hash_table_lookup(file_index, GUINT_TO_POINTER(entries[j].m_source))))
+                {
+                  filename = g_quark_to_string(entries[j].m_source);
+                  name = strings->len;
+                  g_array_append_val(files, name);
+                  g_string_append_len(strings, filename, strlen(filename) + 1);
+
+                  index = GUINT_TO_POINTER(files->len - 1);
+                  g_hash_table_insert(file_index, GUINT_TO_POINTER(entries[j].m_source), index);
+                }
+              line.m_file = GPOINTER_TO_UINT(index);
+            }
+
+          g_array_append_val(lines, line);
+        }
+
+      if (entries != unit->m_entries)
+        g_free(entries);
     }
 
-  if (!act)
+  g_hash_table_destroy(file_index);
+
+  qsort(lines->data, lines->len, sizeof(DwarfLine), _dw_compare_lines);
+
+  _dw_close(self);
+  g_free(self->m_strings);
+
+  self->m_line_count = lines->len;
+  self->m_lines = (DwarfLine *)g_array_free(lines, FALSE);
+  self->m_file_count = files->len;
+  self->m_files = (guint32 *)g_array_free(files, FALSE);
+  self->m_strings_size = strings->len;
+  self->m_strings = g_string_free(strings, FALSE);
+}
+
+static gchar *
+_dw_cache_path(const gchar *build_id, const gchar *cache_dir)
+{
+  return g_strdup_printf("%s/%s.tinu-symbols", cache_dir, build_id);
+}
+
+static gboolean
+_dw_cache_write_section(FILE *file, gconstpointer data, gsize size, guint64 *offset)
+{
+  *offset = ftell(file);
+  return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+/* Store the index of the module, it is written to a temporary file first
+ * so that other processes only see complete caches */
+static void
+_dw_cache_write(const DwarfHandle *self, const gchar *build_id, const gchar *cache_dir)
+{
+  DwarfCacheHeader header;
+  gchar *path = _dw_cache_path(build_id, cache_dir);
+  gchar *temp = g_strdup_printf("%s.XXXXXX", path);
+  FILE *file = NULL;
+  gboolean success;
+  gint fd;
+
+  if (g_mkdir_with_parents(cache_dir, 0755) == -1 ||
+      (fd = g_mkstemp(temp)) == -1)
+    {
+      log_warn("Cannot create symbol cache file", msg_tag_str("filename", path), msg_tag_errno(), NULL);
+      goto exit;
+    }
+
+  /* The cache can be shared by the users of the directory */
+  if (fchmod(fd, 0644) == -1 || !(file = fdopen(fd, "w")))
+    {
+      close(fd);
+      goto error;
+    }
+
+  memset(&header, 0, sizeof(header));
+  header.m_magic = DWARF_CACHE_MAGIC;
+  header.m_version = DWARF_CACHE_VERSION;
+  g_strlcpy(header.m_build_id, build_id, sizeof(header.m_build_id));
+  header.m_line_count = self->m_line_count;
+  header.m_symbol_count = self->m_symbol_count;
+  header.m_file_count = self->m_file_count;
+  header.m_strings_size = self->m_strings_size;
+
+  success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    _dw_cache_write_section(file, self->m_lines, self->m_line_count * sizeof(DwarfLine),
+                            &header.m_lines_offset) &&
+    _dw_cache_write_section(file, self->m_symbols, self->m_symbol_count * sizeof(DwarfSymbol),
+                            &header.m_symbols_offset) &&
+    _dw_cache_write_section(file, self->m_files, self->m_file_count * sizeof(guint32),
+                            &header.m_files_offset) &&
+    _dw_cache_write_section(file, self->m_strings, self->m_strings_size,
+                            &header.m_strings_offset) &&
+    fseek(file, 0, SEEK_SET) == 0 &&
+    fwrite(&header, sizeof(header), 1, file) == 1;
+
+  if (fclose(file) != 0 || !success || rename(temp, path) == -1)
+    goto error;
+
+  log_info("Symbol cache written", msg_tag_str("filename", path), NULL);
+  goto exit;
+
+error:
+  log_warn("Cannot write symbol cache file", msg_tag_str("filename", path), msg_tag_errno(), NULL);
+  unlink(temp);
+
+exit:
+  g_free(temp);
+  g_free(path);
+}
+
+static gboolean
+_dw_cache_section(gsize size, guint64 offset, guint64 count, gsize record, gsize align)
+{
+  return offset % align == 0 && offset <= size && count <= (size - offset) / record;
+}
+
+/* Map the index from the cache. Only the header and the small tables are
+ * checked, the lines are used as they are. */
+static DwarfHandle *
+_dw_cache_map(const gchar *name, const gchar *build_id, const gchar *cache_dir)
+{
+  DwarfHandle *res;
+  const DwarfCacheHeader *header;
+  gchar *path = _dw_cache_path(build_id, cache_dir);
+  gpointer map = MAP_FAILED;
+  struct stat st;
+  guint64 i;
+  gint fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    goto error;
+
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(DwarfCacheHeader))
+    goto error;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    goto error;
+
+  header = (const DwarfCacheHeader *)map;
+  if (header->m_magic != DWARF_CACHE_MAGIC || header->m_version != DWARF_CACHE_VERSION ||
+      strncmp(header->m_build_id, build_id, sizeof(header->m_build_id)) != 0 ||
+      !_dw_cache_section(st.st_size, header->m_lines_offset, header->m_line_count,
+                         sizeof(DwarfLine), sizeof(guint64)) ||
+      !_dw_cache_section(st.st_size, header->m_symbols_offset, header->m_symbol_count,
+                         sizeof(DwarfSymbol), sizeof(guint64)) ||
+      !_dw_cache_section(st.st_size, header->m_files_offset, header->m_file_count,
+                         sizeof(guint32), sizeof(guint32)) ||
+      !_dw_cache_section(st.st_size, header->m_strings_offset, header->m_strings_size, 1, 1) ||
+      header->m_line_count > G_MAXUINT32 || header->m_symbol_count > G_MAXUINT32 ||
+      header->m_file_count == 0 || header->m_strings_size == 0 ||
+      ((const gchar *)map)[header->m_strings_offset + header->m_strings_size - 1] != '\0')
+    goto invalid;
+
+  res = g_new0(DwarfHandle, 1);
+  res->m_filename = g_strdup(name);
+  res->m_fd = -1;
+  res->m_lru_head = DWARF_UNIT_NONE;
+  res->m_lru_tail = DWARF_UNIT_NONE;
+  pthread_mutex_init(&res->m_lock, NULL);
+
+  res->m_map = map;
+  res->m_map_size = st.st_size;
+  res->m_symbols_read = TRUE;
+  res->m_lines = (DwarfLine *)((gchar *)map + header->m_lines_offset);
+  res->m_line_count = header->m_line_count;
+  res->m_symbols = (DwarfSymbol *)((gchar *)map + header->m_symbols_offset);
+  res->m_symbol_count = header->m_symbol_count;
+  res->m_files = (guint32 *)((gchar *)map + header->m_files_offset);
+  res->m_file_count = header->m_file_count;
+  res->m_strings = (gchar *)map + header->m_strings_offset;
+  res->m_strings_size = header->m_strings_size;
+
+  for (i = 0; i < res->m_file_count; i++)
+    {
+      if (res->m_files[i] >= res->m_strings_size)
+        goto invalid_handle;
+    }
+
+  for (i = 0; i < res->m_symbol_count; i++)
+    {
+      if (res->m_symbols[i].m_name >= res->m_strings_size)
+        goto invalid_handle;
+    }
+
+  log_info("Symbol cache loaded", msg_tag_str("filename", path), NULL);
+
+  close(fd);
+  g_free(path);
+  return res;
+
+invalid_handle:
+  dw_destroy(res);
+  map = MAP_FAILED;
+
+invalid:
+  log_warn("Invalid symbol cache file", msg_tag_str("filename", path), NULL);
+
+error:
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+  if (fd != -1)
+    close(fd);
+  g_free(path);
+  return NULL;
+}
+
+/* Build ids are used as file names, anything else is not accepted */
+static gboolean
+_dw_valid_build_id(const gchar *build_id)
+{
+  const gchar *p;
+
+  if (!*build_id || strlen(build_id) >= sizeof(((DwarfCacheHeader *)NULL)->m_build_id))
+    return FALSE;
+
+  for (p = build_id; *p; p++)
+    {
+      if (!g_ascii_isxdigit(*p))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+DwarfHandle *
+dw_new_cached(const gchar *name, const gchar *build_id, const gchar *cache_dir)
+{
+  DwarfHandle *res;
+
+  if (!cache_dir || !build_id || !_dw_valid_build_id(build_id))
+    return dw_new(name);
+
+  if ((res = _dw_cache_map(name, build_id, cache_dir)))
+    return res;
+
+  if (!(res = dw_new(name)))
     return NULL;
 
-  /* Find the nearest line number */
-  for (act = unit->m_entries; act; act = act->next)
+  /* The symbols are stored in the cache too */
+  _dw_load_symbols(res);
+  _dw_index(res);
+  _dw_cache_write(res, build_id, cache_dir);
+
+  return res;
+}
+
+gboolean
+dw_lookup_symbol(DwarfHandle *self, gpointer ptr, const gchar **name, gsize *offset)
+{
+  guint64 address = (guint64)(guintptr)ptr;
+  const DwarfSymbol *symbol;
+  gsize low, high, mid;
+
+  _dw_load_symbols(self);
+
+  low = 0;
+  high = self->m_symbol_count;
+  while (low < high)
+    {
+      mid = low + (high - low) / 2;
+      if (self->m_symbols[mid].m_address <= address)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  if (low == 0)
+    return FALSE;
+
+  /* Symbols without a size only match their own address */
+  symbol = &self->m_symbols[low - 1];
+  if (address - symbol->m_address >= MAX(symbol->m_size, 1))
+    return FALSE;
+
+  *name = self->m_strings + symbol->m_name;
+  *offset = address - symbol->m_address;
+  return TRUE;
+}
+
+/* Index of the last line at or before 'ptr' in [low, high), or -1 */
+static inline gssize
+_dw_find_line(const DwarfLine *lines, gpointer ptr, gsize low, gsize high)
+{
+  guint64 address = (guint64)(guintptr)ptr;
+  gsize start = low, mid;
+
+  while (low < high)
+    {
+      mid = low + (high - low) / 2;
+      if (lines[mid].m_address <= address)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  if (low == start)
+    return -1;
+
+  return low - 1;
+}
+
+static inline gboolean
+_dw_line_entry(const DwarfHandle *self, const DwarfLine *line, DwarfEntry *result)
+{
+  /* Not between two sequences */
+  if (line->m_file == 0 || line->m_file >= self->m_file_count)
+    return FALSE;
+
+  result->m_pointer = DWARF_ADDR_TO_GPOINTER(line->m_address);
+  result->m_source = g_quark_from_string(self->m_strings + self->m_files[line->m_file]);
+  result->m_lineno = line->m_lineno;
+  return TRUE;
+}
+
+static void
+_dw_lru_unlink(DwarfHandle *self, guint32 index)
+{
+  DwarfCompUnit *unit = &self->m_units[index];
+
+  if (unit->m_lru_prev != DWARF_UNIT_NONE)
+    self->m_units[unit->m_lru_prev].m_lru_next = unit->m_lru_next;
+  else
+    self->m_lru_head = unit->m_lru_next;
+
+  if (unit->m_lru_next != DWARF_UNIT_NONE)
+    self->m_units[unit->m_lru_next].m_lru_prev = unit->m_lru_prev;
+  else
+    self->m_lru_tail = unit->m_lru_prev;
+
+  unit->m_lru_prev = DWARF_UNIT_NONE;
+  unit->m_lru_next = DWARF_UNIT_NONE;
+}
+
+static void
+_dw_lru_push(DwarfHandle *self, guint32 index)
+{
+  DwarfCompUnit *unit = &self->m_units[index];
+
+  unit->m_lru_next = self->m_lru_head;
+  if (self->m_lru_head != DWARF_UNIT_NONE)
+    self->m_units[self->m_lru_head].m_lru_prev = index;
+  else
+    self->m_lru_tail = index;
+
+  self->m_lru_head = index;
+}
+
+/* Make sure the line table of a unit is decoded, called with the lock
+ * held */
+static const DwarfCompUnit *
+_dw_unit(DwarfHandle *self, guint32 index)
+{
+  DwarfCompUnit *unit = &self->m_units[index];
+  Dwarf_Debug dbg = (Dwarf_Debug)self->m_debug;
+  Dwarf_Error error = NULL;
+  Dwarf_Die die = NULL;
+  guint32 oldest;
+
+  switch (unit->m_state)
     {
-      entry = (DwarfEntry *)act->data;
-      if (ptr < entry->m_pointer)
+      case DWARF_UNIT_FAILED :
+        return NULL;
+
+      case DWARF_UNIT_RESIDENT :
+        return unit;
+
+      case DWARF_UNIT_DECODED :
+        if (self->m_lru_head != index)
+          {
+            _dw_lru_unlink(self, index);
+            _dw_lru_push(self, index);
+          }
+        return unit;
+
+      default :
         break;
     }
 
-  return entry;
+  if (dwarf_offdie(dbg, unit->m_offset, &die, &error) != DW_DLV_OK ||
+      !_dw_decode_lines(dbg, die, &unit->m_entries, &unit->m_count, &error))
+    {
+      if (error)
+        _dw_log_error("Cannot decode the lines of a compilation unit", dbg, error);
+      if (die)
+        dwarf_dealloc(dbg, die, DW_DLA_DIE);
+
+      unit->m_state = DWARF_UNIT_FAILED;
+      return NULL;
+    }
+  dwarf_dealloc(dbg, die, DW_DLA_DIE);
+
+  if (self->m_decoded == DWARF_MAX_DECODED_UNITS)
+    {
+      oldest = self->m_lru_tail;
+      _dw_lru_unlink(self, oldest);
+
+      g_free(self->m_units[oldest].m_entries);
+      self->m_units[oldest].m_entries = NULL;
+      self->m_units[oldest].m_count = 0;
+      self->m_units[oldest].m_state = DWARF_UNIT_PENDING;
+    }
+  else
+    self->m_decoded++;
+
+  unit->m_state = DWARF_UNIT_DECODED;
+  _dw_lru_push(self, index);
+  return unit;
+}
+
+/* Index of the last range starting at or before 'ptr' in [low, high), or
+ * -1 if 'ptr' is not in it */
+static inline gssize
+_dw_find_range(const DwarfHandle *self, gpointer ptr, gsize low, gsize high)
+{
+  gsize start = low, mid;
+
+  while (low < high)
+    {
+      mid = low + (high - low) / 2;
+      if (self->m_ranges[mid].m_lowpc <= ptr)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  if (low == start || ptr >= self->m_ranges[low - 1].m_highpc)
+    return -1;
+
+  return low - 1;
+}
+
+/* Index of the last row at or before 'ptr' in [low, high), or -1 */
+static inline gssize
+_dw_find_entry(const DwarfEntry *entries, gpointer ptr, gsize low, gsize high)
+{
+  gsize start = low, mid;
+
+  while (low < high)
+    {
+      mid = low + (high - low) / 2;
+      if (entries[mid].m_pointer <= ptr)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  if (low == start)
+    return -1;
+
+  return low - 1;
+}
+
+gboolean
+dw_lookup(DwarfHandle *self, gpointer ptr, DwarfEntry *result)
+{
+  const DwarfCompUnit *unit;
+  gssize index;
+  gboolean found = FALSE;
+
+  if (self->m_lines)
+    {
+      index = _dw_find_line(self->m_lines, ptr, 0, self->m_line_count);
+      return index != -1 && _dw_line_entry(self, &self->m_lines[index], result);
+    }
+
+  if ((index = _dw_find_range(self, ptr, 0, self->m_range_count)) == -1)
+    return FALSE;
+
+  pthread_mutex_lock(&self->m_lock);
+  if ((unit = _dw_unit(self, self->m_ranges[index].m_unit)) &&
+      (index = _dw_find_entry(unit->m_entries, ptr, 0, unit->m_count)) != -1 &&
+      unit->m_entries[index].m_source != 0)
+    {
+      /* Not between two sequences */
+      *result = unit->m_entries[index];
+      found = TRUE;
+    }
+  pthread_mutex_unlock(&self->m_lock);
+
+  return found;
+}
+
+static gint
+_dw_compare_lookups(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const gpointer *ptrs = (const gpointer *)user_data;
+  gpointer ptr_a = ptrs[*(const gsize *)a];
+  gpointer ptr_b = ptrs[*(const gsize *)b];
+
+  if (ptr_a != ptr_b)
+    return (ptr_a < ptr_b ? -1 : 1);
+
+  return 0;
+}
+
+/* Look up many addresses at once. They are resolved in address order, so
+ * each search only covers what is left of the tables after the previous
+ * one, and each unit is decoded at most once. */
+void
+dw_lookup_batch(DwarfHandle *self, const gpointer *ptrs, DwarfEntry *results, gsize count)
+{
+  gsize *order = g_new(gsize, count);
+  const DwarfCompUnit *unit = NULL;
+  gsize i, first_range = 0, first_entry = 0;
+  gssize range, entry;
+  guint32 last_unit = DWARF_UNIT_NONE;
+  gpointer ptr;
+
+  for (i = 0; i < count; i++)
+    order[i] = i;
+  g_qsort_with_data(order, count, sizeof(gsize), _dw_compare_lookups, (gpointer)ptrs);
+
+  if (self->m_lines)
+    {
+      for (i = 0; i < count; i++)
+        {
+          memset(&results[order[i]], 0, sizeof(DwarfEntry));
+          if ((entry = _dw_find_line(self->m_lines, ptrs[order[i]], first_entry, self->m_line_count)) == -1)
+            continue;
+          first_entry = entry;
+
+          _dw_line_entry(self, &self->m_lines[entry], &results[order[i]]);
+        }
+
+      g_free(order);
+      return;
+    }
+
+  pthread_mutex_lock(&self->m_lock);
+  for (i = 0; i < count; i++)
+    {
+      ptr = ptrs[order[i]];
+      memset(&results[order[i]], 0, sizeof(DwarfEntry));
+
+      if ((range = _dw_find_range(self, ptr, first_range, self->m_range_count)) == -1)
+        continue;
+      first_range = range;
+
+      if (self->m_ranges[range].m_unit != last_unit)
+        {
+          last_unit = self->m_ranges[range].m_unit;
+          unit = _dw_unit(self, last_unit);
+          first_entry = 0;
+        }
+
+      if (!unit || (entry = _dw_find_entry(unit->m_entries, ptr, first_entry, unit->m_count)) == -1)
+        continue;
+      first_entry = entry;
+
+      if (unit->m_entries[entry].m_source != 0)
+        results[order[i]] = unit->m_entries[entry];
+    }
+  pthread_mutex_unlock(&self->m_lock);
+
+  g_free(order);
 }
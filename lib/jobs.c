@@ -0,0 +1,595 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include <tinu/jobs.h>
+#include <tinu/log.h>
+#include <tinu/utils.h>
+
+#define JOBS_STOP ((guint32)-1)
+
+typedef struct _JobWorker
+{
+  /** Process ID of the worker (0 if the worker is not running) */
+  pid_t           m_pid;
+
+  /** Test case indices are written here */
+  gint            m_task_fd;
+  /** Test records are read from here */
+  gint            m_result_fd;
+
+  /** Index of the test case being run or -1 if idle */
+  gint            m_current;
+  /** When the current test case was handed out (CLOCK_MONOTONIC, ns) */
+  guint64         m_dispatched;
+} JobWorker;
+
+typedef struct _JobPool
+{
+  TestContext    *m_context;
+  GPtrArray      *m_tests;
+
+  JobWorker      *m_workers;
+  gint            m_count;
+
+  /** Next test case to hand out */
+  guint           m_next;
+} JobPool;
+
+static gboolean
+_jobs_write_full(gint fd, const gchar *data, gsize length)
+{
+  gssize res;
+
+  while (length > 0)
+    {
+      res = write(fd, data, length);
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      data += res;
+      length -= res;
+    }
+  return TRUE;
+}
+
+static gboolean
+_jobs_read_full(gint fd, gchar *data, gsize length)
+{
+  gssize res;
+
+  while (length > 0)
+    {
+      res = read(fd, data, length);
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      if (res == 0)
+        return FALSE;
+
+      data += res;
+      length -= res;
+    }
+  return TRUE;
+}
+
+/* Worker side */
+
+static void
+_jobs_worker_main(JobPool *pool, gint task_fd, gint result_fd)
+{
+  GString *frame = g_string_sized_new(4096);
+  TestRecord *record;
+  guint32 index, length;
+
+  while (_jobs_read_full(task_fd, (gchar *)&index, sizeof(index)) && index != JOBS_STOP)
+    {
+      record = test_case_run_recorded(pool->m_context,
+        (TestCase *)g_ptr_array_index(pool->m_tests, index));
+
+      /* Frame: payload length followed by the serialized record */
+      g_string_truncate(frame, 0);
+      g_string_append_len(frame, (const gchar *)&length, sizeof(length));
+      test_record_serialize(record, frame);
+      test_record_free(record);
+
+      length = frame->len - sizeof(length);
+      memcpy(frame->str, &length, sizeof(length));
+
+      fflush(NULL);
+      if (!_jobs_write_full(result_fd, frame->str, frame->len))
+        break;
+    }
+
+  fflush(NULL);
+  _exit(0);
+}
+
+/* Pool side */
+
+static void
+_jobs_worker_close(JobWorker *worker)
+{
+  close(worker->m_task_fd);
+  close(worker->m_result_fd);
+
+  worker->m_pid = 0;
+  worker->m_current = -1;
+}
+
+static gboolean
+_jobs_worker_start(JobPool *pool, JobWorker *worker)
+{
+  gint task[2], result[2];
+  pid_t pid;
+  gint i;
+
+  if (pipe(task) == -1)
+    {
+      log_error("Cannot create task pipe for worker", msg_tag_errno(), NULL);
+      return FALSE;
+    }
+
+  if (pipe(result) == -1)
+    {
+      log_error("Cannot create result pipe for worker", msg_tag_errno(), NULL);
+      close(task[0]);
+      close(task[1]);
+      return FALSE;
+    }
+
+  /* Avoid duplicating buffered output in the worker */
+  fflush(NULL);
+
+  pid = fork();
+  if (pid == -1)
+    {
+      log_error("Cannot start worker process", msg_tag_errno(), NULL);
+      close(task[0]);
+      close(task[1]);
+      close(result[0]);
+      close(result[1]);
+      return FALSE;
+    }
+
+  if (pid == 0)
+    {
+      close(task[1]);
+      close(result[0]);
+
+      for (i = 0; i < pool->m_count; i++)
+        {
+          if (&pool->m_workers[i] != worker && pool->m_workers[i].m_pid > 0)
+            {
+              close(pool->m_workers[i].m_task_fd);
+              close(pool->m_workers[i].m_result_fd);
+            }
+        }
+
+      _jobs_worker_main(pool, task[0], result[1]);
+    }
+
+  close(task[0]);
+  close(result[1]);
+
+  worker->m_pid = pid;
+  worker->m_task_fd = task[1];
+  worker->m_result_fd = result[0];
+  worker->m_current = -1;
+
+  log_debug("Worker process started", msg_tag_int("pid", pid), NULL);
+  return TRUE;
+}
+
+static void
+_jobs_worker_stop(JobWorker *worker)
+{
+  guint32 stop = JOBS_STOP;
+  gint status;
+
+  _jobs_write_full(worker->m_task_fd, (const gchar *)&stop, sizeof(stop));
+  close(worker->m_task_fd);
+  close(worker->m_result_fd);
+
+  while (waitpid(worker->m_pid, &status, 0) == -1 && errno == EINTR)
+    ;
+
+  worker->m_pid = 0;
+}
+
+static gboolean
+_jobs_worker_dispatch(JobPool *pool, JobWorker *worker)
+{
+  guint32 index = pool->m_next;
+
+  if (index >= pool->m_tests->len)
+    return TRUE;
+
+  if (!_jobs_write_full(worker->m_task_fd, (const gchar *)&index, sizeof(index)))
+    return FALSE;
+
+  worker->m_current = index;
+  worker->m_dispatched = tinu_clock_ns(CLOCK_MONOTONIC);
+  pool->m_next++;
+  return TRUE;
+}
+
+static TestRecord *_jobs_record_failure(TestCase *test, TestCaseResult result,
+                                        const gchar *reason, guint64 wall_time);
+
+static TestRecord *
+_jobs_worker_receive(JobPool *pool, JobWorker *worker)
+{
+  TestCase *test = (TestCase *)g_ptr_array_index(pool->m_tests, worker->m_current);
+  TestRecord *res;
+  guint32 length;
+  gchar *data;
+
+  if (!_jobs_read_full(worker->m_result_fd, (gchar *)&length, sizeof(length)))
+    return NULL;
+
+  data = g_malloc(length);
+  if (!_jobs_read_full(worker->m_result_fd, data, length))
+    {
+      g_free(data);
+      return NULL;
+    }
+
+  res = test_record_deserialize(test, data, length);
+  g_free(data);
+
+  /* The worker is still in sync, only the result of the test case is lost */
+  if (!res)
+    res = _jobs_record_failure(test, TEST_INTERNAL, "Malformed test record received from worker",
+                               tinu_clock_ns(CLOCK_MONOTONIC) - worker->m_dispatched);
+  return res;
+}
+
+static TestRecord *
+_jobs_record_failure(TestCase *test, TestCaseResult result, const gchar *reason,
+                     guint64 wall_time)
+{
+  TestRecord *record = test_record_new(test);
+  TestCaseTiming timing = { wall_time, 0 };
+  Message *msg;
+
+  msg = msg_create(LOG_ERR, reason,
+                   msg_tag_str("suite", test->m_suite->m_name),
+                   msg_tag_str("case", test->m_name), NULL);
+
+  test_record_hook(record, TEST_HOOK_BEFORE_TEST, test);
+  test_record_message(record, msg);
+  if (result == TEST_SEGFAULT)
+    test_record_hook(record, TEST_HOOK_SIGNAL_SEGFAULT);
+  else if (result == TEST_ABORT)
+    test_record_hook(record, TEST_HOOK_SIGNAL_ABORT);
+  test_record_hook(record, TEST_HOOK_AFTER_TEST, test, result, &timing);
+
+  msg_destroy(msg);
+  return record;
+}
+
+static gint
+_jobs_worker_restart(JobPool *pool, JobWorker *worker)
+{
+  pid_t pid = worker->m_pid;
+  gint status = 0;
+
+  kill(pid, SIGKILL);
+  _jobs_worker_close(worker);
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+
+  log_warn("Worker process lost, restarting",
+           msg_tag_int("pid", pid),
+           msg_tag_int("status", status), NULL);
+
+  if (!_jobs_worker_start(pool, worker))
+    log_error("Cannot restart worker process", NULL);
+
+  return status;
+}
+
+static TestRecord *
+_jobs_worker_lost(JobPool *pool, JobWorker *worker, guint index)
+{
+  TestCaseResult result = TEST_INTERNAL;
+  guint64 wall_time = tinu_clock_ns(CLOCK_MONOTONIC) - worker->m_dispatched;
+  gint status = _jobs_worker_restart(pool, worker);
+
+  if (WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV)
+    result = TEST_SEGFAULT;
+  else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT)
+    result = TEST_ABORT;
+
+  /* The CPU time used by the test case is lost with the worker */
+  return _jobs_record_failure((TestCase *)g_ptr_array_index(pool->m_tests, index), result,
+                              "Worker process terminated while running test case",
+                              wall_time);
+}
+
+gboolean
+test_jobs_run(TestContext *context, GPtrArray *tests, TestJobDoneCb done, gpointer user_data)
+{
+  JobPool pool;
+  JobWorker *worker;
+  TestRecord *record;
+  struct pollfd *fds;
+  gint *fd_worker;
+  guint finished = 0, index;
+  gint i, nfds, started = 0;
+  sighandler_t old_sigpipe;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.m_context = context;
+  pool.m_tests = tests;
+  pool.m_count = MIN(context->m_jobs, (gint)tests->len);
+
+  if (pool.m_count <= 0)
+    return TRUE;
+
+  pool.m_workers = g_new0(JobWorker, pool.m_count);
+  fds = g_new0(struct pollfd, pool.m_count);
+  fd_worker = g_new0(gint, pool.m_count);
+
+  /* A dead worker must not kill the main process */
+  old_sigpipe = signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < pool.m_count; i++)
+    {
+      if (_jobs_worker_start(&pool, &pool.m_workers[i]))
+        started++;
+    }
+
+  if (started == 0)
+    {
+      signal(SIGPIPE, old_sigpipe);
+      g_free(fd_worker);
+      g_free(fds);
+      g_free(pool.m_workers);
+      return FALSE;
+    }
+
+  log_debug("Running test cases in parallel",
+            msg_tag_int("workers", started),
+            msg_tag_int("tests", tests->len), NULL);
+
+  for (i = 0; i < pool.m_count; i++)
+    {
+      if (pool.m_workers[i].m_pid > 0)
+        _jobs_worker_dispatch(&pool, &pool.m_workers[i]);
+    }
+
+  while (finished < tests->len)
+    {
+      for (i = 0, nfds = 0; i < pool.m_count; i++)
+        {
+          if (pool.m_workers[i].m_pid > 0 && pool.m_workers[i].m_current >= 0)
+            {
+              fds[nfds].fd = pool.m_workers[i].m_result_fd;
+              fds[nfds].events = POLLIN;
+              fds[nfds].revents = 0;
+              fd_worker[nfds++] = i;
+            }
+        }
+
+      /* All workers are lost */
+      if (nfds == 0)
+        break;
+
+      if (poll(fds, nfds, -1) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          log_error("Cannot poll worker processes", msg_tag_errno(), NULL);
+          break;
+        }
+
+      for (i = 0; i < nfds; i++)
+        {
+          if (!fds[i].revents)
+            continue;
+
+          worker = &pool.m_workers[fd_worker[i]];
+          index = worker->m_current;
+
+          record = _jobs_worker_receive(&pool, worker);
+          if (!record)
+            record = _jobs_worker_lost(&pool, worker, index);
+
+          worker->m_current = -1;
+          finished++;
+          done(index, record, user_data);
+
+          if (worker->m_pid > 0 && !_jobs_worker_dispatch(&pool, worker))
+            {
+              /* The worker died before receiving the test case */
+              _jobs_worker_restart(&pool, worker);
+              if (worker->m_pid > 0)
+                _jobs_worker_dispatch(&pool, worker);
+            }
+        }
+    }
+
+  /* Test cases that could not be handed out or whose worker was lost */
+  for (i = 0; i < pool.m_count; i++)
+    {
+      worker = &pool.m_workers[i];
+      if (worker->m_pid > 0 && worker->m_current >= 0)
+        {
+          index = worker->m_current;
+          done(index, _jobs_worker_lost(&pool, worker, index), user_data);
+        }
+    }
+
+  for (; pool.m_next < tests->len; pool.m_next++)
+    {
+      done(pool.m_next,
+           _jobs_record_failure((TestCase *)g_ptr_array_index(tests, pool.m_next), TEST_INTERNAL,
+                                "No worker process left to run test case", 0),
+           user_data);
+    }
+
+  for (i = 0; i < pool.m_count; i++)
+    {
+      if (pool.m_workers[i].m_pid > 0)
+        _jobs_worker_stop(&pool.m_workers[i]);
+    }
+
+  signal(SIGPIPE, old_sigpipe);
+
+  g_free(fd_worker);
+  g_free(fds);
+  g_free(pool.m_workers);
+  return TRUE;
+}
+
+/* Job count detection */
+
+static gboolean
+_jobs_read_values(const gchar *path, gint64 *first, gint64 *second)
+{
+  gchar *contents = NULL;
+  gint count;
+
+  if (!g_file_get_contents(path, &contents, NULL, NULL))
+    return FALSE;
+
+  if (second)
+    count = sscanf(contents, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT, first, second);
+  else
+    count = sscanf(contents, "%" G_GINT64_FORMAT, first);
+  g_free(contents);
+
+  return count == (second ? 2 : 1);
+}
+
+static gchar *
+_jobs_cgroup_v2_dir(void)
+{
+  gchar *contents = NULL;
+  gchar **lines;
+  gchar *res = NULL;
+  gint i;
+
+  if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+    return NULL;
+
+  lines = g_strsplit(contents, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      if (g_str_has_prefix(lines[i], "0::"))
+        {
+          res = g_build_filename("/sys/fs/cgroup", lines[i] + 3, NULL);
+          break;
+        }
+    }
+
+  g_strfreev(lines);
+  g_free(contents);
+  return res;
+}
+
+static gint
+_jobs_cgroup_cpus(void)
+{
+  gint64 quota = -1, period = 0;
+  gchar *dir, *path;
+  gboolean found = FALSE;
+
+  /* cgroup v2: "<quota> <period>" or "max <period>" */
+  if (NULL != (dir = _jobs_cgroup_v2_dir()))
+    {
+      path = g_build_filename(dir, "cpu.max", NULL);
+      found = _jobs_read_values(path, &quota, &period);
+      g_free(path);
+      g_free(dir);
+    }
+
+  if (!found)
+    found = _jobs_read_values("/sys/fs/cgroup/cpu.max", &quota, &period);
+
+  /* cgroup v1 */
+  if (!found &&
+      _jobs_read_values("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", &quota, NULL) &&
+      _jobs_read_values("/sys/fs/cgroup/cpu/cpu.cfs_period_us", &period, NULL))
+    found = TRUE;
+
+  if (!found || quota <= 0 || period <= 0)
+    return -1;
+
+  return (gint)((quota + period - 1) / period);
+}
+
+gint
+test_jobs_auto(void)
+{
+  cpu_set_t set;
+  gint res, quota;
+
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    res = CPU_COUNT(&set);
+  else
+    res = sysconf(_SC_NPROCESSORS_ONLN);
+
+  quota = _jobs_cgroup_cpus();
+  if (quota > 0 && quota < res)
+    res = quota;
+
+  log_debug("Detected number of usable CPUs",
+            msg_tag_int("cpus", res),
+            msg_tag_int("cgroup_quota", quota), NULL);
+
+  return MAX(res, 1);
+}
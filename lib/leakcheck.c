@@ -0,0 +1,161 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/*
+ * Leak checker for arbitrary programs: tinu-leakcheck preloads this library
+ * (built from the leakwatch and backtrace sources of libtinu) into the
+ * checked program. The whole run is watched and the leaks still allocated
+ * at exit are reported, grouped by allocation site. Forked children report
+ * on their own, including what they inherited from the parent.
+ *
+ * The options are passed in the environment:
+ *   TINU_LEAKCHECK_SAMPLE     sample interval in bytes (0 tracks everything)
+ *   TINU_LEAKCHECK_DEPTH      maximal backtrace depth
+ *   TINU_LEAKCHECK_SITES      number of allocation sites reported (0 for all)
+ *   TINU_LEAKCHECK_LOG        report file (standard error by default)
+ *   TINU_LEAKCHECK_EXITCODE   exit code of the program if leaks are found
+ *   TINU_LEAKCHECK_UNWINDER   stack walker (libc, frame-pointer or eh-frame)
+ *   TINU_LEAKCHECK_SYMBOL_CACHE  directory caching the symbol index of the modules
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include <tinu/log.h>
+#include <tinu/leakwatch.h>
+#include <tinu/backtrace.h>
+
+static gpointer g_leakcheck_watch = NULL;
+static GHashTable *g_leakcheck_result = NULL;
+
+static FILE *g_leakcheck_log = NULL;
+static guint g_leakcheck_sites = LEAKWATCH_REPORT_SITES;
+static gint g_leakcheck_exitcode = 0;
+
+static gboolean
+_leakcheck_option(const gchar *name, gulong *value)
+{
+  const gchar *str = getenv(name);
+  gchar *end;
+
+  if (!str || !*str)
+    return FALSE;
+
+  errno = 0;
+  *value = strtoul(str, &end, 10);
+  if (errno || *end)
+    {
+      log_warn("Invalid leak check option ignored",
+               msg_tag_str("option", name),
+               msg_tag_str("value", str), NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void __attribute__((constructor))
+_leakcheck_start(void)
+{
+  const gchar *log_file = getenv("TINU_LEAKCHECK_LOG");
+  const gchar *unwinder = getenv("TINU_LEAKCHECK_UNWINDER");
+  const gchar *symbol_cache = getenv("TINU_LEAKCHECK_SYMBOL_CACHE");
+  gulong sample = 0, depth = 0, value;
+
+  if (log_file && *log_file && !(g_leakcheck_log = fopen(log_file, "a")))
+    fprintf(stderr, "tinu-leakcheck: cannot open %s, reporting to stderr\n", log_file);
+  /* Programs may close stderr at exit, before the report */
+  if (!g_leakcheck_log)
+    g_leakcheck_log = fdopen(dup(STDERR_FILENO), "w");
+  if (!g_leakcheck_log)
+    g_leakcheck_log = stderr;
+
+  log_register_message_handler(msg_file_handler, LOG_WARNING, (gpointer)g_leakcheck_log);
+
+  _leakcheck_option("TINU_LEAKCHECK_SAMPLE", &sample);
+  _leakcheck_option("TINU_LEAKCHECK_DEPTH", &depth);
+  if (_leakcheck_option("TINU_LEAKCHECK_SITES", &value))
+    g_leakcheck_sites = value;
+  if (_leakcheck_option("TINU_LEAKCHECK_EXITCODE", &value))
+    g_leakcheck_exitcode = value;
+
+  if (unwinder && *unwinder &&
+      !backtrace_set_unwinder(tinu_lookup_name(BacktraceUnwinder_names, unwinder, -1, -1)))
+    log_warn("Invalid leak check unwinder ignored",
+             msg_tag_str("unwinder", unwinder), NULL);
+
+  if (symbol_cache && *symbol_cache)
+    backtrace_set_symbol_cache(symbol_cache);
+
+  tinu_leakwatch_configure(sample, depth);
+  g_leakcheck_watch = tinu_leakwatch_simple(&g_leakcheck_result);
+}
+
+static void __attribute__((destructor))
+_leakcheck_stop(void)
+{
+  LeakwatchProfile profile;
+  gsize leaked;
+  guint count;
+
+  if (!g_leakcheck_watch)
+    return;
+
+  tinu_leakwatch_simple_profile(g_leakcheck_watch, &profile);
+  tinu_unregister_watch(g_leakcheck_watch);
+  g_leakcheck_watch = NULL;
+
+  leaked = tinu_leakwatch_summary(g_leakcheck_result);
+  count = g_hash_table_size(g_leakcheck_result);
+
+  tinu_leakwatch_simple_report(g_leakcheck_result, LOG_WARNING, g_leakcheck_sites);
+  log_warn("Leak check summary",
+           msg_tag_int("pid", getpid()),
+           msg_tag_printf("allocs", "%" G_GUINT64_FORMAT, profile.m_allocs),
+           msg_tag_printf("alloc_bytes", "%" G_GUINT64_FORMAT, profile.m_alloc_bytes),
+           msg_tag_printf("peak_bytes", "%" G_GUINT64_FORMAT, profile.m_peak_bytes),
+           msg_tag_int("leaks", count),
+           msg_tag_printf("leaked_bytes", "%" G_GSIZE_FORMAT, leaked), NULL);
+
+  fflush(g_leakcheck_log);
+  g_hash_table_destroy(g_leakcheck_result);
+  g_leakcheck_result = NULL;
+
+  /* The streams of the program are not flushed yet */
+  if (count && g_leakcheck_exitcode)
+    {
+      fflush(NULL);
+      _exit(g_leakcheck_exitcode);
+    }
+}
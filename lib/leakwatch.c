@@ -28,287 +28,1605 @@
 * Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
 #include <malloc.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include <tinu/utils.h>
+#include <tinu/leakwatch.h>
+
+/* The allocator of the C library. The malloc family exported below
+ * interposes the libc functions for the whole process (libtinu is loaded
+ * before libc), so the real implementation has to be called through its
+ * internal names. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* The mapping functions have no such names, they are looked up once */
+static void *(*g_leakwatch_mmap)(void *, size_t, int, int, int, off_t) = NULL;
+static void *(*g_leakwatch_mmap64)(void *, size_t, int, int, int, off64_t) = NULL;
+static void *(*g_leakwatch_mremap)(void *, size_t, size_t, int, ...) = NULL;
+static int (*g_leakwatch_munmap)(void *, size_t) = NULL;
+
+/*
+ * Allocation events are not delivered to the watches right away. Every
+ * thread appends them to its own ring buffer (no locking, the thread is
+ * the only producer) and the rings are drained in batches: by the owner
+ * when its ring is full and by everyone when a watch is registered or
+ * unregistered. Simple leak watches keep their allocations in a sharded
+ * table, so threads draining at the same time rarely contend.
+ *
+ * The events of different threads are drained in no particular order,
+ * so every event carries a global sequence number. The table keeps the
+ * sequence number of the last event of each pointer and drops events
+ * older than that, which makes a free and a reallocation of the same
+ * address by two threads safe. Freed pointers are kept in the table
+ * until every older event has been applied (see _leakwatch_watermark()).
+ */
+
+/* Number of events buffered per thread */
+#define LEAKWATCH_RING_SIZE 256
+/* Number of events dispatched at once (copied to the stack) */
+#define LEAKWATCH_BATCH_SIZE 32
+/* Number of shards in the pointer table of a simple watch (power of two) */
+#define LEAKWATCH_SHARDS 64
+/* Initial number of slots of a shard (power of two) */
+#define LEAKWATCH_TABLE_MIN_SLOTS 256
+/* Size of the chunks entries are allocated from */
+#define LEAKWATCH_SLAB_SIZE (16 * 1024)
+
+#define LEAKWATCH_SEQ_NONE G_MAXUINT64
+
+typedef struct _LeakwatchEvent
+{
+  guint64             m_seq;
+  /* Sequence number of the free side of the operation (taken before the
+   * old block was released) */
+  guint64             m_free_seq;
+  LeakwatchOperation  m_operation;
+  gpointer            m_oldptr;
+  gpointer            m_ptr;
+  gsize               m_size;
+  BacktraceId         m_trace;
+  /* Tracked by the simple watches */
+  gboolean            m_sampled;
+} LeakwatchEvent;
+
+typedef struct _LeakwatchRing LeakwatchRing;
+struct _LeakwatchRing
+{
+  /* Written by the owner thread only */
+  volatile gint       m_head;
+  /* Written by the drainer (holding m_lock) only */
+  volatile gint       m_tail;
+
+  /* Lower bound of the sequence number being reserved by the owner (set
+   * until the event is published) and of the batch being dispatched by
+   * the drainer. Together with the unread events these tell which events
+   * may not have reached the tables yet, see _leakwatch_watermark(). */
+  volatile guint64    m_reserved;
+  volatile guint64    m_dispatching;
+
+  /* Serializes drainers */
+  pthread_mutex_t     m_lock;
+  pthread_t           m_owner;
+
+  LeakwatchRing      *m_prev;
+  LeakwatchRing      *m_next;
+
+  LeakwatchEvent      m_events[LEAKWATCH_RING_SIZE];
+};
+
+typedef struct _LeakwatchEntry
+{
+  /* Must be the first member, the result table frees entries as MemoryEntry */
+  MemoryEntry         m_entry;
+
+  guint64             m_seq;
+  gboolean            m_freed;
+} LeakwatchEntry;
+
+/* Entries are carved from chunks mapped directly from the kernel, so the
+ * table never calls the allocator it is watching */
+typedef struct _LeakwatchSlab LeakwatchSlab;
+struct _LeakwatchSlab
+{
+  LeakwatchSlab      *m_next;
+  guint32             m_used;
+
+  LeakwatchEntry      m_entries[];
+};
+
+typedef struct _LeakwatchSlot
+{
+  gpointer            m_ptr;
+  LeakwatchEntry     *m_entry;
+} LeakwatchSlot;
+
+/* Open addressing table with linear probing. Deleting shifts the rest of
+ * the cluster back instead of leaving a deleted marker, so probes never
+ * get longer than the clusters of the live keys. */
+typedef struct _LeakwatchShard
+{
+  pthread_mutex_t     m_lock;
+
+  LeakwatchSlot      *m_slots;
+  guint32             m_mask;
+  guint32             m_used;
+  guint32             m_freed;
+
+  LeakwatchSlab      *m_slabs;
+  LeakwatchEntry     *m_free_entries;
+
+  guint64             m_lookups;
+  guint64             m_probes;
+  guint32             m_max_probe;
+
+  /* Heap profile (estimates when sampling) */
+  gdouble             m_allocs;
+  gdouble             m_alloc_bytes;
+  gdouble             m_histogram[LEAKWATCH_SIZE_CLASSES];
+} LeakwatchShard;
+
+struct _Leakwatch
+{
+  gpointer            m_user_data;
+  AllocCallback       m_callback;
+
+  /* Events older than the watch are not delivered */
+  guint64             m_start_seq;
+
+  /* Serializes the callback */
+  pthread_mutex_t     m_lock;
+
+  /* Simple watches only (m_callback is NULL) */
+  LeakwatchShard     *m_shards;
+  GHashTable         *m_result;
+
+  /* Bytes held by the tracked allocations */
+  volatile gint64     m_live;
+  volatile gint64     m_peak;
+};
+
+static GSList *g_leakwatch_list = NULL;
+static gboolean g_leakwatch_init = FALSE;
+
+/* Number of registered watches and counters, checked without locking on
+ * every allocation so an unwatched process only pays for a load and a
+ * branch */
+static volatile gint g_leakwatch_active = 0;
+/* Number of registered watches */
+static volatile gint g_leakwatch_count = 0;
+/* Number of callback watches, they need the unsampled events too */
+static volatile gint g_leakwatch_callbacks = 0;
+
+/* Number of net allocation counter users and the counters (the usable
+ * size of the blocks is counted, it is known on both sides) */
+static volatile gint g_leakwatch_counters = 0;
+static volatile gint64 g_leakwatch_net_blocks = 0;
+static volatile gint64 g_leakwatch_net_bytes = 0;
+
+/* Mean sampling interval in bytes (0 tracks every allocation) */
+static gsize g_leakwatch_sample = 0;
+/* Frames recorded per allocation */
+static guint32 g_leakwatch_depth = MAX_DEPTH;
+
+/* Event sequence counter */
+static volatile guint64 g_leakwatch_seq = 0;
+
+/* Guards g_leakwatch_list (readers are the drainers). These are pthread
+ * locks because the glib ones may allocate memory when first locked. */
+static pthread_rwlock_t g_leakwatch_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Guards g_leakwatch_rings */
+static pthread_mutex_t g_leakwatch_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static LeakwatchRing *g_leakwatch_rings = NULL;
+
+/* Anonymous mappings created while the watcher is active, keyed by their
+ * start address (open addressing with deleted markers). Only unmaps and
+ * remaps of these are reported: file mappings, mappings older than the
+ * watch and partial unmaps are not allocations the watch has seen. */
+typedef struct _LeakwatchMapping
+{
+  gpointer            m_addr;
+  gsize               m_length;
+} LeakwatchMapping;
+
+#define LEAKWATCH_MAPPING_DELETED ((gpointer)1)
+#define LEAKWATCH_MAPPINGS_MIN_SIZE 64
+
+static LeakwatchMapping *g_leakwatch_mappings = NULL;
+static gsize g_leakwatch_mappings_size = 0;
+/* Slots in use, deleted ones included */
+static gsize g_leakwatch_mappings_used = 0;
+/* Live mappings, checked without locking */
+static volatile gint g_leakwatch_mappings_count = 0;
+static pthread_mutex_t g_leakwatch_mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t g_leakwatch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_leakwatch_ring_key;
+
+/* Set while the current thread is inside the leak watcher. Allocations
+ * done by the watcher itself (backtraces, callbacks) are not reported.
+ * Initial-exec TLS is used because the dynamic model may allocate. */
+static __thread gint g_leakwatch_busy __attribute__((tls_model("initial-exec"))) = 0;
+static __thread LeakwatchRing *g_leakwatch_ring __attribute__((tls_model("initial-exec"))) = NULL;
+/* Sampler state: bytes until the next sample and the random generator */
+static __thread gint64 g_leakwatch_sample_left __attribute__((tls_model("initial-exec"))) = 0;
+static __thread guint64 g_leakwatch_random __attribute__((tls_model("initial-exec"))) = 0;
+/* Innermost allocation budget of the thread */
+static __thread LeakwatchBudget *g_leakwatch_budget __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread guint g_leakwatch_budget_depth __attribute__((tls_model("initial-exec"))) = 0;
+
+#define LEAKWATCH_ACTIVE() \
+  G_UNLIKELY(g_atomic_int_get(&g_leakwatch_active) > 0 && !g_leakwatch_busy)
+
+/* Pointer table */
+
+static inline guint64
+_leakwatch_hash(gpointer ptr)
+{
+  /* Fibonacci hashing, the low bits of a pointer are mostly alignment */
+  return ((guint64)(gsize)ptr >> 4) * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15);
+}
+
+static inline LeakwatchShard *
+_leakwatch_shard(struct _Leakwatch *self, gpointer ptr)
+{
+  return &self->m_shards[_leakwatch_hash(ptr) >> 58];
+}
+
+static inline guint32
+_leakwatch_home(LeakwatchShard *shard, gpointer ptr)
+{
+  /* The top bits select the shard */
+  return (guint32)(_leakwatch_hash(ptr) >> 26) & shard->m_mask;
+}
+
+static gpointer
+_leakwatch_map(gsize size)
+{
+  gpointer res = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  return res == MAP_FAILED ? NULL : res;
+}
+
+static LeakwatchEntry *
+_leakwatch_entry_new(LeakwatchShard *shard)
+{
+  LeakwatchEntry *res = shard->m_free_entries;
+  LeakwatchSlab *slab = shard->m_slabs;
+
+  if (res)
+    {
+      shard->m_free_entries = (LeakwatchEntry *)res->m_entry.m_ptr;
+      return res;
+    }
+
+  if (!slab || sizeof(LeakwatchSlab) + (slab->m_used + 1) * sizeof(LeakwatchEntry) > LEAKWATCH_SLAB_SIZE)
+    {
+      if (!(slab = (LeakwatchSlab *)_leakwatch_map(LEAKWATCH_SLAB_SIZE)))
+        return NULL;
+
+      slab->m_next = shard->m_slabs;
+      shard->m_slabs = slab;
+    }
+
+  return &slab->m_entries[slab->m_used++];
+}
+
+static void
+_leakwatch_entry_release(LeakwatchShard *shard, LeakwatchEntry *entry)
+{
+  entry->m_entry.m_ptr = (gpointer)shard->m_free_entries;
+  shard->m_free_entries = entry;
+}
+
+/* Returns the slot of the pointer or the empty slot where it belongs */
+static guint32
+_leakwatch_table_find(LeakwatchShard *shard, gpointer ptr)
+{
+  guint32 index = _leakwatch_home(shard, ptr);
+  guint32 probes = 1;
+
+  while (shard->m_slots[index].m_ptr && shard->m_slots[index].m_ptr != ptr)
+    {
+      index = (index + 1) & shard->m_mask;
+      probes++;
+    }
+
+  shard->m_lookups++;
+  shard->m_probes += probes;
+  if (probes > shard->m_max_probe)
+    shard->m_max_probe = probes;
+
+  return index;
+}
+
+static gboolean
+_leakwatch_table_resize(LeakwatchShard *shard, guint32 size)
+{
+  LeakwatchSlot *old = shard->m_slots;
+  guint32 old_size = (old ? shard->m_mask + 1 : 0);
+  guint32 i, index;
+
+  if (!(shard->m_slots = (LeakwatchSlot *)_leakwatch_map(size * sizeof(LeakwatchSlot))))
+    {
+      shard->m_slots = old;
+      return FALSE;
+    }
+
+  shard->m_mask = size - 1;
+  for (i = 0; i < old_size; i++)
+    {
+      if (!old[i].m_ptr)
+        continue;
+
+      index = _leakwatch_home(shard, old[i].m_ptr);
+      while (shard->m_slots[index].m_ptr)
+        index = (index + 1) & shard->m_mask;
+
+      shard->m_slots[index] = old[i];
+    }
+
+  if (old)
+    munmap(old, old_size * sizeof(LeakwatchSlot));
+
+  return TRUE;
+}
+
+static void
+_leakwatch_table_delete(LeakwatchShard *shard, guint32 index)
+{
+  guint32 next, home;
+
+  for (next = (index + 1) & shard->m_mask; shard->m_slots[next].m_ptr;
+       next = (next + 1) & shard->m_mask)
+    {
+      /* Move the entry back unless its home is between the hole and its slot */
+      home = _leakwatch_home(shard, shard->m_slots[next].m_ptr);
+      if (((next - home) & shard->m_mask) >= ((next - index) & shard->m_mask))
+        {
+          shard->m_slots[index] = shard->m_slots[next];
+          index = next;
+        }
+    }
+
+  shard->m_slots[index].m_ptr = NULL;
+  shard->m_slots[index].m_entry = NULL;
+  shard->m_used--;
+}
+
+/* The sequence number below which every event has been applied to the
+ * tables. Returns FALSE when it can not be determined without waiting. */
+static gboolean
+_leakwatch_watermark(guint64 *result)
+{
+  LeakwatchRing *ring;
+  guint64 res, seq;
+  gint tail;
+
+  if (pthread_mutex_trylock(&g_leakwatch_rings_lock) != 0)
+    return FALSE;
+
+  /* Anything reserved from now on is newer than this */
+  res = __sync_fetch_and_add(&g_leakwatch_seq, 0);
+
+  for (ring = g_leakwatch_rings; ring; ring = ring->m_next)
+    {
+      /* The owner sets m_reserved before taking a sequence number and
+       * clears it after publishing, the drainer sets m_dispatching before
+       * consuming events and clears it after applying them, so reading
+       * them in this order misses no event. */
+      seq = ring->m_reserved;
+      res = MIN(res, seq);
+
+      __sync_synchronize();
+      tail = g_atomic_int_get(&ring->m_tail);
+      if (tail != g_atomic_int_get(&ring->m_head))
+        res = MIN(res, ring->m_events[tail].m_free_seq);
+
+      __sync_synchronize();
+      seq = ring->m_dispatching;
+      res = MIN(res, seq);
+    }
+
+  pthread_mutex_unlock(&g_leakwatch_rings_lock);
+
+  *result = res;
+  return TRUE;
+}
+
+/* Drop the freed entries no pending event can refer to */
+static void
+_leakwatch_table_sweep(LeakwatchShard *shard)
+{
+  LeakwatchEntry *entry;
+  guint64 watermark;
+  guint32 start, index;
+
+  if (!shard->m_freed || !_leakwatch_watermark(&watermark))
+    return;
+
+  /* Start after an empty slot, deleting never moves entries across it */
+  for (start = 0; shard->m_slots[start].m_ptr; start++)
+    ;
+
+  index = (start + 1) & shard->m_mask;
+  while (index != start)
+    {
+      entry = shard->m_slots[index].m_entry;
+      if (entry && entry->m_freed && entry->m_seq < watermark)
+        {
+          _leakwatch_table_delete(shard, index);
+          _leakwatch_entry_release(shard, entry);
+          shard->m_freed--;
+          continue;
+        }
+
+      index = (index + 1) & shard->m_mask;
+    }
+}
+
+/* Must be called with the shard locked. Returns NULL if the event is
+ * older than what the table knows about the pointer. */
+static LeakwatchEntry *
+_leakwatch_table_claim(LeakwatchShard *shard, gpointer ptr, guint64 seq)
+{
+  LeakwatchEntry *entry;
+  guint32 index, size;
+
+  if (!shard->m_slots && !_leakwatch_table_resize(shard, LEAKWATCH_TABLE_MIN_SLOTS))
+    return NULL;
+
+  index = _leakwatch_table_find(shard, ptr);
+  entry = shard->m_slots[index].m_entry;
+
+  if (entry && entry->m_seq > seq)
+    return NULL;
+
+  if (entry)
+    return entry;
+
+  /* Keep the load under one half. Freed entries are swept before
+   * growing, so the table follows the live allocations. */
+  size = shard->m_mask + 1;
+  if ((shard->m_used + 1) * 2 > size)
+    {
+      _leakwatch_table_sweep(shard);
+      if (shard->m_used * 4 > size && !_leakwatch_table_resize(shard, size * 2))
+        return NULL;
+
+      index = _leakwatch_table_find(shard, ptr);
+    }
+
+  if (!(entry = _leakwatch_entry_new(shard)))
+    return NULL;
+
+  memset(entry, 0, sizeof(LeakwatchEntry));
+  entry->m_entry.m_ptr = ptr;
+  entry->m_freed = TRUE;
+  shard->m_freed++;
+
+  shard->m_slots[index].m_ptr = ptr;
+  shard->m_slots[index].m_entry = entry;
+  shard->m_used++;
+
+  return entry;
+}
+
+static void
+_leakwatch_table_set(LeakwatchShard *shard, LeakwatchEntry *entry, guint64 seq, gsize size,
+                     BacktraceId origin, BacktraceId last)
+{
+  if (entry->m_freed)
+    shard->m_freed--;
+
+  entry->m_seq = seq;
+  entry->m_freed = FALSE;
+  entry->m_entry.m_size = size;
+  entry->m_entry.m_origin = origin;
+  entry->m_entry.m_last = last;
+}
+
+static void
+_leakwatch_table_free(LeakwatchShard *shard, LeakwatchEntry *entry, guint64 seq)
+{
+  _leakwatch_table_set(shard, entry, seq, 0, BACKTRACE_ID_NONE, BACKTRACE_ID_NONE);
+  entry->m_freed = TRUE;
+  shard->m_freed++;
+}
+
+/* Heap profile */
+
+static inline guint32
+_leakwatch_size_class(gsize size)
+{
+  guint32 res = 0;
+
+  while (size >>= 1)
+    res++;
+
+  return MIN(res, LEAKWATCH_SIZE_CLASSES - 1);
+}
+
+/* Must be called with the shard locked */
+static void
+_leakwatch_profile_alloc(LeakwatchShard *shard, gsize size)
+{
+  gsize bytes = tinu_leakwatch_scale(size);
+  gdouble count = (size ? (gdouble)bytes / size : 1.0);
+
+  shard->m_allocs += count;
+  shard->m_alloc_bytes += bytes;
+  shard->m_histogram[_leakwatch_size_class(size)] += count;
+}
+
+static void
+_leakwatch_profile_live(struct _Leakwatch *self, gint64 delta)
+{
+  gint64 live, peak;
+
+  if (!delta)
+    return;
+
+  live = __sync_add_and_fetch(&self->m_live, delta);
+  for (peak = self->m_peak; live > peak; peak = self->m_peak)
+    {
+      if (__sync_bool_compare_and_swap(&self->m_peak, peak, live))
+        break;
+    }
+}
+
+static void
+_leakwatch_table_apply(struct _Leakwatch *self, const LeakwatchEvent *event)
+{
+  LeakwatchShard *shard;
+  LeakwatchEntry *entry;
+  BacktraceId origin = BACKTRACE_ID_NONE;
+  LeakwatchOperation kind = tinu_leakwatch_operation_kind(event->m_operation);
+  gboolean known = FALSE;
+  gint64 delta = 0;
+
+  /* A sampled reallocation in place updates the entry of the block, it is
+   * not freed and allocated again */
+  if (kind == LEAKWATCH_OPERATION_REALLOC && event->m_oldptr == event->m_ptr &&
+      event->m_sampled)
+    {
+      shard = _leakwatch_shard(self, event->m_ptr);
+      pthread_mutex_lock(&shard->m_lock);
+
+      _leakwatch_profile_alloc(shard, event->m_size);
+      entry = _leakwatch_table_claim(shard, event->m_ptr, event->m_seq);
+      if (entry && !entry->m_freed)
+        {
+          delta = tinu_leakwatch_scale(event->m_size) - tinu_leakwatch_scale(entry->m_entry.m_size);
+          entry->m_entry.m_last = event->m_trace;
+          entry->m_entry.m_size = event->m_size;
+          entry->m_seq = event->m_seq;
+        }
+
+      pthread_mutex_unlock(&shard->m_lock);
+      _leakwatch_profile_live(self, delta);
+      return;
+    }
+
+  if (kind != LEAKWATCH_OPERATION_MALLOC)
+    {
+      shard = _leakwatch_shard(self, event->m_oldptr);
+      pthread_mutex_lock(&shard->m_lock);
+
+      entry = _leakwatch_table_claim(shard, event->m_oldptr, event->m_free_seq);
+      if (entry)
+        {
+          known = !entry->m_freed;
+          origin = entry->m_entry.m_origin;
+          if (known)
+            delta -= tinu_leakwatch_scale(entry->m_entry.m_size);
+          _leakwatch_table_free(shard, entry, event->m_free_seq);
+        }
+
+      pthread_mutex_unlock(&shard->m_lock);
+    }
+
+  /* An unsampled reallocation only frees the old block */
+  if (kind == LEAKWATCH_OPERATION_FREE || !event->m_sampled)
+    {
+      _leakwatch_profile_live(self, delta);
+      return;
+    }
+
+  shard = _leakwatch_shard(self, event->m_ptr);
+  pthread_mutex_lock(&shard->m_lock);
+
+  _leakwatch_profile_alloc(shard, event->m_size);
+
+  /* Reallocations of blocks allocated before the watch are not tracked */
+  if (kind == LEAKWATCH_OPERATION_REALLOC && !known)
+    entry = NULL;
+  else
+    entry = _leakwatch_table_claim(shard, event->m_ptr, event->m_seq);
+
+  if (entry)
+    {
+      if (!entry->m_freed)
+        delta -= tinu_leakwatch_scale(entry->m_entry.m_size);
+      delta += tinu_leakwatch_scale(event->m_size);
+    }
+
+  if (entry && kind == LEAKWATCH_OPERATION_MALLOC)
+    _leakwatch_table_set(shard, entry, event->m_seq, event->m_size,
+                         event->m_trace, BACKTRACE_ID_NONE);
+  else if (entry)
+    _leakwatch_table_set(shard, entry, event->m_seq, event->m_size,
+                         origin, event->m_trace);
+
+  pthread_mutex_unlock(&shard->m_lock);
+  _leakwatch_profile_live(self, delta);
+}
+
+static void
+_leakwatch_table_stats(struct _Leakwatch *self, LeakwatchTableStats *stats)
+{
+  LeakwatchShard *shard;
+  LeakwatchSlab *slab;
+  gint i;
+
+  memset(stats, 0, sizeof(LeakwatchTableStats));
+  for (i = 0; i < LEAKWATCH_SHARDS; i++)
+    {
+      shard = &self->m_shards[i];
+      pthread_mutex_lock(&shard->m_lock);
+
+      stats->m_live += shard->m_used - shard->m_freed;
+      stats->m_freed += shard->m_freed;
+      if (shard->m_slots)
+        {
+          stats->m_slots += shard->m_mask + 1;
+          stats->m_mapped += (shard->m_mask + 1) * sizeof(LeakwatchSlot);
+        }
+      for (slab = shard->m_slabs; slab; slab = slab->m_next)
+        stats->m_mapped += LEAKWATCH_SLAB_SIZE;
+
+      stats->m_lookups += shard->m_lookups;
+      stats->m_probes += shard->m_probes;
+      stats->m_max_probe = MAX(stats->m_max_probe, shard->m_max_probe);
+
+      pthread_mutex_unlock(&shard->m_lock);
+    }
+}
+
+/* Copy the live entries into the result table and unmap the shards */
+static void
+_leakwatch_table_collect(struct _Leakwatch *self)
+{
+  LeakwatchShard *shard;
+  LeakwatchSlab *slab;
+  MemoryEntry *entry;
+  guint32 index;
+  gint i;
+
+  for (i = 0; i < LEAKWATCH_SHARDS; i++)
+    {
+      shard = &self->m_shards[i];
+      for (index = 0; shard->m_slots && index <= shard->m_mask; index++)
+        {
+          if (!shard->m_slots[index].m_entry || shard->m_slots[index].m_entry->m_freed)
+            continue;
+
+          entry = t_new(MemoryEntry, 1);
+          *entry = shard->m_slots[index].m_entry->m_entry;
+          g_hash_table_insert(self->m_result, entry->m_ptr, entry);
+        }
+
+      if (shard->m_slots)
+        munmap(shard->m_slots, (shard->m_mask + 1) * sizeof(LeakwatchSlot));
+
+      while ((slab = shard->m_slabs))
+        {
+          shard->m_slabs = slab->m_next;
+          munmap(slab, LEAKWATCH_SLAB_SIZE);
+        }
+
+      pthread_mutex_destroy(&shard->m_lock);
+    }
+
+  t_free(self->m_shards);
+  self->m_shards = NULL;
+}
+
+/* Event rings */
+
+static void
+_leakwatch_dispatch(const LeakwatchEvent *events, gint count)
+{
+  struct _Leakwatch *lw;
+  GSList *act;
+  gint i;
+
+  pthread_rwlock_rdlock(&g_leakwatch_lock);
+  for (act = g_leakwatch_list; act; act = act->next)
+    {
+      lw = (struct _Leakwatch *)act->data;
+
+      if (lw->m_callback)
+        pthread_mutex_lock(&lw->m_lock);
+
+      for (i = 0; i < count; i++)
+        {
+          if (events[i].m_seq < lw->m_start_seq)
+            continue;
+
+          if (lw->m_callback)
+            lw->m_callback(events[i].m_operation, events[i].m_oldptr, events[i].m_ptr,
+                           events[i].m_size, events[i].m_trace, lw->m_user_data);
+          else
+            _leakwatch_table_apply(lw, &events[i]);
+        }
+
+      if (lw->m_callback)
+        pthread_mutex_unlock(&lw->m_lock);
+    }
+  pthread_rwlock_unlock(&g_leakwatch_lock);
+}
+
+static void
+_leakwatch_ring_drain(LeakwatchRing *ring)
+{
+  LeakwatchEvent batch[LEAKWATCH_BATCH_SIZE];
+  gint head, tail, count;
+
+  g_leakwatch_busy++;
+  pthread_mutex_lock(&ring->m_lock);
+
+  head = g_atomic_int_get(&ring->m_head);
+  tail = ring->m_tail;
+  while (tail != head)
+    {
+      for (count = 0; tail != head && count < LEAKWATCH_BATCH_SIZE; count++)
+        {
+          batch[count] = ring->m_events[tail];
+          tail = (tail + 1) % LEAKWATCH_RING_SIZE;
+        }
+
+      /* Free the slots before dispatching, so the owner can go on */
+      ring->m_dispatching = batch[0].m_free_seq;
+      __sync_synchronize();
+      g_atomic_int_set(&ring->m_tail, tail);
+      _leakwatch_dispatch(batch, count);
+      __sync_synchronize();
+      ring->m_dispatching = LEAKWATCH_SEQ_NONE;
+    }
+
+  pthread_mutex_unlock(&ring->m_lock);
+  g_leakwatch_busy--;
+}
+
+static void
+_leakwatch_drain_all(void)
+{
+  LeakwatchRing *ring;
+
+  pthread_mutex_lock(&g_leakwatch_rings_lock);
+  for (ring = g_leakwatch_rings; ring; ring = ring->m_next)
+    _leakwatch_ring_drain(ring);
+  pthread_mutex_unlock(&g_leakwatch_rings_lock);
+}
+
+static void
+_leakwatch_ring_unlink(LeakwatchRing *ring)
+{
+  if (ring->m_prev)
+    ring->m_prev->m_next = ring->m_next;
+  else
+    g_leakwatch_rings = ring->m_next;
+
+  if (ring->m_next)
+    ring->m_next->m_prev = ring->m_prev;
+}
+
+/* Thread exit: deliver the remaining events and free the ring */
+static void
+_leakwatch_ring_destroy(gpointer data)
+{
+  LeakwatchRing *ring = (LeakwatchRing *)data;
+
+  g_leakwatch_busy++;
+
+  pthread_mutex_lock(&g_leakwatch_rings_lock);
+  _leakwatch_ring_drain(ring);
+  _leakwatch_ring_unlink(ring);
+  pthread_mutex_unlock(&g_leakwatch_rings_lock);
+
+  g_leakwatch_ring = NULL;
+  pthread_mutex_destroy(&ring->m_lock);
+  __libc_free(ring);
+
+  g_leakwatch_busy--;
+}
+
+/* A forking thread can not leave locks held by other threads behind */
+static void
+_leakwatch_atfork_prepare(void)
+{
+  LeakwatchRing *ring;
+
+  pthread_mutex_lock(&g_leakwatch_rings_lock);
+  for (ring = g_leakwatch_rings; ring; ring = ring->m_next)
+    pthread_mutex_lock(&ring->m_lock);
+  pthread_rwlock_wrlock(&g_leakwatch_lock);
+  pthread_mutex_lock(&g_leakwatch_mappings_lock);
+}
+
+static void
+_leakwatch_atfork_parent(void)
+{
+  LeakwatchRing *ring;
+
+  pthread_mutex_unlock(&g_leakwatch_mappings_lock);
+  pthread_rwlock_unlock(&g_leakwatch_lock);
+  for (ring = g_leakwatch_rings; ring; ring = ring->m_next)
+    pthread_mutex_unlock(&ring->m_lock);
+  pthread_mutex_unlock(&g_leakwatch_rings_lock);
+}
+
+static void
+_leakwatch_atfork_child(void)
+{
+  LeakwatchRing *ring, *next;
+
+  /* The rwlock remembers the thread holding it for writing, which has a
+   * new id in the child: the locks are reinitialized instead of unlocked */
+  pthread_rwlock_init(&g_leakwatch_lock, NULL);
+  pthread_mutex_init(&g_leakwatch_rings_lock, NULL);
+  pthread_mutex_init(&g_leakwatch_mappings_lock, NULL);
+
+  /* Only the forking thread exists in the child, the events of the others
+   * belong to the parent */
+  for (ring = g_leakwatch_rings; ring; ring = next)
+    {
+      next = ring->m_next;
+      if (ring == g_leakwatch_ring)
+        {
+          pthread_mutex_init(&ring->m_lock, NULL);
+          continue;
+        }
+
+      _leakwatch_ring_unlink(ring);
+      __libc_free(ring);
+    }
+}
+
+static void
+_leakwatch_init(void)
+{
+  pthread_key_create(&g_leakwatch_ring_key, _leakwatch_ring_destroy);
+  pthread_atfork(_leakwatch_atfork_prepare, _leakwatch_atfork_parent, _leakwatch_atfork_child);
+}
+
+static LeakwatchRing *
+_leakwatch_ring_new(void)
+{
+  LeakwatchRing *ring = (LeakwatchRing *)__libc_calloc(1, sizeof(LeakwatchRing));
+
+  if (!ring)
+    return NULL;
+
+  pthread_mutex_init(&ring->m_lock, NULL);
+  ring->m_owner = pthread_self();
+  ring->m_reserved = LEAKWATCH_SEQ_NONE;
+  ring->m_dispatching = LEAKWATCH_SEQ_NONE;
+
+  pthread_mutex_lock(&g_leakwatch_rings_lock);
+  ring->m_next = g_leakwatch_rings;
+  if (g_leakwatch_rings)
+    g_leakwatch_rings->m_prev = ring;
+  g_leakwatch_rings = ring;
+  pthread_mutex_unlock(&g_leakwatch_rings_lock);
+
+  pthread_setspecific(g_leakwatch_ring_key, ring);
+  return ring;
+}
+
+static LeakwatchRing *
+_leakwatch_ring_current(void)
+{
+  if (G_LIKELY(g_leakwatch_ring != NULL))
+    return g_leakwatch_ring;
+
+  g_leakwatch_busy++;
+  pthread_once(&g_leakwatch_once, _leakwatch_init);
+  g_leakwatch_ring = _leakwatch_ring_new();
+  g_leakwatch_busy--;
+
+  return g_leakwatch_ring;
+}
+
+/* The reservation is announced in the ring until the event is published */
+static inline guint64
+_leakwatch_next_seq(LeakwatchRing *ring)
+{
+  if (ring && ring->m_reserved == LEAKWATCH_SEQ_NONE)
+    ring->m_reserved = g_leakwatch_seq;
+
+  return __sync_fetch_and_add(&g_leakwatch_seq, 1);
+}
+
+/* A reserved sequence number is not published after all (the call failed
+ * or nobody watches anymore), it must not hold back the watermark */
+static inline void
+_leakwatch_release_seq(void)
+{
+  if (g_leakwatch_ring)
+    g_leakwatch_ring->m_reserved = LEAKWATCH_SEQ_NONE;
+}
+
+/* Sampling */
+
+static gint64
+_leakwatch_sample_interval(void)
+{
+  guint64 x = g_leakwatch_random;
+  gdouble u;
+
+  /* xorshift64* */
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  g_leakwatch_random = x;
+
+  /* Uniform in (0, 1], the intervals are exponentially distributed */
+  u = ((x * G_GUINT64_CONSTANT(0x2545F4914F6CDD1D) >> 11) + 1) / 9007199254740992.0;
+  return (gint64)(-log(u) * g_leakwatch_sample) + 1;
+}
+
+/* Every byte allocated is a sampling point with probability 1/interval,
+ * an allocation is sampled if it contains at least one of them */
+static gboolean
+_leakwatch_sampled(gsize size)
+{
+  if (!g_leakwatch_sample)
+    return TRUE;
+
+  if (G_UNLIKELY(!g_leakwatch_random))
+    {
+      g_leakwatch_random = (tinu_clock_ns(CLOCK_MONOTONIC) ^ (guint64)(gsize)&g_leakwatch_random) | 1;
+      g_leakwatch_sample_left = _leakwatch_sample_interval();
+    }
+
+  g_leakwatch_sample_left -= size;
+  if (g_leakwatch_sample_left > 0)
+    return FALSE;
+
+  g_leakwatch_sample_left = _leakwatch_sample_interval();
+  return TRUE;
+}
+
+/* Allocation budgets */
+
+static void __attribute__((noinline))
+_leakwatch_budget_charge(LeakwatchBudget *budget, gsize size)
+{
+  budget->m_allocs++;
+  budget->m_bytes += size;
+
+  if (budget->m_allocs <= budget->m_max_allocs || budget->m_trace_count >= LEAKWATCH_BUDGET_TRACES)
+    return;
+
+  /* Skip this function, _leakwatch_alert() and the allocator */
+  g_leakwatch_busy++;
+  budget->m_traces[budget->m_trace_count++] = backtrace_intern_current(g_leakwatch_depth, 3);
+  g_leakwatch_busy--;
+}
+
+/* Net allocation counters */
+
+static inline void
+_leakwatch_count(gint64 blocks, gint64 bytes)
+{
+  __sync_fetch_and_add(&g_leakwatch_net_blocks, blocks);
+  __sync_fetch_and_add(&g_leakwatch_net_bytes, bytes);
+}
+
+static void
+_leakwatch_alert(LeakwatchOperation op, guint64 free_seq, gpointer oldptr, gpointer ptr, gsize size)
+{
+  LeakwatchRing *ring;
+  LeakwatchEvent *event;
+  LeakwatchOperation kind = tinu_leakwatch_operation_kind(op);
+  gint saved_errno = errno;
+  gboolean sampled;
+  guint64 seq;
+  gint head, next;
+
+  if (g_leakwatch_budget && kind != LEAKWATCH_OPERATION_FREE)
+    _leakwatch_budget_charge(g_leakwatch_budget, size);
+
+  /* Reallocations are counted by the callers, the old size is needed */
+  if (g_atomic_int_get(&g_leakwatch_counters))
+    {
+      if (op == LEAKWATCH_OPERATION_MMAP)
+        _leakwatch_count(1, size);
+      else if (op == LEAKWATCH_OPERATION_MUNMAP)
+        _leakwatch_count(-1, -(gint64)size);
+      else if (kind == LEAKWATCH_OPERATION_MALLOC)
+        _leakwatch_count(1, malloc_usable_size(ptr));
+      else if (kind == LEAKWATCH_OPERATION_FREE)
+        _leakwatch_count(-1, -(gint64)malloc_usable_size(oldptr));
+    }
+
+  if (!g_atomic_int_get(&g_leakwatch_count))
+    {
+      _leakwatch_release_seq();
+      return;
+    }
+
+  /* Nobody is interested in an unsampled allocation */
+  sampled = (kind != LEAKWATCH_OPERATION_FREE && _leakwatch_sampled(size));
+  if (!sampled && kind == LEAKWATCH_OPERATION_MALLOC && !g_atomic_int_get(&g_leakwatch_callbacks))
+    {
+      _leakwatch_release_seq();
+      return;
+    }
+
+  g_leakwatch_busy++;
+
+#ifdef TRACK_ALERTS
+  fprintf(stderr, "[track] op=%d old=%p res=%p size=%d\n", op, oldptr, ptr, size);
+#endif
+
+  ring = _leakwatch_ring_current();
+  seq = _leakwatch_next_seq(ring);
+  if (!ring)
+    goto exit;
+
+  head = ring->m_head;
+  next = (head + 1) % LEAKWATCH_RING_SIZE;
+  if (next == g_atomic_int_get(&ring->m_tail))
+    _leakwatch_ring_drain(ring);
+
+  event = &ring->m_events[head];
+  event->m_seq = seq;
+  event->m_free_seq = (kind == LEAKWATCH_OPERATION_FREE ? seq : free_seq);
+  event->m_operation = op;
+  event->m_oldptr = oldptr;
+  event->m_ptr = ptr;
+  event->m_size = size;
+  event->m_sampled = sampled;
+  event->m_trace = (sampled || !g_leakwatch_sample ?
+                    backtrace_intern_current(g_leakwatch_depth, 2) : BACKTRACE_ID_NONE);
+
+  /* Publish the event */
+  g_atomic_int_set(&ring->m_head, next);
+  ring->m_reserved = LEAKWATCH_SEQ_NONE;
+
+exit:
+  g_leakwatch_busy--;
+  errno = saved_errno;
+}
+
+/* Interposed allocator */
+
+void *
+malloc(size_t size)
+{
+  void *res = __libc_malloc(size);
+
+  if (LEAKWATCH_ACTIVE() && res)
+    _leakwatch_alert(LEAKWATCH_OPERATION_MALLOC, 0, NULL, res, size);
 
-#include <glib.h>
+  return res;
+}
 
-#include <tinu/utils.h>
-#include <tinu/leakwatch.h>
+void *
+calloc(size_t nmemb, size_t size)
+{
+  void *res = __libc_calloc(nmemb, size);
 
-static GSList *g_leakwatch_list = NULL;
-static gint g_leakwatch_count = 0;
-static gboolean g_leakwatch_init = FALSE;
+  if (LEAKWATCH_ACTIVE() && res)
+    _leakwatch_alert(LEAKWATCH_OPERATION_MALLOC, 0, NULL, res, nmemb * size);
 
-static void *(*g_leakwatch_malloc)(size_t, const void *) = NULL;
-static void *(*g_leakwatch_realloc)(void *, size_t, const void *) = NULL;
-static void  (*g_leakwatch_free)(void *, const void *) = NULL;
+  return res;
+}
 
-struct _Leakwatch
+void *
+realloc(void *ptr, size_t size)
 {
-  gpointer        m_user_data;
-  AllocCallback   m_callback;
-};
+  void *res;
+  guint64 free_seq = 0;
+  gsize old_size = 0;
 
-void _hook_pause();
-void _hook_resume();
+  if (!LEAKWATCH_ACTIVE())
+    return __libc_realloc(ptr, size);
 
-void
-_leakwatch_alert(LeakwatchOperation op, gpointer oldptr, gpointer ptr, gsize size)
-{
-  struct _Leakwatch *cb;
-  Backtrace *trace = backtrace_create(4);
-  GSList *act;
+  if (ptr && size == 0)
+    {
+      _leakwatch_alert(LEAKWATCH_OPERATION_FREE, 0, ptr, NULL, 0);
+      return __libc_realloc(ptr, size);
+    }
 
-#ifdef TRACK_ALERTS
-  fprintf(stderr, "[track] op=%d old=%p res=%p size=%d\n", op, oldptr, ptr, size);
-#endif
+  /* A moved block can be reused by another thread as soon as realloc
+   * releases it, so the free side is ordered before the call */
+  if (ptr && g_atomic_int_get(&g_leakwatch_count))
+    free_seq = _leakwatch_next_seq(_leakwatch_ring_current());
 
-  for (act = g_leakwatch_list; act; act = act->next)
+  if (ptr && g_atomic_int_get(&g_leakwatch_counters))
+    old_size = malloc_usable_size(ptr);
+
+  res = __libc_realloc(ptr, size);
+  if (!res)
+    {
+      _leakwatch_release_seq();
+      return res;
+    }
+
+  if (!ptr)
+    _leakwatch_alert(LEAKWATCH_OPERATION_MALLOC, 0, NULL, res, size);
+  else
     {
-      cb = (struct _Leakwatch *)act->data;
-      cb->m_callback(op, oldptr, ptr, size, trace, cb->m_user_data);
+      if (g_atomic_int_get(&g_leakwatch_counters))
+        _leakwatch_count(0, (gint64)malloc_usable_size(res) - (gint64)old_size);
+
+      _leakwatch_alert(LEAKWATCH_OPERATION_REALLOC, free_seq, ptr, res, size);
     }
 
-  backtrace_unreference(trace);
+  return res;
 }
 
-void *
-_leakwatch_malloc(size_t size, const void *caller)
+void
+free(void *ptr)
 {
-  void *res;
+  /* Report before freeing, so the address cannot be reused by another
+   * thread before the watchers forget it */
+  if (LEAKWATCH_ACTIVE() && ptr)
+    _leakwatch_alert(LEAKWATCH_OPERATION_FREE, 0, ptr, NULL, 0);
 
-  _hook_pause();
+  __libc_free(ptr);
+}
 
-  res = g_leakwatch_malloc ? g_leakwatch_malloc(size, caller) : malloc(size);
-  if (res)
-    _leakwatch_alert(LEAKWATCH_OPERATION_MALLOC, NULL, res, size);
+void *
+memalign(size_t alignment, size_t size)
+{
+  void *res = __libc_memalign(alignment, size);
+
+  if (LEAKWATCH_ACTIVE() && res)
+    _leakwatch_alert(LEAKWATCH_OPERATION_MALLOC, 0, NULL, res, size);
 
-  _hook_resume();
   return res;
 }
 
 void *
-_leakwatch_realloc(void *ptr, size_t newsize, const void *caller)
+aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
 {
   void *res;
 
-  _hook_pause();
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
 
-  res = g_leakwatch_realloc ? g_leakwatch_realloc(ptr, newsize, caller) : realloc(ptr, newsize);
-  if (res)
-    _leakwatch_alert(LEAKWATCH_OPERATION_REALLOC, ptr, res, newsize);
+  res = memalign(alignment, size);
+  if (!res)
+    return ENOMEM;
 
-  _hook_resume();
-  return res;
+  *memptr = res;
+  return 0;
 }
 
-void
-_leakwatch_free(void *ptr, const void *caller)
+/* Interposed mappings */
+
+static void
+_leakwatch_resolve_mappings(void)
 {
-  _hook_pause();
+  /* Racing threads store the same values */
+  g_leakwatch_mmap64 = dlsym(RTLD_NEXT, "mmap64");
+  g_leakwatch_mremap = dlsym(RTLD_NEXT, "mremap");
+  g_leakwatch_munmap = dlsym(RTLD_NEXT, "munmap");
+  g_atomic_pointer_set(&g_leakwatch_mmap, dlsym(RTLD_NEXT, "mmap"));
+}
 
-  _leakwatch_alert(LEAKWATCH_OPERATION_FREE, ptr, NULL, 0);
+#define LEAKWATCH_RESOLVE_MAPPINGS() \
+  do { if (G_UNLIKELY(!g_atomic_pointer_get(&g_leakwatch_mmap))) _leakwatch_resolve_mappings(); } while (0)
 
-  if (g_leakwatch_free)
-    g_leakwatch_free(ptr, caller);
-  else
-    free(ptr);
+/* Slot of the mapping starting at 'addr', or of the first free slot.
+ * Called with the mapping lock held and a non-empty table. */
+static LeakwatchMapping *
+_leakwatch_mapping_slot(gpointer addr)
+{
+  gsize mask = g_leakwatch_mappings_size - 1;
+  gsize i = (gsize)(_leakwatch_hash(addr) >> 32) & mask;
 
-  _hook_resume();
+  while (g_leakwatch_mappings[i].m_addr && g_leakwatch_mappings[i].m_addr != addr)
+    i = (i + 1) & mask;
+
+  return &g_leakwatch_mappings[i];
 }
 
-void
-_hook_pause()
+static void
+_leakwatch_mapping_insert(gpointer addr, gsize length)
 {
-  if (g_leakwatch_count > 0)
+  LeakwatchMapping *old, *slot;
+  gsize old_size, i;
+
+  pthread_mutex_lock(&g_leakwatch_mappings_lock);
+
+  /* Rehashed at half load, which drops the deleted slots as well */
+  if ((g_leakwatch_mappings_used + 1) * 2 > g_leakwatch_mappings_size)
+    {
+      old = g_leakwatch_mappings;
+      old_size = g_leakwatch_mappings_size;
+
+      g_leakwatch_mappings_size = MAX(LEAKWATCH_MAPPINGS_MIN_SIZE,
+                                      (gsize)g_atomic_int_get(&g_leakwatch_mappings_count) * 4);
+      g_leakwatch_mappings = __libc_calloc(g_leakwatch_mappings_size, sizeof(LeakwatchMapping));
+      g_leakwatch_mappings_used = 0;
+
+      for (i = 0; i < old_size; i++)
+        {
+          if (old[i].m_addr && old[i].m_addr != LEAKWATCH_MAPPING_DELETED)
+            {
+              *_leakwatch_mapping_slot(old[i].m_addr) = old[i];
+              g_leakwatch_mappings_used++;
+            }
+        }
+      __libc_free(old);
+    }
+
+  slot = _leakwatch_mapping_slot(addr);
+  if (!slot->m_addr)
     {
-      __malloc_hook = NULL;
-      __realloc_hook = NULL;
-      __free_hook = NULL;
+      g_leakwatch_mappings_used++;
+      g_atomic_int_inc(&g_leakwatch_mappings_count);
     }
+  slot->m_addr = addr;
+  slot->m_length = length;
+
+  pthread_mutex_unlock(&g_leakwatch_mappings_lock);
 }
 
-void
-_hook_resume()
+/* Forget the mapping if 'length' covers the whole of it, returns its
+ * length if it was tracked */
+static gsize
+_leakwatch_mapping_remove(gpointer addr, gsize length)
 {
-  if (g_leakwatch_count > 0)
+  LeakwatchMapping *slot;
+  gsize page = getpagesize(), res = 0;
+
+  if (!g_atomic_int_get(&g_leakwatch_mappings_count))
+    return 0;
+
+  pthread_mutex_lock(&g_leakwatch_mappings_lock);
+
+  slot = _leakwatch_mapping_slot(addr);
+  if (slot->m_addr == addr &&
+      (length + page - 1) / page >= (slot->m_length + page - 1) / page)
     {
-      __malloc_hook = _leakwatch_malloc;
-      __realloc_hook = _leakwatch_realloc;
-      __free_hook = _leakwatch_free;
+      res = slot->m_length;
+      slot->m_addr = LEAKWATCH_MAPPING_DELETED;
+      g_atomic_int_add(&g_leakwatch_mappings_count, -1);
     }
+
+  pthread_mutex_unlock(&g_leakwatch_mappings_lock);
+  return res;
 }
 
-void
-_memory_entry_destroy(gpointer obj)
+void *
+mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-  MemoryEntry *self = (MemoryEntry *)obj;
+  void *res;
 
-  backtrace_unreference(self->m_origin);
-  backtrace_unreference(self->m_last);
-  t_free(obj);
+  LEAKWATCH_RESOLVE_MAPPINGS();
+  res = g_leakwatch_mmap(addr, length, prot, flags, fd, offset);
+
+  /* File mappings are not counted as allocations */
+  if (LEAKWATCH_ACTIVE() && res != MAP_FAILED && (flags & MAP_ANONYMOUS))
+    {
+      _leakwatch_mapping_insert(res, length);
+      _leakwatch_alert(LEAKWATCH_OPERATION_MMAP, 0, NULL, res, length);
+    }
+
+  return res;
 }
 
-void
-_tinu_leakwatch_simple_callback(LeakwatchOperation operation,
-  gpointer oldptr, gpointer ptr, gsize size,
-  Backtrace *trace,
-  gpointer user_data)
+void *
+mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
 {
-  GHashTable *self = g_hash_table_ref((GHashTable *)user_data);
-  MemoryEntry *entry, *oldentry;
+  void *res;
 
-  switch (operation)
+  LEAKWATCH_RESOLVE_MAPPINGS();
+  res = g_leakwatch_mmap64(addr, length, prot, flags, fd, offset);
+
+  if (LEAKWATCH_ACTIVE() && res != MAP_FAILED && (flags & MAP_ANONYMOUS))
     {
-      case LEAKWATCH_OPERATION_MALLOC :
-        entry = t_new(MemoryEntry, 1);
+      _leakwatch_mapping_insert(res, length);
+      _leakwatch_alert(LEAKWATCH_OPERATION_MMAP, 0, NULL, res, length);
+    }
 
-        entry->m_ptr = ptr;
-        entry->m_size = size;
-        entry->m_origin = backtrace_reference(trace);
+  return res;
+}
 
-        g_hash_table_insert(self, ptr, entry);
-        break;
+void *
+mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+  void *res;
+  void *new_address = NULL;
+  guint64 free_seq = 0;
+  gsize tracked;
+  va_list args;
 
-      case LEAKWATCH_OPERATION_REALLOC :
-        oldentry = (MemoryEntry *)g_hash_table_lookup(self, oldptr);
+  LEAKWATCH_RESOLVE_MAPPINGS();
+  if (flags & MREMAP_FIXED)
+    {
+      va_start(args, flags);
+      new_address = va_arg(args, void *);
+      va_end(args);
+    }
 
-        if (!oldentry)
-          break;
+  /* Only remaps of whole tracked mappings are reported */
+  tracked = _leakwatch_mapping_remove(old_address, old_size);
+  if (!tracked || !LEAKWATCH_ACTIVE())
+    return g_leakwatch_mremap(old_address, old_size, new_size, flags, new_address);
 
-        if (ptr == oldptr)
-          {
-            if (oldentry->m_last)
-              backtrace_unreference(oldentry->m_last);
-            oldentry->m_last = backtrace_reference(trace);
-            oldentry->m_size = size;
-            break;
-          }
+  /* Ordered before the call, like the free side of realloc() */
+  if (g_atomic_int_get(&g_leakwatch_count))
+    free_seq = _leakwatch_next_seq(_leakwatch_ring_current());
 
-        entry = t_new(MemoryEntry, 1);
+  res = g_leakwatch_mremap(old_address, old_size, new_size, flags, new_address);
+  if (res == MAP_FAILED)
+    {
+      _leakwatch_mapping_insert(old_address, tracked);
+      _leakwatch_release_seq();
+      return res;
+    }
 
-        entry->m_ptr = ptr;
-        entry->m_size = size;
-        entry->m_origin = (oldentry ? backtrace_reference(oldentry->m_origin) : NULL);
-        entry->m_last = backtrace_reference(trace);
+  _leakwatch_mapping_insert(res, new_size);
+  if (g_atomic_int_get(&g_leakwatch_counters))
+    _leakwatch_count(0, (gint64)new_size - (gint64)tracked);
 
-        g_hash_table_remove(self, oldptr);
-        g_hash_table_insert(self, ptr, entry);
-        break;
+  _leakwatch_alert(LEAKWATCH_OPERATION_MREMAP, free_seq, old_address, res, new_size);
+  return res;
+}
 
-      case LEAKWATCH_OPERATION_FREE :
-        g_hash_table_remove(self, oldptr);
-        break;
+int
+munmap(void *addr, size_t length)
+{
+  gsize tracked;
 
-      default :
-        g_assert_not_reached();
-    }
+  LEAKWATCH_RESOLVE_MAPPINGS();
+
+  /* Reported before unmapping, see free(). Only whole tracked mappings
+   * are, the others were never reported as allocated. */
+  tracked = (addr ? _leakwatch_mapping_remove(addr, length) : 0);
+  if (tracked && LEAKWATCH_ACTIVE())
+    _leakwatch_alert(LEAKWATCH_OPERATION_MUNMAP, 0, addr, NULL, tracked);
+
+  return g_leakwatch_munmap(addr, length);
+}
+
+/* C++ allocator */
+
+gpointer
+tinu_leakwatch_new(gsize size, gsize alignment)
+{
+  gpointer res = (alignment ? __libc_memalign(alignment, size) : __libc_malloc(size));
+
+  if (LEAKWATCH_ACTIVE() && res)
+    _leakwatch_alert(LEAKWATCH_OPERATION_NEW, 0, NULL, res, size);
+
+  return res;
+}
+
+void
+tinu_leakwatch_delete(gpointer ptr)
+{
+  if (LEAKWATCH_ACTIVE() && ptr)
+    _leakwatch_alert(LEAKWATCH_OPERATION_DELETE, 0, ptr, NULL, 0);
+
+  __libc_free(ptr);
+}
+
+/* Watches */
+
+void
+_memory_entry_destroy(gpointer obj)
+{
+  t_free(obj);
+}
+
+/* Leaks with the same allocating stacks are reported together */
+typedef struct _LeakwatchSite
+{
+  BacktraceId         m_origin;
+  BacktraceId         m_last;
+
+  gsize               m_count;
+  /* Estimated when sampling */
+  gsize               m_bytes;
+  gsize               m_min_size;
+  gsize               m_max_size;
+} LeakwatchSite;
+
+static guint
+_leakwatch_site_hash(gconstpointer key)
+{
+  const LeakwatchSite *site = (const LeakwatchSite *)key;
+
+  return site->m_origin * 2654435761U ^ site->m_last;
+}
+
+static gboolean
+_leakwatch_site_equal(gconstpointer a, gconstpointer b)
+{
+  const LeakwatchSite *x = (const LeakwatchSite *)a;
+  const LeakwatchSite *y = (const LeakwatchSite *)b;
+
+  return x->m_origin == y->m_origin && x->m_last == y->m_last;
+}
+
+static gint
+_leakwatch_site_compare(gconstpointer a, gconstpointer b)
+{
+  const LeakwatchSite *x = *(const LeakwatchSite **)a;
+  const LeakwatchSite *y = *(const LeakwatchSite **)b;
+
+  if (x->m_bytes != y->m_bytes)
+    return (x->m_bytes < y->m_bytes) - (x->m_bytes > y->m_bytes);
 
-  g_hash_table_unref(self);
+  return (x->m_count < y->m_count) - (x->m_count > y->m_count);
 }
 
 void
-_tinu_leakwatch_simple_dump(gpointer key, gpointer value, gpointer user_data)
+_tinu_leakwatch_site_add(gpointer key, gpointer value, gpointer user_data)
 {
-  gint priority = (gint)user_data;
-  MemoryEntry *self = (MemoryEntry *)value;
+  GHashTable *sites = (GHashTable *)user_data;
+  MemoryEntry *entry = (MemoryEntry *)value;
+  LeakwatchSite *site, lookup;
 
-  log_format(priority, "Memory leak found",
-            msg_tag_ptr("pointer", self->m_ptr),
-            msg_tag_int("size", self->m_size), NULL);
+  lookup.m_origin = entry->m_origin;
+  lookup.m_last = entry->m_last;
+
+  site = g_hash_table_lookup(sites, &lookup);
+  if (!site)
+    {
+      site = g_new0(LeakwatchSite, 1);
+      site->m_origin = entry->m_origin;
+      site->m_last = entry->m_last;
+      site->m_min_size = entry->m_size;
+      g_hash_table_insert(sites, site, site);
+    }
+
+  site->m_count++;
+  site->m_bytes += tinu_leakwatch_scale(entry->m_size);
+  site->m_min_size = MIN(site->m_min_size, entry->m_size);
+  site->m_max_size = MAX(site->m_max_size, entry->m_size);
+}
+
+static void
+_tinu_leakwatch_site_dump(const LeakwatchSite *site, gint priority)
+{
+  log_format(priority, g_leakwatch_sample ? "Memory leak found (sampled)" : "Memory leak found",
+             msg_tag_int("count", site->m_count),
+             msg_tag_int("bytes", site->m_bytes),
+             msg_tag_int("min_size", site->m_min_size),
+             msg_tag_int("max_size", site->m_max_size), NULL);
 
-  if (self->m_origin)
+  if (site->m_origin)
     {
       log_format(priority, "  Original allocator", NULL);
-      backtrace_dump_log(self->m_origin, "    ", priority);
+      backtrace_dump_log(backtrace_lookup(site->m_origin), "    ", priority);
     }
 
-  if (self->m_last)
+  if (site->m_last)
     {
       log_format(priority, "  Last (re)allocator", NULL);
-      backtrace_dump_log(self->m_last, "    ", priority);
+      backtrace_dump_log(backtrace_lookup(site->m_last), "    ", priority);
     }
 }
 
 void
 _tinu_leakwatch_summary(gpointer key, gpointer value, gpointer user_data)
 {
-  *(gsize *)user_data += ((MemoryEntry *)value)->m_size;
+  *(gsize *)user_data += tinu_leakwatch_scale(((MemoryEntry *)value)->m_size);
 }
 
 void
-_tinu_leakwatch_enable()
+tinu_leakwatch_configure(gsize sample_interval, guint32 depth)
 {
-  if (g_leakwatch_count == 0)
-    {
-      g_leakwatch_malloc = __malloc_hook;
-      g_leakwatch_realloc = __realloc_hook;
-      g_leakwatch_free = __free_hook;
-
-      __malloc_hook = _leakwatch_malloc;
-      __realloc_hook = _leakwatch_realloc;
-      __free_hook = _leakwatch_free;
-    }
-  g_leakwatch_count++;
+  g_leakwatch_sample = sample_interval;
+  g_leakwatch_depth = (depth ? MIN(depth, MAX_DEPTH) : MAX_DEPTH);
 }
 
-static void
-_tinu_leakwatch_clear()
+gsize
+tinu_leakwatch_scale(gsize size)
 {
-  __malloc_hook = g_leakwatch_malloc;
-  __realloc_hook = g_leakwatch_realloc;
-  __free_hook = g_leakwatch_free;
+  /* Divide by the probability of sampling an allocation of this size */
+  if (!g_leakwatch_sample || !size)
+    return size;
 
-  g_leakwatch_malloc = NULL;
-  g_leakwatch_realloc = NULL;
-  g_leakwatch_free = NULL;
+  return (gsize)(size / -expm1(-(gdouble)size / g_leakwatch_sample) + 0.5);
 }
 
-void
-_tinu_leakwatch_disable()
+static struct _Leakwatch *
+_leakwatch_register(struct _Leakwatch *lw)
 {
-  t_assert(g_leakwatch_count > 0);
-  if (g_leakwatch_count == 1)
-    {
-      _tinu_leakwatch_clear(NULL);
-      t_assert(!g_leakwatch_list);
-    }
-  g_leakwatch_count--;
+  /* Not while draining, dlsym() takes the loader lock */
+  LEAKWATCH_RESOLVE_MAPPINGS();
+
+  g_leakwatch_busy++;
+  g_leakwatch_init = TRUE;
+
+  pthread_mutex_init(&lw->m_lock, NULL);
+
+  /* Events still in the rings are older than the watch */
+  pthread_rwlock_wrlock(&g_leakwatch_lock);
+  lw->m_start_seq = __sync_fetch_and_add(&g_leakwatch_seq, 1);
+  g_leakwatch_list = g_slist_prepend(g_leakwatch_list, lw);
+  g_atomic_int_add(&g_leakwatch_count, 1);
+  g_atomic_int_add(&g_leakwatch_active, 1);
+  if (lw->m_callback)
+    g_atomic_int_add(&g_leakwatch_callbacks, 1);
+  pthread_rwlock_unlock(&g_leakwatch_lock);
+
+  g_leakwatch_busy--;
+  return lw;
 }
 
 gpointer
 tinu_register_watch(AllocCallback callback, gpointer user_data)
 {
-  struct _Leakwatch *lw;
-
-  if (!g_leakwatch_init)
-    {
-      atexit(_tinu_leakwatch_clear);
-      g_leakwatch_init = TRUE;
-    }
-
-  _tinu_leakwatch_enable();
-  _hook_pause();
+  struct _Leakwatch *lw = t_new(struct _Leakwatch, 1);
 
-  lw = t_new(struct _Leakwatch, 1);
   lw->m_user_data = user_data;
   lw->m_callback = callback;
 
-  g_leakwatch_list = g_slist_prepend(g_leakwatch_list, lw);
+  return (gpointer)_leakwatch_register(lw);
+}
+
+void
+tinu_leakwatch_flush(void)
+{
+  g_leakwatch_busy++;
+  _leakwatch_drain_all();
+  g_leakwatch_busy--;
+}
+
+void
+tinu_leakwatch_suspend(void)
+{
+  g_leakwatch_busy++;
+}
 
-  _hook_resume();
-  return (gpointer)lw;
+void
+tinu_leakwatch_resume(void)
+{
+  g_leakwatch_busy--;
 }
 
 gboolean
 tinu_unregister_watch(gpointer handle)
 {
   GSList *act;
-  struct _Leakwatch *lw;
-  gboolean res = FALSE;
+  struct _Leakwatch *lw = NULL;
+  LeakwatchTableStats stats;
 
   if (!g_leakwatch_init)
     {
@@ -316,46 +1634,239 @@ tinu_unregister_watch(gpointer handle)
       return FALSE;
     }
 
-  _hook_pause();
+  g_leakwatch_busy++;
 
+  /* Deliver everything that happened while the watch was registered */
+  _leakwatch_drain_all();
+
+  pthread_rwlock_wrlock(&g_leakwatch_lock);
   for (act = g_leakwatch_list; act; act = act->next)
     {
-      lw = (struct _Leakwatch *)act->data;
-
       if (act->data == handle)
         {
-          res = TRUE;
-          t_free(lw);
-          act->data = NULL;
+          lw = (struct _Leakwatch *)act->data;
           g_leakwatch_list = g_slist_delete_link(g_leakwatch_list, act);
+          g_atomic_int_add(&g_leakwatch_count, -1);
+          g_atomic_int_add(&g_leakwatch_active, -1);
+          if (lw->m_callback)
+            g_atomic_int_add(&g_leakwatch_callbacks, -1);
           break;
         }
     }
+  pthread_rwlock_unlock(&g_leakwatch_lock);
 
-  _hook_resume();
-  if (act)
-    _tinu_leakwatch_disable();
-  else
+  if (lw)
+    {
+      if (lw->m_shards)
+        {
+          _leakwatch_table_stats(lw, &stats);
+          log_debug("Leakwatch pointer table statistics",
+                    msg_tag_int("live", stats.m_live),
+                    msg_tag_int("freed", stats.m_freed),
+                    msg_tag_int("slots", stats.m_slots),
+                    msg_tag_printf("avg_probe", "%.2f",
+                                   stats.m_lookups ? (gdouble)stats.m_probes / stats.m_lookups : 0.0),
+                    msg_tag_int("max_probe", stats.m_max_probe),
+                    msg_tag_int("mapped", stats.m_mapped), NULL);
+
+          _leakwatch_table_collect(lw);
+        }
+
+      pthread_mutex_destroy(&lw->m_lock);
+      t_free(lw);
+    }
+
+  g_leakwatch_busy--;
+
+  if (!lw)
     log_warn("Leakwatch handle is not registered",
              msg_tag_ptr("handle", handle), NULL);
 
-  return res;
+  return lw != NULL;
 }
 
 gpointer
 tinu_leakwatch_simple(GHashTable **result)
 {
+  struct _Leakwatch *lw;
+  gint i;
+
   t_assert(result);
   t_assert(*result == NULL);
 
   *result = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _memory_entry_destroy);
-  return tinu_register_watch(_tinu_leakwatch_simple_callback, (gpointer)*result);
+
+  lw = t_new(struct _Leakwatch, 1);
+  lw->m_result = *result;
+  lw->m_shards = t_new(LeakwatchShard, LEAKWATCH_SHARDS);
+  for (i = 0; i < LEAKWATCH_SHARDS; i++)
+    {
+      /* The tables are mapped on the first allocation */
+      pthread_mutex_init(&lw->m_shards[i].m_lock, NULL);
+    }
+
+  return (gpointer)_leakwatch_register(lw);
+}
+
+gboolean
+tinu_leakwatch_simple_profile(gpointer handle, LeakwatchProfile *profile)
+{
+  struct _Leakwatch *lw = (struct _Leakwatch *)handle;
+  gdouble allocs = 0, bytes = 0, histogram[LEAKWATCH_SIZE_CLASSES] = { 0 };
+  gint i, j;
+
+  if (!lw->m_shards)
+    return FALSE;
+
+  g_leakwatch_busy++;
+  _leakwatch_drain_all();
+
+  for (i = 0; i < LEAKWATCH_SHARDS; i++)
+    {
+      pthread_mutex_lock(&lw->m_shards[i].m_lock);
+      allocs += lw->m_shards[i].m_allocs;
+      bytes += lw->m_shards[i].m_alloc_bytes;
+      for (j = 0; j < LEAKWATCH_SIZE_CLASSES; j++)
+        histogram[j] += lw->m_shards[i].m_histogram[j];
+      pthread_mutex_unlock(&lw->m_shards[i].m_lock);
+    }
+
+  profile->m_allocs = (guint64)(allocs + 0.5);
+  profile->m_alloc_bytes = (guint64)(bytes + 0.5);
+  profile->m_peak_bytes = MAX(lw->m_peak, 0);
+  for (j = 0; j < LEAKWATCH_SIZE_CLASSES; j++)
+    profile->m_histogram[j] = (guint64)(histogram[j] + 0.5);
+
+  g_leakwatch_busy--;
+  return TRUE;
+}
+
+gboolean
+tinu_leakwatch_simple_stats(gpointer handle, LeakwatchTableStats *stats)
+{
+  struct _Leakwatch *lw = (struct _Leakwatch *)handle;
+
+  if (!lw->m_shards)
+    return FALSE;
+
+  g_leakwatch_busy++;
+  _leakwatch_drain_all();
+  _leakwatch_table_stats(lw, stats);
+  g_leakwatch_busy--;
+
+  return TRUE;
 }
 
 void
 tinu_leakwatch_simple_dump(GHashTable *result, gint loglevel)
 {
-  g_hash_table_foreach(result, _tinu_leakwatch_simple_dump, (gpointer)loglevel);
+  tinu_leakwatch_simple_report(result, loglevel, 0);
+}
+
+void
+tinu_leakwatch_simple_report(GHashTable *result, gint loglevel, guint limit)
+{
+  GHashTable *sites;
+  GPtrArray *sorted;
+  GHashTableIter iter;
+  LeakwatchSite *site, rest = { 0 };
+  guint i;
+
+  if (!g_hash_table_size(result))
+    return;
+
+  sites = g_hash_table_new_full(_leakwatch_site_hash, _leakwatch_site_equal, NULL, g_free);
+  g_hash_table_foreach(result, _tinu_leakwatch_site_add, sites);
+
+  sorted = g_ptr_array_sized_new(g_hash_table_size(sites));
+  g_hash_table_iter_init(&iter, sites);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&site))
+    g_ptr_array_add(sorted, site);
+  g_ptr_array_sort(sorted, _leakwatch_site_compare);
+
+  if (!limit || limit > sorted->len)
+    limit = sorted->len;
+
+  for (i = 0; i < sorted->len; i++)
+    {
+      site = (LeakwatchSite *)sorted->pdata[i];
+
+      if (i < limit)
+        {
+          _tinu_leakwatch_site_dump(site, loglevel);
+          continue;
+        }
+
+      rest.m_count += site->m_count;
+      rest.m_bytes += site->m_bytes;
+    }
+
+  if (rest.m_count)
+    log_format(loglevel, "Memory leaks of further allocation sites not shown",
+               msg_tag_int("sites", sorted->len - limit),
+               msg_tag_int("count", rest.m_count),
+               msg_tag_int("bytes", rest.m_bytes), NULL);
+
+  g_ptr_array_free(sorted, TRUE);
+  g_hash_table_destroy(sites);
+}
+
+void
+tinu_leakwatch_counters_start(LeakwatchCounters *start)
+{
+  g_atomic_int_add(&g_leakwatch_counters, 1);
+  g_atomic_int_add(&g_leakwatch_active, 1);
+  __sync_synchronize();
+
+  start->m_blocks = g_leakwatch_net_blocks;
+  start->m_bytes = g_leakwatch_net_bytes;
+}
+
+void
+tinu_leakwatch_counters_stop(const LeakwatchCounters *start, LeakwatchCounters *delta)
+{
+  __sync_synchronize();
+  delta->m_blocks = g_leakwatch_net_blocks - start->m_blocks;
+  delta->m_bytes = g_leakwatch_net_bytes - start->m_bytes;
+
+  g_atomic_int_add(&g_leakwatch_active, -1);
+  g_atomic_int_add(&g_leakwatch_counters, -1);
+}
+
+void
+tinu_leakwatch_budget_start(LeakwatchBudget *budget, guint64 max_allocs)
+{
+  memset(budget, 0, sizeof(*budget));
+  budget->m_max_allocs = max_allocs;
+  budget->m_outer = g_leakwatch_budget;
+
+  g_leakwatch_budget = budget;
+  g_leakwatch_budget_depth++;
+  g_atomic_int_add(&g_leakwatch_active, 1);
+}
+
+void
+tinu_leakwatch_budget_stop(LeakwatchBudget *budget)
+{
+  g_atomic_int_add(&g_leakwatch_active, -1);
+  g_leakwatch_budget = budget->m_outer;
+  g_leakwatch_budget_depth--;
+
+  /* The allocations of a nested budget count in the enclosing one too */
+  if (budget->m_outer)
+    {
+      budget->m_outer->m_allocs += budget->m_allocs;
+      budget->m_outer->m_bytes += budget->m_bytes;
+    }
+}
+
+void
+tinu_leakwatch_budget_reset(void)
+{
+  /* The budgets themselves may be freed already, only the depth is used */
+  g_atomic_int_add(&g_leakwatch_active, -(gint)g_leakwatch_budget_depth);
+  g_leakwatch_budget = NULL;
+  g_leakwatch_budget_depth = 0;
 }
 
 gsize
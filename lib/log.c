@@ -47,6 +47,12 @@ static struct
   gpointer          m_user_data;
 } g_log_diverted = { NULL, NULL };
 
+static __thread struct
+{
+  MessageHandler    m_handler;
+  gpointer          m_user_data;
+} g_log_capture = { NULL, NULL };
+
 struct _LogHandler
 {
   gint            m_max_priority;
@@ -210,7 +216,10 @@ log_message(Message *msg, gboolean free_msg)
   if (!g_log_list || msg->m_priority > g_log_max_priority)
     goto exit;
 
-  _log_alert_handlers(msg);
+  if (g_log_capture.m_handler)
+    g_log_capture.m_handler(msg, g_log_capture.m_user_data);
+  else
+    _log_alert_handlers(msg);
 
 exit:
   if (free_msg)
@@ -245,7 +254,10 @@ log_vformat(gint priority, const gchar *msg, MessageTag *tag0, va_list vl)
     }
 
   self = msg_vcreate(priority, msg, tag0, vl);
-  _log_alert_handlers(self);
+  if (g_log_capture.m_handler)
+    g_log_capture.m_handler(self, g_log_capture.m_user_data);
+  else
+    _log_alert_handlers(self);
   msg_destroy(self);
 }
 
@@ -288,3 +300,10 @@ log_divert(MessageHandler handler, gpointer user_data)
   g_log_diverted.m_user_data = user_data;
   g_log_max_priority = LOG_DEBUG;
 }
+
+void
+log_capture(MessageHandler handler, gpointer user_data)
+{
+  g_log_capture.m_handler = handler;
+  g_log_capture.m_user_data = user_data;
+}
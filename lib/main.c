@@ -37,10 +37,14 @@
 #include <tinu/config.h>
 #include <tinu/utils.h>
 #include <tinu/leakwatch.h>
+#include <tinu/backtrace.h>
 #include <tinu/main.h>
 #include <tinu/log.h>
 #include <tinu/clist.h>
 #include <tinu/reporting.h>
+#include <tinu/jobs.h>
+#include <tinu/baseline.h>
+#include <tinu/perf.h>
 
 static GOptionEntry g_main_opt_entries[];
 
@@ -55,6 +59,17 @@ static gboolean g_opt_sighandle = TRUE;
 static gboolean g_opt_leakwatch = FALSE;
 static gboolean g_opt_version = FALSE;
 static gint g_opt_priority = LOG_WARNING;
+static gint g_opt_jobs = 1;
+static gint g_opt_threads = 1;
+static guint32 g_opt_perf_counters = 0;
+static gint g_opt_leakwatch_sample = 0;
+static gint g_opt_leakwatch_depth = 0;
+static gint g_opt_leakwatch_sites = LEAKWATCH_REPORT_SITES;
+static gboolean g_opt_leakwatch_screen = FALSE;
+static gboolean g_opt_alloc_profile = FALSE;
+static gint g_opt_bench_samples = 0;
+static gint g_opt_bench_time = 0;
+static gdouble g_opt_bench_threshold = BASELINE_DEFAULT_THRESHOLD * 100;
 static StatisticsVerbosity g_opt_stat_verb = STAT_VERB_SUMMARY;
 
 static const gchar *g_opt_suite = NULL;
@@ -63,6 +78,11 @@ static const gchar *g_opt_file = NULL;
 
 static const gchar *g_opt_report = "print";
 
+static const gchar *g_opt_bench_baseline = NULL;
+static const gchar *g_opt_bench_compare = NULL;
+
+static const gchar *g_opt_symbol_cache = NULL;
+
 #ifdef COREDUMPER_ENABLED
 static const gchar *g_opt_core_dir = "/tmp";
 #endif
@@ -147,6 +167,81 @@ _tinu_opt_stat_verb(const gchar *opt G_GNUC_UNUSED, const gchar *value,
   return TRUE;
 }
 
+gboolean
+_tinu_opt_unwinder(const gchar *opt G_GNUC_UNUSED, const gchar *value,
+  gpointer data, GError **error)
+{
+  NameTableKey key = tinu_lookup_name(BacktraceUnwinder_names, value, -1, -1);
+
+  if (key == -1)
+    {
+      g_set_error(error, log_error_main(), MAIN_ERROR_OPTIONS,
+                  "Unknown unwinder `%s'", value);
+      return FALSE;
+    }
+
+  if (!backtrace_set_unwinder(key))
+    {
+      g_set_error(error, log_error_main(), MAIN_ERROR_OPTIONS,
+                  "Unwinder `%s' is not supported on this platform", value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+_tinu_parse_jobs(const gchar *value, gint *result, GError **error)
+{
+  gint jobs;
+  gchar *endl;
+
+  if (!strcmp(value, "auto"))
+    {
+      *result = test_jobs_auto();
+      return TRUE;
+    }
+
+  jobs = strtol(value, &endl, 10);
+  if (!endl || (*endl) != '\0' || jobs < 1)
+    {
+      g_set_error(error, log_error_main(), MAIN_ERROR_OPTIONS,
+                  "Invalid number of jobs `%s'", value);
+      return FALSE;
+    }
+
+  *result = jobs;
+  return TRUE;
+}
+
+gboolean
+_tinu_opt_jobs(const gchar *opt G_GNUC_UNUSED, const gchar *value,
+  gpointer data, GError **error)
+{
+  return _tinu_parse_jobs(value, &g_opt_jobs, error);
+}
+
+gboolean
+_tinu_opt_threads(const gchar *opt G_GNUC_UNUSED, const gchar *value,
+  gpointer data, GError **error)
+{
+  return _tinu_parse_jobs(value, &g_opt_threads, error);
+}
+
+gboolean
+_tinu_opt_perf_counters(const gchar *opt G_GNUC_UNUSED, const gchar *value,
+  gpointer data, GError **error)
+{
+  if (!perf_counters_parse(value, &g_opt_perf_counters))
+    {
+      g_set_error(error, log_error_main(), MAIN_ERROR_OPTIONS,
+                  "Invalid performance counter list `%s'", value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 _tinu_opt_report_null(const gchar *opt G_GNUC_UNUSED, const gchar *value G_GNUC_UNUSED,
   gpointer data, GError **error)
@@ -172,6 +267,43 @@ static GOptionEntry g_main_opt_entries[] = {
     "verbosity" },
   { "leakwatch", 0, 0, G_OPTION_ARG_NONE, (gpointer)&g_opt_leakwatch,
     "Enable leak watcher (warning: slows tests down by a significant ammount of time)", NULL },
+  { "leakwatch-sample", 0, 0, G_OPTION_ARG_INT, (gpointer)&g_opt_leakwatch_sample,
+    "Only track a random sample of the allocations, one per BYTES allocated on average "
+    "(implies --leakwatch, leak sizes are estimates)", "BYTES" },
+  { "leakwatch-depth", 0, 0, G_OPTION_ARG_INT, (gpointer)&g_opt_leakwatch_depth,
+    "Record at most N frames of the allocating stack (implies --leakwatch)", "N" },
+  { "leakwatch-screen", 0, 0, G_OPTION_ARG_NONE, (gpointer)&g_opt_leakwatch_screen,
+    "Screen test cases with net allocation counters and only run the ones that seem to leak "
+    "again with the leak watcher (much faster than --leakwatch)", NULL },
+  { "leakwatch-sites", 0, 0, G_OPTION_ARG_INT, (gpointer)&g_opt_leakwatch_sites,
+    "Report the leaks of at most N allocation sites per test case (0: all, default: 20)", "N" },
+  { "alloc-profile", 0, 0, G_OPTION_ARG_NONE, (gpointer)&g_opt_alloc_profile,
+    "Log the call sites allocating the most memory in each test case", NULL },
+  { "unwinder", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer)&_tinu_opt_unwinder,
+    "Stack walker used for backtraces (libc (default), frame-pointer: fastest, needs code "
+    "built with -fno-omit-frame-pointer, eh-frame: fast, uses the unwind tables)",
+    "unwinder" },
+  { "symbol-cache", 0, 0, G_OPTION_ARG_STRING, (gpointer)&g_opt_symbol_cache,
+    "Cache the symbol and line index of the modules in DIR, later runs map it instead "
+    "of parsing the debug information", "DIR" },
+  { "jobs", 'j', 0, G_OPTION_ARG_CALLBACK, (gpointer)&_tinu_opt_jobs,
+    "Run test cases in parallel worker processes (auto: number of usable CPUs)",
+    "N|auto" },
+  { "threads", 't', 0, G_OPTION_ARG_CALLBACK, (gpointer)&_tinu_opt_threads,
+    "Run test cases in parallel threads (test cases must be thread-safe)", "N|auto" },
+  { "perf-counters", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer)&_tinu_opt_perf_counters,
+    "Measure performance counters for each test case (cycles, instructions, cache-misses, "
+    "branch-misses, page-faults, context-switches, task-clock)", "LIST" },
+  { "benchmark-samples", 0, 0, G_OPTION_ARG_INT, (gpointer)&g_opt_bench_samples,
+    "Number of samples taken by benchmarks (default: 20)", "N" },
+  { "benchmark-time", 0, 0, G_OPTION_ARG_INT, (gpointer)&g_opt_bench_time,
+    "Duration of a benchmark sample in milliseconds (default: 10)", "MS" },
+  { "benchmark-baseline", 0, 0, G_OPTION_ARG_STRING, (gpointer)&g_opt_bench_baseline,
+    "Save benchmark results into a baseline file", "FILE" },
+  { "benchmark-compare", 0, 0, G_OPTION_ARG_STRING, (gpointer)&g_opt_bench_compare,
+    "Fail if benchmarks are significantly slower than in the baseline file", "FILE" },
+  { "benchmark-threshold", 0, 0, G_OPTION_ARG_DOUBLE, (gpointer)&g_opt_bench_threshold,
+    "Slowdown in percent ignored as noise when comparing to a baseline (default: 5)", "PCT" },
   { "no-sighandle", 0, G_OPTION_FLAG_HIDDEN | G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, 
     (gpointer)&g_opt_sighandle,
     "Don't handle signals from test", NULL },
@@ -335,12 +467,63 @@ tinu_main(int *argc, char **argv[])
       return 1;
     }
 
+  if (g_opt_bench_samples < 0 || g_opt_bench_time < 0)
+    {
+      log_error("Benchmark samples and time must be positive", NULL);
+      return 1;
+    }
+
+  if (g_opt_bench_threshold < 0)
+    {
+      log_error("Benchmark threshold must be positive", NULL);
+      return 1;
+    }
+  benchmark_configure(g_opt_bench_samples, (guint64)g_opt_bench_time * 1000000);
+
+  if (g_opt_leakwatch_sample < 0 || g_opt_leakwatch_depth < 0 || g_opt_leakwatch_sites < 0)
+    {
+      log_error("Leakwatch sample interval, depth and sites must be positive", NULL);
+      return 1;
+    }
+
+  if (g_opt_leakwatch_sample || g_opt_leakwatch_depth)
+    g_opt_leakwatch = TRUE;
+  tinu_leakwatch_configure(g_opt_leakwatch_sample, g_opt_leakwatch_depth);
+
+  if (g_opt_symbol_cache)
+    backtrace_set_symbol_cache(g_opt_symbol_cache);
+
+  if (g_opt_leakwatch && g_opt_threads > 1)
+    {
+      log_warn("Leak watcher cannot be used with threads, disabling it", NULL);
+      g_opt_leakwatch = FALSE;
+    }
+
+  if (g_opt_leakwatch_screen && g_opt_threads > 1)
+    {
+      log_warn("Leak screening cannot be used with threads, disabling it", NULL);
+      g_opt_leakwatch_screen = FALSE;
+    }
+
+  if (g_opt_alloc_profile && g_opt_threads > 1)
+    {
+      log_warn("Allocation profiler cannot be used with threads, disabling it", NULL);
+      g_opt_alloc_profile = FALSE;
+    }
+
   g_main_test_context.m_sighandle = g_opt_sighandle;
   g_main_test_context.m_leakwatch = g_opt_leakwatch;
+  g_main_test_context.m_leakwatch_sites = g_opt_leakwatch_sites;
+  g_main_test_context.m_leak_screen = g_opt_leakwatch_screen;
+  g_main_test_context.m_alloc_profile = g_opt_alloc_profile;
+  g_main_test_context.m_jobs = g_opt_jobs;
+  g_main_test_context.m_threads = g_opt_threads;
+  g_main_test_context.m_perf_counters = g_opt_perf_counters;
 #ifdef COREDUMPER_ENABLED
   g_main_test_context.m_core_dir = g_opt_core_dir;
 #endif
-  if (report && g_opt_stat_verb > STAT_VERB_NONE)
+  if ((report && g_opt_stat_verb > STAT_VERB_NONE) ||
+      g_opt_bench_baseline || g_opt_bench_compare)
     {
       stat = stat_new(&g_main_test_context);
       stat_start(stat);
@@ -357,10 +540,19 @@ tinu_main(int *argc, char **argv[])
   else
     res = tinu_test_all_run(&g_main_test_context);
 
-  if (report)
+  if (stat)
     {
       stat_stop(stat);
-      report->m_handle(stat, g_opt_stat_verb, g_opt_fancy);
+
+      if (report && g_opt_stat_verb > STAT_VERB_NONE)
+        report->m_handle(stat, g_opt_stat_verb, g_opt_fancy);
+
+      if (g_opt_bench_compare &&
+          baseline_compare(stat, g_opt_bench_compare, g_opt_bench_threshold / 100) != 0)
+        res = FALSE;
+
+      if (g_opt_bench_baseline && !baseline_save(stat, g_opt_bench_baseline))
+        res = FALSE;
 
       stat_destroy(stat);
     }
@@ -421,6 +613,32 @@ tinu_test_add_extended(const gchar *suite_name,
                     user_data_cleanup);
 }
 
+void
+tinu_benchmark_add(const gchar *suite_name,
+                   const gchar *bench_name,
+                   TestSetup setup,
+                   TestCleanup cleanup,
+                   BenchmarkFunction func,
+                   gpointer user_data,
+                   CleanupFunction user_data_cleanup)
+{
+  if (!g_main_test_context_init)
+    {
+      /* Initialize test context */
+      test_context_init((TestContext *)&g_main_test_context);
+      g_main_test_context_init = TRUE;
+    }
+
+  benchmark_add((TestContext *)&g_main_test_context,
+                suite_name,
+                bench_name,
+                setup,
+                cleanup,
+                func,
+                user_data,
+                user_data_cleanup);
+}
+
 void
 tinu_report_add(const ReportModule *module)
 {
@@ -132,12 +132,13 @@ msg_copy(const Message *self)
   res->m_priority = self->m_priority;
   res->m_message = g_strdup(self->m_message);
   res->m_tag_count = self->m_tag_count;
+  res->m_tags = g_new0(MessageTag *, self->m_tag_count);
 
   for (i = 0; i < res->m_tag_count; i++)
     {
       tag = g_new0(MessageTag, 1);
-      tag->m_tag = g_strdup(res->m_tags[i]->m_tag);
-      tag->m_value = g_strdup(res->m_tags[i]->m_value);
+      tag->m_tag = g_strdup(self->m_tags[i]->m_tag);
+      tag->m_value = g_strdup(self->m_tags[i]->m_value);
       res->m_tags[i] = tag;
     }
 
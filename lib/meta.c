@@ -38,6 +38,18 @@ tinu_use_metainfo(const TinuMetaInfo *metainfo)
 
   for (i = 0; metainfo[i].m_suite; ++i)
     {
+      if (metainfo[i].m_benchmark)
+        {
+          tinu_benchmark_add(metainfo[i].m_suite,
+                             metainfo[i].m_test,
+                             metainfo[i].m_setup,
+                             metainfo[i].m_cleanup,
+                             metainfo[i].m_benchmark,
+                             NULL,
+                             NULL);
+          continue;
+        }
+
       tinu_test_add_extended(metainfo[i].m_suite,
                              metainfo[i].m_test,
                              metainfo[i].m_setup,
@@ -0,0 +1,275 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include <tinu/config.h>
+#include <tinu/perf.h>
+#include <tinu/log.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#ifndef PERF_FLAG_FD_CLOEXEC
+#define PERF_FLAG_FD_CLOEXEC 0
+#endif
+
+#define PERF_HARDWARE_COUNTERS \
+  (PERF_COUNTER_BIT(PERF_COUNTER_CYCLES) | \
+   PERF_COUNTER_BIT(PERF_COUNTER_INSTRUCTIONS) | \
+   PERF_COUNTER_BIT(PERF_COUNTER_CACHE_MISSES) | \
+   PERF_COUNTER_BIT(PERF_COUNTER_BRANCH_MISSES))
+
+static const struct
+{
+  guint32           m_type;
+  guint64           m_config;
+} g_perf_events[PERF_COUNTER_MAX] =
+{
+  [PERF_COUNTER_CYCLES]           = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  [PERF_COUNTER_INSTRUCTIONS]     = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  [PERF_COUNTER_CACHE_MISSES]     = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  [PERF_COUNTER_BRANCH_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  [PERF_COUNTER_PAGE_FAULTS]      = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  [PERF_COUNTER_CONTEXT_SWITCHES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  [PERF_COUNTER_TASK_CLOCK]       = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+/* Counters that could not be opened (they are not tried again) */
+static volatile guint g_perf_unavailable = 0;
+/* Set if only user space events can be counted */
+static volatile gint g_perf_exclude_kernel = 0;
+
+struct _PerfCounters
+{
+  guint             m_count;
+  gint              m_fds[PERF_COUNTER_MAX];
+  PerfCounterID     m_ids[PERF_COUNTER_MAX];
+};
+
+static gint
+_perf_open(PerfCounterID id, gint group)
+{
+  struct perf_event_attr attr;
+  gint fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = g_perf_events[id].m_type;
+  attr.config = g_perf_events[id].m_config;
+  attr.disabled = (group == -1);
+  attr.exclude_hv = 1;
+  attr.exclude_kernel = g_atomic_int_get(&g_perf_exclude_kernel);
+  attr.read_format = PERF_FORMAT_GROUP |
+                     PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  fd = syscall(__NR_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+  if (fd == -1 && (errno == EACCES || errno == EPERM) && !attr.exclude_kernel)
+    {
+      /* Restricted by perf_event_paranoid, count user space only */
+      g_atomic_int_set(&g_perf_exclude_kernel, 1);
+      attr.exclude_kernel = 1;
+      fd = syscall(__NR_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+    }
+
+  return fd;
+}
+
+static void
+_perf_disable(PerfCounterID id, gint error)
+{
+  guint old;
+
+  /* Without access to the PMU (or without a PMU, e.g. in virtual machines)
+   * none of the hardware counters can be used */
+  if (g_perf_events[id].m_type == PERF_TYPE_HARDWARE &&
+      (error == EACCES || error == EPERM ||
+       (id == PERF_COUNTER_CYCLES && (error == ENOENT || error == ENODEV || error == EOPNOTSUPP))))
+    {
+      old = g_atomic_int_or(&g_perf_unavailable, PERF_HARDWARE_COUNTERS);
+      if (!(old & PERF_HARDWARE_COUNTERS))
+        log_warn("Hardware performance counters are not accessible, using software events",
+                 msg_tag_str("error", g_strerror(error)), NULL);
+      return;
+    }
+
+  old = g_atomic_int_or(&g_perf_unavailable, PERF_COUNTER_BIT(id));
+  if (!(old & PERF_COUNTER_BIT(id)))
+    log_warn("Performance counter not available",
+             msg_tag_str("counter", tinu_lookup_key(PerfCounterID_names, id, NULL)),
+             msg_tag_str("error", g_strerror(error)), NULL);
+}
+
+PerfCounters *
+perf_counters_start(guint32 mask)
+{
+  PerfCounters *self = g_new0(PerfCounters, 1);
+  PerfCounterID id;
+  gint fd;
+
+  for (id = 0; id < PERF_COUNTER_MAX; id++)
+    {
+      if (!(mask & PERF_COUNTER_BIT(id)))
+        continue;
+
+      fd = -1;
+      if (!(g_atomic_int_get(&g_perf_unavailable) & PERF_COUNTER_BIT(id)))
+        {
+          fd = _perf_open(id, self->m_count ? self->m_fds[0] : -1);
+          if (fd == -1)
+            _perf_disable(id, errno);
+        }
+
+      if (fd == -1)
+        {
+          /* Task clock is the closest software replacement of cycles */
+          if (id == PERF_COUNTER_CYCLES)
+            mask |= PERF_COUNTER_BIT(PERF_COUNTER_TASK_CLOCK);
+          continue;
+        }
+
+      self->m_fds[self->m_count] = fd;
+      self->m_ids[self->m_count] = id;
+      self->m_count++;
+    }
+
+  if (!self->m_count)
+    {
+      g_free(self);
+      return NULL;
+    }
+
+  ioctl(self->m_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(self->m_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return self;
+}
+
+void
+perf_counters_stop(PerfCounters *self, PerfCounterValues *values)
+{
+  /* nr, time_enabled, time_running, values */
+  guint64 data[3 + PERF_COUNTER_MAX];
+  gssize size;
+  gdouble scale = 1.0;
+  guint i;
+
+  memset(values, 0, sizeof(*values));
+
+  if (!self)
+    return;
+
+  ioctl(self->m_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  size = read(self->m_fds[0], data, sizeof(data));
+
+  /* The group was never scheduled if time_running is zero */
+  if (size >= (gssize)((3 + self->m_count) * sizeof(guint64)) &&
+      data[0] == self->m_count && data[2] > 0)
+    {
+      /* The counters were multiplexed, extrapolate */
+      if (data[2] < data[1])
+        scale = (gdouble)data[1] / data[2];
+
+      for (i = 0; i < self->m_count; i++)
+        {
+          values->m_values[self->m_ids[i]] = (guint64)(data[3 + i] * scale);
+          values->m_valid |= PERF_COUNTER_BIT(self->m_ids[i]);
+        }
+    }
+
+  for (i = 0; i < self->m_count; i++)
+    close(self->m_fds[i]);
+
+  g_free(self);
+}
+
+#else
+
+PerfCounters *
+perf_counters_start(guint32 mask)
+{
+  static volatile gint warned = 0;
+
+  if (g_atomic_int_compare_and_exchange(&warned, 0, 1))
+    log_warn("Performance counters are not supported on this platform", NULL);
+
+  return NULL;
+}
+
+void
+perf_counters_stop(PerfCounters *self, PerfCounterValues *values)
+{
+  memset(values, 0, sizeof(*values));
+}
+
+#endif
+
+gboolean
+perf_counters_parse(const gchar *list, guint32 *mask)
+{
+  gchar **names = g_strsplit(list, ",", -1);
+  NameTableKey id;
+  gboolean res = TRUE;
+  gint i;
+
+  *mask = 0;
+  for (i = 0; names[i]; i++)
+    {
+      id = tinu_lookup_name(PerfCounterID_names, g_strstrip(names[i]), -1, -1);
+      if (id == -1)
+        {
+          res = FALSE;
+          break;
+        }
+
+      *mask |= PERF_COUNTER_BIT(id);
+    }
+
+  g_strfreev(names);
+  return res && *mask != 0;
+}
+
+const NameTable PerfCounterID_names[] =
+{
+  { PERF_COUNTER_CYCLES,            "cycles",            6 },
+  { PERF_COUNTER_INSTRUCTIONS,      "instructions",     12 },
+  { PERF_COUNTER_CACHE_MISSES,      "cache-misses",     12 },
+  { PERF_COUNTER_BRANCH_MISSES,     "branch-misses",    13 },
+  { PERF_COUNTER_PAGE_FAULTS,       "page-faults",      11 },
+  { PERF_COUNTER_CONTEXT_SWITCHES,  "context-switches", 16 },
+  { PERF_COUNTER_TASK_CLOCK,        "task-clock",       10 },
+  { 0,                              NULL,                0 }
+};
@@ -0,0 +1,452 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <tinu/record.h>
+#include <tinu/benchmark.h>
+#include <tinu/perf.h>
+#include <tinu/leakwatch.h>
+#include <tinu/log.h>
+
+#define RECORD_NULL_STRING ((guint32)-1)
+
+static void
+_record_event_clear(TestRecordEvent *event)
+{
+  g_free(event->m_str[0]);
+  g_free(event->m_str[1]);
+  g_free(event->m_data);
+
+  if (event->m_message)
+    msg_destroy(event->m_message);
+}
+
+static TestRecordEvent *
+_record_event_new(TestRecord *self, TestHookID hook_id)
+{
+  TestRecordEvent event;
+
+  memset(&event, 0, sizeof(event));
+  event.m_hook_id = hook_id;
+
+  g_array_append_val(self->m_events, event);
+  return &g_array_index(self->m_events, TestRecordEvent, self->m_events->len - 1);
+}
+
+TestRecord *
+test_record_new(TestCase *test)
+{
+  TestRecord *self = g_new0(TestRecord, 1);
+
+  self->m_test = test;
+  self->m_result = TEST_NONE;
+  self->m_events = g_array_new(FALSE, FALSE, sizeof(TestRecordEvent));
+  return self;
+}
+
+void
+test_record_free(TestRecord *self)
+{
+  guint i;
+
+  for (i = 0; i < self->m_events->len; i++)
+    _record_event_clear(&g_array_index(self->m_events, TestRecordEvent, i));
+
+  g_array_free(self->m_events, TRUE);
+  g_free(self);
+}
+
+void
+test_record_vhook(TestRecord *self, TestHookID hook_id, va_list vl)
+{
+  TestRecordEvent *event = _record_event_new(self, hook_id);
+  const TestCaseTiming *timing;
+
+  switch (hook_id)
+    {
+      case TEST_HOOK_ASSERT :
+        event->m_int[0] = va_arg(vl, gboolean);
+        event->m_str[0] = g_strdup(va_arg(vl, const gchar *));
+        event->m_str[1] = g_strdup(va_arg(vl, const gchar *));
+        event->m_int[1] = va_arg(vl, gint);
+        break;
+
+      case TEST_HOOK_SIGNAL_ABORT :
+      case TEST_HOOK_SIGNAL_SEGFAULT :
+      case TEST_HOOK_BEFORE_TEST :
+        break;
+
+      case TEST_HOOK_AFTER_TEST :
+        (void)va_arg(vl, TestCase *);
+        event->m_int[0] = va_arg(vl, TestCaseResult);
+        timing = va_arg(vl, const TestCaseTiming *);
+        event->m_int[1] = timing->m_wall_time;
+        event->m_int[2] = timing->m_cpu_time;
+        self->m_result = (TestCaseResult)event->m_int[0];
+        break;
+
+      case TEST_HOOK_LEAKINFO :
+        (void)va_arg(vl, TestCase *);
+        event->m_int[0] = va_arg(vl, gsize);
+        break;
+
+      case TEST_HOOK_BENCHMARK :
+        (void)va_arg(vl, TestCase *);
+        event->m_data_size = sizeof(BenchmarkResult);
+        event->m_data = g_memdup(va_arg(vl, const BenchmarkResult *), event->m_data_size);
+        break;
+
+      case TEST_HOOK_PERF_COUNTERS :
+        (void)va_arg(vl, TestCase *);
+        event->m_data_size = sizeof(PerfCounterValues);
+        event->m_data = g_memdup(va_arg(vl, const PerfCounterValues *), event->m_data_size);
+        break;
+
+      case TEST_HOOK_HEAP_PROFILE :
+        (void)va_arg(vl, TestCase *);
+        event->m_data_size = sizeof(LeakwatchProfile);
+        event->m_data = g_memdup(va_arg(vl, const LeakwatchProfile *), event->m_data_size);
+        break;
+
+      default :
+        /* Suite hooks are never emitted by a test case run */
+        g_assert_not_reached();
+    }
+}
+
+void
+test_record_hook(TestRecord *self, TestHookID hook_id, ...)
+{
+  va_list vl;
+
+  va_start(vl, hook_id);
+  test_record_vhook(self, hook_id, vl);
+  va_end(vl);
+}
+
+void
+test_record_message(TestRecord *self, const Message *msg)
+{
+  _record_event_new(self, TEST_RECORD_MESSAGE)->m_message = msg_copy(msg);
+}
+
+void
+test_record_replay(TestRecord *self, TestContext *context)
+{
+  TestRecordEvent *event;
+  TestCaseTiming timing;
+  guint i;
+
+  for (i = 0; i < self->m_events->len; i++)
+    {
+      event = &g_array_index(self->m_events, TestRecordEvent, i);
+
+      switch (event->m_hook_id)
+        {
+          case TEST_RECORD_MESSAGE :
+            log_message(event->m_message, FALSE);
+            break;
+
+          case TEST_HOOK_ASSERT :
+            test_run_hooks(context, event->m_hook_id, (gboolean)event->m_int[0],
+                           event->m_str[0], event->m_str[1], (gint)event->m_int[1]);
+            break;
+
+          case TEST_HOOK_SIGNAL_ABORT :
+          case TEST_HOOK_SIGNAL_SEGFAULT :
+            test_run_hooks(context, event->m_hook_id);
+            break;
+
+          case TEST_HOOK_BEFORE_TEST :
+            test_run_hooks(context, event->m_hook_id, self->m_test);
+            break;
+
+          case TEST_HOOK_AFTER_TEST :
+            timing.m_wall_time = event->m_int[1];
+            timing.m_cpu_time = event->m_int[2];
+            test_run_hooks(context, event->m_hook_id, self->m_test,
+                           (TestCaseResult)event->m_int[0], &timing);
+            break;
+
+          case TEST_HOOK_LEAKINFO :
+            test_run_hooks(context, event->m_hook_id, self->m_test, (gsize)event->m_int[0]);
+            break;
+
+          case TEST_HOOK_BENCHMARK :
+            test_run_hooks(context, event->m_hook_id, self->m_test,
+                           (const BenchmarkResult *)event->m_data);
+            break;
+
+          case TEST_HOOK_PERF_COUNTERS :
+            test_run_hooks(context, event->m_hook_id, self->m_test,
+                           (const PerfCounterValues *)event->m_data);
+            break;
+
+          case TEST_HOOK_HEAP_PROFILE :
+            test_run_hooks(context, event->m_hook_id, self->m_test,
+                           (const LeakwatchProfile *)event->m_data);
+            break;
+
+          default :
+            g_assert_not_reached();
+        }
+    }
+}
+
+/* Serialization */
+
+static void
+_record_put_uint32(GString *output, guint32 value)
+{
+  g_string_append_len(output, (const gchar *)&value, sizeof(value));
+}
+
+static void
+_record_put_int64(GString *output, gint64 value)
+{
+  g_string_append_len(output, (const gchar *)&value, sizeof(value));
+}
+
+static void
+_record_put_string(GString *output, const gchar *str)
+{
+  guint32 len = (str ? strlen(str) : RECORD_NULL_STRING);
+
+  _record_put_uint32(output, len);
+  if (str)
+    g_string_append_len(output, str, len);
+}
+
+static void
+_record_put_data(GString *output, gconstpointer data, guint32 size)
+{
+  _record_put_uint32(output, data ? size : RECORD_NULL_STRING);
+  if (data)
+    g_string_append_len(output, (const gchar *)data, size);
+}
+
+typedef struct _RecordReader
+{
+  const gchar    *m_pos;
+  const gchar    *m_end;
+} RecordReader;
+
+static gboolean
+_record_get(RecordReader *reader, gpointer dest, gsize size)
+{
+  if (reader->m_pos + size > reader->m_end)
+    return FALSE;
+
+  memcpy(dest, reader->m_pos, size);
+  reader->m_pos += size;
+  return TRUE;
+}
+
+static gboolean
+_record_get_string(RecordReader *reader, gchar **dest)
+{
+  guint32 len;
+
+  if (!_record_get(reader, &len, sizeof(len)))
+    return FALSE;
+
+  if (len == RECORD_NULL_STRING)
+    {
+      *dest = NULL;
+      return TRUE;
+    }
+
+  if (reader->m_pos + len > reader->m_end)
+    return FALSE;
+
+  *dest = g_strndup(reader->m_pos, len);
+  reader->m_pos += len;
+  return TRUE;
+}
+
+static gboolean
+_record_get_data(RecordReader *reader, gpointer *dest, guint32 *size)
+{
+  if (!_record_get(reader, size, sizeof(*size)))
+    return FALSE;
+
+  if (*size == RECORD_NULL_STRING)
+    {
+      *dest = NULL;
+      *size = 0;
+      return TRUE;
+    }
+
+  if (reader->m_pos + *size > reader->m_end)
+    return FALSE;
+
+  *dest = g_memdup(reader->m_pos, *size);
+  reader->m_pos += *size;
+  return TRUE;
+}
+
+void
+test_record_serialize(const TestRecord *self, GString *output)
+{
+  const TestRecordEvent *event;
+  const Message *msg;
+  guint i;
+  gint j;
+
+  _record_put_uint32(output, self->m_events->len);
+
+  for (i = 0; i < self->m_events->len; i++)
+    {
+      event = &g_array_index(self->m_events, TestRecordEvent, i);
+
+      _record_put_uint32(output, event->m_hook_id);
+      if (event->m_hook_id != TEST_RECORD_MESSAGE)
+        {
+          for (j = 0; j < G_N_ELEMENTS(event->m_int); j++)
+            _record_put_int64(output, event->m_int[j]);
+          _record_put_string(output, event->m_str[0]);
+          _record_put_string(output, event->m_str[1]);
+          _record_put_data(output, event->m_data, event->m_data_size);
+          continue;
+        }
+
+      msg = event->m_message;
+      _record_put_uint32(output, msg->m_priority);
+      _record_put_string(output, msg->m_message);
+      _record_put_uint32(output, msg->m_tag_count);
+      for (j = 0; j < msg->m_tag_count; j++)
+        {
+          _record_put_string(output, msg->m_tags[j]->m_tag);
+          _record_put_string(output, msg->m_tags[j]->m_value);
+        }
+    }
+}
+
+static gboolean
+_record_get_message(RecordReader *reader, Message **result)
+{
+  Message *msg = g_new0(Message, 1);
+  MessageTag *tag;
+  guint32 priority, count;
+
+  *result = msg;
+
+  if (!_record_get(reader, &priority, sizeof(priority)) ||
+      !_record_get_string(reader, &msg->m_message) ||
+      !_record_get(reader, &count, sizeof(count)))
+    return FALSE;
+
+  msg->m_priority = priority;
+  msg->m_tags = g_new0(MessageTag *, count);
+
+  for (; msg->m_tag_count < count; msg->m_tag_count++)
+    {
+      tag = g_new0(MessageTag, 1);
+      msg->m_tags[msg->m_tag_count] = tag;
+
+      if (!_record_get_string(reader, &tag->m_tag) ||
+          !_record_get_string(reader, &tag->m_value))
+        {
+          msg->m_tag_count++;
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+TestRecord *
+test_record_deserialize(TestCase *test, const gchar *data, gsize length)
+{
+  RecordReader reader = { data, data + length };
+  TestRecord *self = test_record_new(test);
+  TestRecordEvent *event;
+  guint32 count, hook_id;
+  guint i;
+
+  if (!_record_get(&reader, &count, sizeof(count)))
+    goto error;
+
+  for (; count > 0; count--)
+    {
+      /* Suite hooks are run by the parent, they are never recorded */
+      if (!_record_get(&reader, &hook_id, sizeof(hook_id)) || hook_id > TEST_RECORD_MESSAGE ||
+          hook_id == TEST_HOOK_BEFORE_SUITE || hook_id == TEST_HOOK_AFTER_SUITE)
+        goto error;
+
+      event = _record_event_new(self, hook_id);
+
+      if (hook_id == TEST_RECORD_MESSAGE)
+        {
+          if (!_record_get_message(&reader, &event->m_message))
+            goto error;
+          continue;
+        }
+
+      for (i = 0; i < G_N_ELEMENTS(event->m_int); i++)
+        {
+          if (!_record_get(&reader, &event->m_int[i], sizeof(event->m_int[i])))
+            goto error;
+        }
+
+      if (!_record_get_string(&reader, &event->m_str[0]) ||
+          !_record_get_string(&reader, &event->m_str[1]) ||
+          !_record_get_data(&reader, &event->m_data, &event->m_data_size))
+        goto error;
+
+      if (hook_id == TEST_HOOK_BENCHMARK && event->m_data_size != sizeof(BenchmarkResult))
+        goto error;
+
+      if (hook_id == TEST_HOOK_PERF_COUNTERS && event->m_data_size != sizeof(PerfCounterValues))
+        goto error;
+
+      if (hook_id == TEST_HOOK_HEAP_PROFILE && event->m_data_size != sizeof(LeakwatchProfile))
+        goto error;
+
+      if (hook_id == TEST_HOOK_AFTER_TEST)
+        self->m_result = (TestCaseResult)event->m_int[0];
+    }
+
+  if (reader.m_pos != reader.m_end)
+    goto error;
+
+  return self;
+
+error:
+  log_error("Malformed test record",
+            msg_tag_str("suite", test->m_suite->m_name),
+            msg_tag_str("case", test->m_name), NULL);
+  test_record_free(self);
+  return NULL;
+}
@@ -38,6 +38,8 @@
 #include <tinu/reporting.h>
 #include <tinu/log.h>
 
+#define NSEC_PER_SEC 1e9
+
 /* Options */
 static const gchar *g_opt_program_name = NULL;
 static const gchar *g_opt_program_template = "cat %s";
@@ -104,6 +106,57 @@ _prg_report_passfile(gchar **name)
   return res;
 }
 
+static void
+_prg_report_benchmark(FILE *file, const BenchmarkResult *bench)
+{
+  _prg_report_print(file, "benchmark.samples=%u", bench->m_samples);
+  _prg_report_print(file, "benchmark.iterations=%" G_GUINT64_FORMAT, bench->m_iterations);
+  _prg_report_print(file, "benchmark.mean=%.3lf", bench->m_mean);
+  _prg_report_print(file, "benchmark.median=%.3lf", bench->m_median);
+  _prg_report_print(file, "benchmark.stddev=%.3lf", bench->m_stddev);
+  _prg_report_print(file, "benchmark.p99=%.3lf", bench->m_p99);
+  _prg_report_print(file, "benchmark.min=%.3lf", bench->m_min);
+  _prg_report_print(file, "benchmark.max=%.3lf", bench->m_max);
+
+  if (bench->m_allocs >= 0)
+    {
+      _prg_report_print(file, "benchmark.allocs=%.3lf", bench->m_allocs);
+      _prg_report_print(file, "benchmark.alloc_bytes=%.3lf", bench->m_alloc_bytes);
+    }
+}
+
+static void
+_prg_report_perf(FILE *file, const PerfCounterValues *perf)
+{
+  PerfCounterID id;
+
+  for (id = 0; id < PERF_COUNTER_MAX; id++)
+    {
+      if (perf->m_valid & PERF_COUNTER_BIT(id))
+        _prg_report_print(file, "perf.%s=%" G_GUINT64_FORMAT,
+                          tinu_lookup_key(PerfCounterID_names, id, NULL), perf->m_values[id]);
+    }
+}
+
+static void
+_prg_report_heap(FILE *file, gsize leaked, const LeakwatchProfile *heap)
+{
+  gint i;
+
+  _prg_report_print(file, "heap.leaked=%" G_GSIZE_FORMAT, leaked);
+  _prg_report_print(file, "heap.peak=%" G_GUINT64_FORMAT, heap->m_peak_bytes);
+  _prg_report_print(file, "heap.allocs=%" G_GUINT64_FORMAT, heap->m_allocs);
+  _prg_report_print(file, "heap.bytes=%" G_GUINT64_FORMAT, heap->m_alloc_bytes);
+
+  /* Keyed by the lower bound of the size class */
+  for (i = 0; i < LEAKWATCH_SIZE_CLASSES; i++)
+    {
+      if (heap->m_histogram[i])
+        _prg_report_print(file, "heap.histogram.%" G_GUINT64_FORMAT "=%" G_GUINT64_FORMAT,
+                          i ? G_GUINT64_CONSTANT(1) << i : 0, heap->m_histogram[i]);
+    }
+}
+
 static gboolean
 test_report_program_check(StatisticsVerbosity verbosity, gboolean enable_colour)
 {
@@ -114,7 +167,6 @@ static void
 _test_report_put_file(FILE *file, TestStatistics *stat)
 {
   gint i, j;
-  double tics = (double)sysconf(_SC_CLK_TCK);
 
   StatSuiteInfo *suite;
   StatTestInfo *test;
@@ -132,7 +184,8 @@ _test_report_put_file(FILE *file, TestStatistics *stat)
       _prg_report_print(file, "result=%d", suite->m_result ? 1 : 0);
       _prg_report_print(file, "asserts.passed=%d", suite->m_assertions_passed);
       _prg_report_print(file, "asserts.total=%d", suite->m_assertions);
-      _prg_report_print(file, "time=%lf", (suite->m_end - suite->m_start) / tics);
+      _prg_report_print(file, "time=%.9lf", suite->m_wall_time / NSEC_PER_SEC);
+      _prg_report_print(file, "cputime=%.9lf", suite->m_cpu_time / NSEC_PER_SEC);
 
       for (j = 0; j < suite->m_test_info_list->len; j++)
         {
@@ -142,7 +195,17 @@ _test_report_put_file(FILE *file, TestStatistics *stat)
           _prg_report_print(file, "result=%s", test_result_name(test->m_result));
           _prg_report_print(file, "asserts.passed=%d", test->m_assertions_passed);
           _prg_report_print(file, "asserts.total=%d", test->m_assertions);
-          _prg_report_print(file, "time=%lf", (test->m_end - test->m_start) / tics);
+          _prg_report_print(file, "time=%.9lf", test->m_wall_time / NSEC_PER_SEC);
+          _prg_report_print(file, "cputime=%.9lf", test->m_cpu_time / NSEC_PER_SEC);
+
+          if (test->m_benchmark)
+            _prg_report_benchmark(file, test->m_benchmark);
+
+          if (test->m_perf)
+            _prg_report_perf(file, test->m_perf);
+
+          if (test->m_heap)
+            _prg_report_heap(file, test->m_leaked_bytes, test->m_heap);
         }
     }
 
@@ -34,7 +34,11 @@
 #include <glib.h>
 
 #define SIZE_1KB 1024
-#define SIZE_1MB SIZE_1KB * 1024
+#define SIZE_1MB (SIZE_1KB * 1024)
+
+#define NSEC_1US G_GUINT64_CONSTANT(1000)
+#define NSEC_1MS (NSEC_1US * 1000)
+#define NSEC_1S (NSEC_1MS * 1000)
 
 static gboolean g_opt_stderr = FALSE;
 static FILE *g_opt_print_out;
@@ -73,11 +77,105 @@ _humanly_readable_size(char *dest, int max_size, gsize size)
   else if (size >= SIZE_1KB)
     snprintf(dest, max_size, "%.2lf kB", (double)size / (double)SIZE_1KB);
   else
-    snprintf(dest, max_size, "%u B", size);
+    snprintf(dest, max_size, "%" G_GSIZE_FORMAT " B", size);
 
   return dest;
 }
 
+static char *
+_humanly_readable_time(char *dest, int max_size, double nsec)
+{
+  if (nsec >= NSEC_1S)
+    snprintf(dest, max_size, "%.3lf s", nsec / (double)NSEC_1S);
+  else if (nsec >= NSEC_1MS)
+    snprintf(dest, max_size, "%.3lf ms", nsec / (double)NSEC_1MS);
+  else if (nsec >= NSEC_1US)
+    snprintf(dest, max_size, "%.3lf us", nsec / (double)NSEC_1US);
+  else
+    snprintf(dest, max_size, "%.3lf ns", nsec);
+
+  return dest;
+}
+
+static void
+_std_report_show_time(guint64 wall_time, guint64 cpu_time)
+{
+  char wall_str[64];
+  char cpu_str[64];
+
+  fprintf(g_opt_print_out, " time: %s (cpu: %s)",
+    _humanly_readable_time(wall_str, sizeof(wall_str), wall_time),
+    _humanly_readable_time(cpu_str, sizeof(cpu_str), cpu_time));
+}
+
+static void
+_std_report_show_benchmark(const BenchmarkResult *bench)
+{
+  char mean_str[64], median_str[64], stddev_str[64], p99_str[64];
+  char alloc_str[128];
+
+  fprintf(g_opt_print_out, "        mean: %s median: %s stddev: %s p99: %s (%u x %" G_GUINT64_FORMAT " iterations)\n",
+    _humanly_readable_time(mean_str, sizeof(mean_str), bench->m_mean),
+    _humanly_readable_time(median_str, sizeof(median_str), bench->m_median),
+    _humanly_readable_time(stddev_str, sizeof(stddev_str), bench->m_stddev),
+    _humanly_readable_time(p99_str, sizeof(p99_str), bench->m_p99),
+    bench->m_samples, bench->m_iterations);
+
+  if (bench->m_allocs >= 0)
+    {
+      fprintf(g_opt_print_out, "        allocations per iteration: %.2lf (%s)\n",
+        bench->m_allocs,
+        _humanly_readable_size(alloc_str, sizeof(alloc_str), (gsize)bench->m_alloc_bytes));
+    }
+}
+
+static void
+_std_report_show_perf(const PerfCounterValues *perf)
+{
+  PerfCounterID id;
+  char clock_str[64];
+
+  fprintf(g_opt_print_out, "        counters:");
+  for (id = 0; id < PERF_COUNTER_MAX; id++)
+    {
+      if (!(perf->m_valid & PERF_COUNTER_BIT(id)))
+        continue;
+
+      if (id == PERF_COUNTER_TASK_CLOCK)
+        fprintf(g_opt_print_out, " %s: %s", tinu_lookup_key(PerfCounterID_names, id, NULL),
+          _humanly_readable_time(clock_str, sizeof(clock_str), perf->m_values[id]));
+      else
+        fprintf(g_opt_print_out, " %s: %" G_GUINT64_FORMAT,
+          tinu_lookup_key(PerfCounterID_names, id, NULL), perf->m_values[id]);
+    }
+  fprintf(g_opt_print_out, "\n");
+}
+
+static void
+_std_report_show_heap(const LeakwatchProfile *heap, StatisticsVerbosity verbosity)
+{
+  char peak_str[64], bytes_str[64], class_str[64];
+  gint i;
+
+  fprintf(g_opt_print_out, "        heap: peak: %s allocations: %" G_GUINT64_FORMAT " (%s)\n",
+    _humanly_readable_size(peak_str, sizeof(peak_str), heap->m_peak_bytes),
+    heap->m_allocs,
+    _humanly_readable_size(bytes_str, sizeof(bytes_str), heap->m_alloc_bytes));
+
+  if (verbosity != STAT_VERB_VERBOSE || !heap->m_allocs)
+    return;
+
+  fprintf(g_opt_print_out, "        sizes:");
+  for (i = 0; i < LEAKWATCH_SIZE_CLASSES; i++)
+    {
+      if (heap->m_histogram[i])
+        fprintf(g_opt_print_out, " %s+: %" G_GUINT64_FORMAT,
+          _humanly_readable_size(class_str, sizeof(class_str), i ? (gsize)1 << i : 0),
+          heap->m_histogram[i]);
+    }
+  fprintf(g_opt_print_out, "\n");
+}
+
 #define COL_OK(str) (colour ? "\033[32m" str "\033[0m" : str)
 #define COL_FAIL(str) (colour ? "\033[31m" str "\033[0m" : str)
 #define COL_FATAL(str) (colour ? "\033[1;41m" str "\033[0m" : str)
@@ -104,6 +202,7 @@ _std_report_show_suite(StatSuiteInfo *suite, StatisticsVerbosity verbosity, gboo
     {
       fprintf(g_opt_print_out, " assertions passed: %d/%d",
         suite->m_assertions_passed, suite->m_assertions);
+      _std_report_show_time(suite->m_wall_time, suite->m_cpu_time);
     }
   fprintf(g_opt_print_out, "\n");
 }
@@ -146,6 +245,7 @@ _std_report_show_case(StatTestInfo *test, StatisticsVerbosity verbosity, gboolea
     {
       fprintf(g_opt_print_out, " assertions passed: %d/%d",
         test->m_assertions_passed, test->m_assertions);
+      _std_report_show_time(test->m_wall_time, test->m_cpu_time);
     }
 
   if (test->m_leaked_bytes)
@@ -156,6 +256,15 @@ _std_report_show_case(StatTestInfo *test, StatisticsVerbosity verbosity, gboolea
                                test->m_leaked_bytes));
     }
   fprintf(g_opt_print_out, "\n");
+
+  if (test->m_benchmark)
+    _std_report_show_benchmark(test->m_benchmark);
+
+  if (test->m_perf)
+    _std_report_show_perf(test->m_perf);
+
+  if (test->m_heap)
+    _std_report_show_heap(test->m_heap, verbosity);
 }
 
 static gboolean
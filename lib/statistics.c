@@ -32,15 +32,6 @@
 
 #include <glib.h>
 
-#include <sys/times.h>
-
-static clock_t
-_stat_time()
-{
-  struct tms t;
-  return times(&t);
-}
-
 static gboolean
 _stat_message_counter(Message *msg, gpointer user_data)
 {
@@ -71,7 +62,6 @@ _stat_hook_case_begin(TestHookID hook_id, TestContext *context, gpointer user_da
   memset(&test_info, 0, sizeof(test_info));
 
   test_info.m_test = va_arg(vl, TestCase *);
-  test_info.m_start = _stat_time();
 
   g_array_append_val(self->m_suite_current->m_test_info_list, test_info);
   self->m_test_current = &g_array_index(self->m_suite_current->m_test_info_list, StatTestInfo,
@@ -82,6 +72,7 @@ static void
 _stat_hook_case_end(TestHookID hook_id, TestContext *context, gpointer user_data, va_list vl)
 {
   TestStatistics *self = (TestStatistics *)user_data;
+  const TestCaseTiming *timing;
 
   if (self->m_test_current->m_test != va_arg(vl, TestCase *))
     {
@@ -90,9 +81,14 @@ _stat_hook_case_end(TestHookID hook_id, TestContext *context, gpointer user_data
                 msg_tag_str("testcase", self->m_test_current->m_test->m_name), NULL);
       return;
     }
-  self->m_test_current->m_end = _stat_time();
   self->m_test_current->m_result = va_arg(vl, TestCaseResult);
 
+  timing = va_arg(vl, const TestCaseTiming *);
+  self->m_test_current->m_wall_time = timing->m_wall_time;
+  self->m_test_current->m_cpu_time = timing->m_cpu_time;
+  self->m_suite_current->m_wall_time += timing->m_wall_time;
+  self->m_suite_current->m_cpu_time += timing->m_cpu_time;
+
   switch (self->m_test_current->m_result)
     {
       case TEST_PASSED :
@@ -126,7 +122,6 @@ _stat_hook_suite_begin(TestHookID hook_id, TestContext *context, gpointer user_d
   memset(&suite_info, 0, sizeof(suite_info));
 
   suite_info.m_suite = va_arg(vl, TestSuite *);
-  suite_info.m_start = _stat_time();
   suite_info.m_test_info_list = g_array_new(FALSE, FALSE, sizeof(StatTestInfo));
 
   g_array_append_val(self->m_suite_info_list, suite_info);
@@ -145,7 +140,6 @@ _stat_hook_suite_end(TestHookID hook_id, TestContext *context, gpointer user_dat
                 msg_tag_str("suite", self->m_suite_current->m_suite->m_name), NULL);
       return;
     }
-  self->m_suite_current->m_end = _stat_time();
   self->m_suite_current->m_result = va_arg(vl, gboolean);
   self->m_suite_current = NULL;
 }
@@ -166,6 +160,60 @@ _stat_hook_leakwatch(TestHookID hook_id, TestContext *context, gpointer user_dat
   self->m_test_current->m_leaked_bytes = va_arg(vl, gsize);
 }
 
+static void
+_stat_hook_benchmark(TestHookID hook_id, TestContext *context, gpointer user_data, va_list vl)
+{
+  TestStatistics *self = (TestStatistics *)user_data;
+
+  if (self->m_test_current->m_test != va_arg(vl, TestCase *))
+    {
+      log_error("Duplicate test case in test statistics",
+                msg_tag_str("suite", self->m_suite_current->m_suite->m_name),
+                msg_tag_str("testcase", self->m_test_current->m_test->m_name), NULL);
+      return;
+    }
+
+  g_free(self->m_test_current->m_benchmark);
+  self->m_test_current->m_benchmark = g_memdup(va_arg(vl, const BenchmarkResult *),
+                                               sizeof(BenchmarkResult));
+}
+
+static void
+_stat_hook_perf_counters(TestHookID hook_id, TestContext *context, gpointer user_data, va_list vl)
+{
+  TestStatistics *self = (TestStatistics *)user_data;
+
+  if (self->m_test_current->m_test != va_arg(vl, TestCase *))
+    {
+      log_error("Duplicate test case in test statistics",
+                msg_tag_str("suite", self->m_suite_current->m_suite->m_name),
+                msg_tag_str("testcase", self->m_test_current->m_test->m_name), NULL);
+      return;
+    }
+
+  g_free(self->m_test_current->m_perf);
+  self->m_test_current->m_perf = g_memdup(va_arg(vl, const PerfCounterValues *),
+                                          sizeof(PerfCounterValues));
+}
+
+static void
+_stat_hook_heap_profile(TestHookID hook_id, TestContext *context, gpointer user_data, va_list vl)
+{
+  TestStatistics *self = (TestStatistics *)user_data;
+
+  if (self->m_test_current->m_test != va_arg(vl, TestCase *))
+    {
+      log_error("Duplicate test case in test statistics",
+                msg_tag_str("suite", self->m_suite_current->m_suite->m_name),
+                msg_tag_str("testcase", self->m_test_current->m_test->m_name), NULL);
+      return;
+    }
+
+  g_free(self->m_test_current->m_heap);
+  self->m_test_current->m_heap = g_memdup(va_arg(vl, const LeakwatchProfile *),
+                                          sizeof(LeakwatchProfile));
+}
+
 static TestHookCb g_stat_hooks[TEST_HOOK_MAX] = {
   [TEST_HOOK_ASSERT]            = &_stat_hook_assert,
   [TEST_HOOK_SIGNAL_ABORT]      = NULL,
@@ -175,6 +223,9 @@ static TestHookCb g_stat_hooks[TEST_HOOK_MAX] = {
   [TEST_HOOK_BEFORE_SUITE]      = &_stat_hook_suite_begin,
   [TEST_HOOK_AFTER_SUITE]       = &_stat_hook_suite_end,
   [TEST_HOOK_LEAKINFO]          = &_stat_hook_leakwatch,
+  [TEST_HOOK_BENCHMARK]         = &_stat_hook_benchmark,
+  [TEST_HOOK_PERF_COUNTERS]     = &_stat_hook_perf_counters,
+  [TEST_HOOK_HEAP_PROFILE]      = &_stat_hook_heap_profile,
 };
 
 TestStatistics *
@@ -190,13 +241,20 @@ void
 stat_destroy(TestStatistics *self)
 {
   StatSuiteInfo *suite;
-  gint i;
+  gint i, j;
 
   stat_stop(self);
 
   for (i = 0; i < self->m_suite_info_list->len; i++)
     {
       suite = &g_array_index(self->m_suite_info_list, StatSuiteInfo, i);
+
+      for (j = 0; j < suite->m_test_info_list->len; j++)
+        {
+          g_free(g_array_index(suite->m_test_info_list, StatTestInfo, j).m_benchmark);
+          g_free(g_array_index(suite->m_test_info_list, StatTestInfo, j).m_perf);
+          g_free(g_array_index(suite->m_test_info_list, StatTestInfo, j).m_heap);
+        }
       g_array_free(suite->m_test_info_list, TRUE);
     }
 
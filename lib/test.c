@@ -28,16 +28,25 @@
 * Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
 */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 
 #include <ucontext.h>
 #include <signal.h>
+#include <pthread.h>
+#include <dlfcn.h>
 
 #include <tinu/utils.h>
 #include <tinu/test.h>
 #include <tinu/backtrace.h>
 #include <tinu/leakwatch.h>
+#include <tinu/allocprofile.h>
+#include <tinu/record.h>
+#include <tinu/jobs.h>
+#include <tinu/threads.h>
+#include <tinu/perf.h>
 #include <tinu/config.h>
 
 #ifndef sighandler_t
@@ -53,11 +62,205 @@ typedef void (*sighandler_t)(int);
 static sighandler_t g_sigsegv_handler = NULL;
 static sighandler_t g_sigabrt_handler = NULL;
 
-static TestContext *g_test_context_current = NULL;
-static TestCase *g_test_case_current = NULL;
-static TestCaseResult g_test_case_current_result = TEST_NONE;
+static GMutex g_signal_lock;
+static gint g_signal_refs = 0;
+
+typedef struct _TestThreadLink TestThreadLink;
+
+/* Test execution state, one instance per thread running test cases */
+typedef struct _TestThreadState
+{
+  TestContext    *m_context;
+  TestCase       *m_case;
+  TestCaseResult  m_result;
+  TestRecord     *m_record;
+
+  /* Set while a test case found leaking by the screening is run again
+   * under the leak watcher, only the leak results of the run are kept */
+  gboolean        m_leak_rerun;
+
+  /* Given to the threads started by the running test case */
+  TestThreadLink *m_link;
+
+  ucontext_t      m_ucontext;
+} TestThreadState;
+
+/* Threads started by a test case have no state of their own, their
+ * assertions and hooks belong to the test case. The link is detached
+ * (under g_test_link_lock) when the test case is done, the threads
+ * outliving it keep their reference only. */
+struct _TestThreadLink
+{
+  volatile gint     m_refs;
+  TestThreadState  *m_state;
+};
+
+static __thread TestThreadState g_test_state;
+static __thread TestThreadLink *g_test_thread_link = NULL;
+
+/* State of the test case running when test cases are not run in threads,
+ * for the threads not started by a test case (eg. a thread pool of a
+ * library started earlier) */
+static TestThreadState *volatile g_test_state_shared = NULL;
+
+/* The threads of a test case may record concurrently */
+static GMutex g_test_record_lock;
+static GMutex g_test_link_lock;
+
+static pthread_once_t g_test_thread_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_test_thread_key;
+static int (*g_test_pthread_create)(pthread_t *, const pthread_attr_t *,
+                                    void *(*)(void *), void *) = NULL;
+
+/* The state the calling thread reports to. The link lock is held for the
+ * threads started by a test case until _test_state_release(). */
+static TestThreadState *
+_test_state_acquire(void)
+{
+  TestThreadLink *link = g_test_thread_link;
+
+  if (g_test_state.m_context)
+    return &g_test_state;
+
+  if (link)
+    {
+      g_mutex_lock(&g_test_link_lock);
+      if (link->m_state)
+        return link->m_state;
+      g_mutex_unlock(&g_test_link_lock);
+    }
+
+  if (g_test_state_shared)
+    return g_test_state_shared;
+
+  return &g_test_state;
+}
+
+static inline void
+_test_state_release(TestThreadState *state)
+{
+  if (!g_test_state.m_context && g_test_thread_link && g_test_thread_link->m_state == state)
+    g_mutex_unlock(&g_test_link_lock);
+}
+
+static void
+_test_link_unref(gpointer user_data)
+{
+  TestThreadLink *link = (TestThreadLink *)user_data;
+
+  if (g_atomic_int_dec_and_test(&link->m_refs))
+    {
+      tinu_leakwatch_suspend();
+      g_free(link);
+      tinu_leakwatch_resume();
+    }
+}
+
+/* Called by the thread running the test case when it is done */
+static void
+_test_link_detach(TestThreadState *state)
+{
+  TestThreadLink *link = state->m_link;
 
-ucontext_t g_test_ucontext;
+  if (!link)
+    return;
+
+  g_mutex_lock(&g_test_link_lock);
+  link->m_state = NULL;
+  g_mutex_unlock(&g_test_link_lock);
+
+  state->m_link = NULL;
+  _test_link_unref(link);
+}
+
+/* Link for a thread started by the calling thread, NULL if the calling
+ * thread does not run (and was not started by) a test case */
+static TestThreadLink *
+_test_link_new_thread(void)
+{
+  TestThreadLink *link = g_test_thread_link;
+
+  if (g_test_state.m_case)
+    {
+      if (!g_test_state.m_link)
+        {
+          tinu_leakwatch_suspend();
+          g_test_state.m_link = g_new0(TestThreadLink, 1);
+          tinu_leakwatch_resume();
+
+          g_test_state.m_link->m_refs = 1;
+          g_test_state.m_link->m_state = &g_test_state;
+        }
+      link = g_test_state.m_link;
+    }
+  else if (!link || !link->m_state)
+    return NULL;
+
+  g_atomic_int_inc(&link->m_refs);
+  return link;
+}
+
+typedef struct _TestThreadStart
+{
+  void         *(*m_func)(void *);
+  void           *m_arg;
+  TestThreadLink *m_link;
+} TestThreadStart;
+
+static void
+_test_thread_init(void)
+{
+  pthread_key_create(&g_test_thread_key, _test_link_unref);
+  g_test_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+}
+
+static void *
+_test_thread_start(void *user_data)
+{
+  TestThreadStart start = *(TestThreadStart *)user_data;
+
+  tinu_leakwatch_suspend();
+  g_free(user_data);
+  tinu_leakwatch_resume();
+
+  /* The key drops the reference when the thread exits */
+  g_test_thread_link = start.m_link;
+  pthread_setspecific(g_test_thread_key, start.m_link);
+  return start.m_func(start.m_arg);
+}
+
+/* Threads started by test cases are linked to them, whichever way test
+ * cases are run */
+int
+pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+               void *(*func)(void *), void *arg)
+{
+  TestThreadStart *start;
+  TestThreadLink *link;
+  int res;
+
+  pthread_once(&g_test_thread_once, _test_thread_init);
+  if (!(link = _test_link_new_thread()))
+    return g_test_pthread_create(thread, attr, func, arg);
+
+  tinu_leakwatch_suspend();
+  start = g_new(TestThreadStart, 1);
+  tinu_leakwatch_resume();
+
+  start->m_func = func;
+  start->m_arg = arg;
+  start->m_link = link;
+
+  if ((res = g_test_pthread_create(thread, attr, _test_thread_start, start)) != 0)
+    {
+      tinu_leakwatch_suspend();
+      g_free(start);
+      tinu_leakwatch_resume();
+      _test_link_unref(link);
+    }
+
+  return res;
+}
 
 typedef struct _LeakInfo
 {
@@ -73,28 +276,82 @@ typedef struct _TestSimplifiedFunctions
   TestFunctionSimple      m_function;
 } TestSimplifiedFunctions;
 
+typedef struct _TestParallelRun
+{
+  TestContext    *m_context;
+  GPtrArray      *m_tests;
+  TestRecord    **m_records;
+  guint           m_next;
+
+  TestSuite      *m_suite;
+  gboolean        m_suite_result;
+  gboolean        m_result;
+} TestParallelRun;
+
 static void
-_test_run_hooks(TestHookID hook_id, ...)
+_test_vrun_hooks(TestContext *self, TestHookID hook_id, va_list vl)
 {
-  va_list vl;
+  va_list vl_hook;
   CListIterator *iter;
   TestHookEntry *entry;
 
   g_assert (hook_id < TEST_HOOK_MAX);
-  for (iter = clist_iter_new(g_test_context_current->m_hooks[hook_id]); clist_iter_next(iter); )
+  for (iter = clist_iter_new(self->m_hooks[hook_id]); clist_iter_next(iter); )
     {
       entry = (TestHookEntry *)clist_iter_data(iter);
 
       if (!entry->m_hook)
         continue;
 
-      va_start(vl, hook_id);
-      entry->m_hook(hook_id, g_test_context_current, entry->m_user_data, vl);
-      va_end(vl);
+      va_copy(vl_hook, vl);
+      entry->m_hook(hook_id, self, entry->m_user_data, vl_hook);
+      va_end(vl_hook);
     }
   clist_iter_done(iter);
 }
 
+/* Hooks of a running test case are recorded when the test case is run
+ * outside of the main flow */
+static void
+_test_vemit_hooks(TestHookID hook_id, va_list vl)
+{
+  TestThreadState *state = _test_state_acquire();
+
+  /* A thread not started by a test case (or outliving it) has no test
+   * case to report to */
+  if (!state->m_context ||
+      (state->m_leak_rerun &&
+       hook_id != TEST_HOOK_LEAKINFO && hook_id != TEST_HOOK_HEAP_PROFILE))
+    {
+      _test_state_release(state);
+      return;
+    }
+
+  /* The record outlives the test case, it is not a leak of the test */
+  if (state->m_record)
+    {
+      tinu_leakwatch_suspend();
+      g_mutex_lock(&g_test_record_lock);
+      test_record_vhook(state->m_record, hook_id, vl);
+      g_mutex_unlock(&g_test_record_lock);
+      tinu_leakwatch_resume();
+    }
+  else
+    _test_vrun_hooks(state->m_context, hook_id, vl);
+
+  _test_state_release(state);
+}
+
+static void
+_test_run_hooks(TestHookID hook_id, ...)
+{
+  va_list vl;
+
+  va_start(vl, hook_id);
+  _test_vemit_hooks(hook_id, vl);
+  va_end(vl);
+}
+
 static gboolean
 _test_validate_name(const gchar *name)
 {
@@ -113,44 +370,64 @@ _signal_handler(int signo)
 {
   Backtrace *trace;
 
+  /* Not raised by a test case (eg. a thread not running tests) */
+  if (!g_test_state.m_case)
+    {
+      signal(signo, SIG_DFL);
+      raise(signo);
+      return;
+    }
+
 #ifdef COREDUMPER_ENABLED
-  WriteCoreDump(core_file_name(g_test_context_current->m_core_dir,
-    g_test_case_current->m_suite->m_name, g_test_case_current->m_name));
+  WriteCoreDump(core_file_name(g_test_state.m_context->m_core_dir,
+    g_test_state.m_case->m_suite->m_name, g_test_state.m_case->m_name));
 #endif
   trace = backtrace_create(3);
   log_error("Signal received while running a test",
             msg_tag_int("signal", signo),
-            msg_tag_str("suite", g_test_case_current->m_suite->m_name),
-            msg_tag_str("test", g_test_case_current->m_name), NULL);
+            msg_tag_str("suite", g_test_state.m_case->m_suite->m_name),
+            msg_tag_str("test", g_test_state.m_case->m_name), NULL);
   backtrace_dump_log(trace, "    ", LOG_ERR);
   backtrace_unreference(trace);
 
   if (signo == SIGABRT)
     {
       _test_run_hooks(TEST_HOOK_SIGNAL_ABORT);
-      g_test_case_current_result = TEST_ABORT;
+      g_test_state.m_result = TEST_ABORT;
     }
   else
     {
       _test_run_hooks(TEST_HOOK_SIGNAL_SEGFAULT);
-      g_test_case_current_result = TEST_SEGFAULT;
+      g_test_state.m_result = TEST_SEGFAULT;
     }
 
-  setcontext(g_test_ucontext.uc_link);
+  setcontext(g_test_state.m_ucontext.uc_link);
 }
 
+/* The handlers are process-wide, so they are installed by the first running
+ * test case and restored when the last one finishes */
 void
 _signal_on()
 {
-  g_sigsegv_handler = signal(SIGSEGV, _signal_handler);
-  g_sigabrt_handler = signal(SIGABRT, _signal_handler);
+  g_mutex_lock(&g_signal_lock);
+  if (g_signal_refs++ == 0)
+    {
+      g_sigsegv_handler = signal(SIGSEGV, _signal_handler);
+      g_sigabrt_handler = signal(SIGABRT, _signal_handler);
+    }
+  g_mutex_unlock(&g_signal_lock);
 }
 
 void
 _signal_off()
 {
-  signal(SIGSEGV, g_sigsegv_handler);
-  signal(SIGABRT, g_sigabrt_handler);
+  g_mutex_lock(&g_signal_lock);
+  if (--g_signal_refs == 0)
+    {
+      signal(SIGSEGV, g_sigsegv_handler);
+      signal(SIGABRT, g_sigabrt_handler);
+    }
+  g_mutex_unlock(&g_signal_lock);
 }
 
 void
@@ -158,7 +435,7 @@ _test_case_run_intern(TestContext *self, TestCase *test)
 {
   gpointer ctx = NULL;
 
-  g_test_case_current = test;
+  g_test_state.m_case = test;
   _test_run_hooks(TEST_HOOK_BEFORE_TEST, test);
 
   if (test->m_setup)
@@ -170,55 +447,100 @@ _test_case_run_intern(TestContext *self, TestCase *test)
   if (test->m_cleanup)
     test->m_cleanup(test, ctx);
 
-  if (g_test_case_current_result == TEST_NONE)
-    g_test_case_current_result = TEST_PASSED;
+  if (g_test_state.m_result == TEST_NONE)
+    g_test_state.m_result = TEST_PASSED;
 }
 
 TestCaseResult
 _test_case_run_single_test(TestContext *self, TestCase *test)
 {
+  /* The stack is allocated first, it is not part of the heap of the test */
+  gpointer stack = g_malloc0(TEST_CTX_STACK_SIZE);
+
+  gboolean leakwatch = (self->m_leakwatch || g_test_state.m_leak_rerun);
   GHashTable *leak_table = NULL;
-  gpointer leak_handler = (self->m_leakwatch ? tinu_leakwatch_simple(&leak_table) : NULL);
+  gpointer leak_handler = (leakwatch ? tinu_leakwatch_simple(&leak_table) : NULL);
 
-  gpointer stack = g_malloc0(TEST_CTX_STACK_SIZE);
   gsize leaked_bytes;
+  LeakwatchProfile heap_profile;
+
+  gboolean leak_screen = (self->m_leak_screen && !leakwatch);
+  LeakwatchCounters leak_counters, leak_delta;
+
+  AllocProfile *alloc_profile =
+    (self->m_alloc_profile && !g_test_state.m_leak_rerun ? alloc_profile_start() : NULL);
+  GArray *alloc_sites = NULL;
 
   ucontext_t main_ctx;
+  TestCaseTiming timing;
+  guint64 wall_start = tinu_clock_ns(CLOCK_MONOTONIC);
+  guint64 cpu_start = tinu_clock_ns(CLOCK_THREAD_CPUTIME_ID);
 
-  g_test_case_current_result = TEST_NONE;
+  PerfCounterValues perf_values;
+  PerfCounters *perf = (self->m_perf_counters && !g_test_state.m_leak_rerun ?
+                        perf_counters_start(self->m_perf_counters) : NULL);
+
+  TestCaseResult result;
+  TestThreadState *shared = g_test_state_shared;
+
+  if (leak_screen)
+    tinu_leakwatch_counters_start(&leak_counters);
+
+  g_test_state.m_result = TEST_NONE;
+  if (self->m_threads <= 1)
+    g_test_state_shared = &g_test_state;
 
   if (self->m_sighandle)
     {
       _signal_on();
 
-      if (getcontext(&g_test_ucontext) == -1)
+      if (getcontext(&g_test_state.m_ucontext) == -1)
         {
           log_error("Cannot get main context", msg_tag_errno(), NULL);
-          g_test_case_current_result = TEST_INTERNAL;
+          g_test_state.m_result = TEST_INTERNAL;
           goto test_case_run_done;
         }
 
-      g_test_ucontext.uc_stack.ss_sp = stack;
-      g_test_ucontext.uc_stack.ss_size = TEST_CTX_STACK_SIZE;
-      g_test_ucontext.uc_link = &main_ctx;
-      makecontext(&g_test_ucontext, (void (*)())(&_test_case_run_intern), 2, self, test);
+      g_test_state.m_ucontext.uc_stack.ss_sp = stack;
+      g_test_state.m_ucontext.uc_stack.ss_size = TEST_CTX_STACK_SIZE;
+      g_test_state.m_ucontext.uc_link = &main_ctx;
+      makecontext(&g_test_state.m_ucontext, (void (*)())(&_test_case_run_intern), 2, self, test);
     
-      if (swapcontext(&main_ctx, &g_test_ucontext) == -1)
+      if (swapcontext(&main_ctx, &g_test_state.m_ucontext) == -1)
         {
           log_error("Cannot change context", msg_tag_errno(), NULL);
-          g_test_case_current_result = TEST_INTERNAL;
+          g_test_state.m_result = TEST_INTERNAL;
           goto test_case_run_done;
         }
     
-      g_free(stack);
-    
       _signal_off();
     }
   else
     _test_case_run_intern(self, test);
 
 test_case_run_done:
-  switch (g_test_case_current_result)
+  /* Threads left running report to no test case from now on */
+  _test_link_detach(&g_test_state);
+
+  /* A crashed test case left its budgets on the stack freed below */
+  tinu_leakwatch_budget_reset();
+
+  if (perf)
+    perf_counters_stop(perf, &perf_values);
+
+  if (alloc_profile)
+    alloc_sites = alloc_profile_stop(alloc_profile);
+
+  if (leak_screen)
+    tinu_leakwatch_counters_stop(&leak_counters, &leak_delta);
+
+  /* Freed after the counters are stopped, it was allocated before them */
+  g_free(stack);
+
+  timing.m_wall_time = tinu_clock_ns(CLOCK_MONOTONIC) - wall_start;
+  timing.m_cpu_time = tinu_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+  switch (g_test_state.m_result)
     {
       case TEST_PASSED :
         log_notice("Test case run successfull",
@@ -256,21 +578,179 @@ test_case_run_done:
 
   if (leak_handler)
     {
+      tinu_leakwatch_simple_profile(leak_handler, &heap_profile);
       tinu_unregister_watch(leak_handler);
 
       // Send summary to hooks
       leaked_bytes = tinu_leakwatch_summary(leak_table);
       _test_run_hooks(TEST_HOOK_LEAKINFO, test, leaked_bytes);
+      _test_run_hooks(TEST_HOOK_HEAP_PROFILE, test, &heap_profile);
 
       // Dump statistics
-      if (g_test_case_current_result == TEST_PASSED)
-        tinu_leakwatch_simple_dump(leak_table, LOG_WARNING);
+      if (g_test_state.m_result == TEST_PASSED)
+        tinu_leakwatch_simple_report(leak_table, LOG_WARNING, self->m_leakwatch_sites);
 
       g_hash_table_destroy(leak_table);
     }
 
-  _test_run_hooks(TEST_HOOK_AFTER_TEST, test, g_test_case_current_result);
-  return g_test_case_current_result;
+  /* Only the passed test cases that left more blocks allocated than they
+   * found are run again to find their leaks (the blocks allocated before
+   * the test and grown by it are not leaks of the test) */
+  if (leak_screen)
+    {
+      if (g_test_state.m_result == TEST_PASSED && leak_delta.m_blocks > 0)
+        {
+          log_notice("Test case may leak memory, running it again with the leak watcher",
+                     msg_tag_str("case", test->m_name),
+                     msg_tag_str("suite", test->m_suite->m_name),
+                     msg_tag_printf("blocks", "%" G_GINT64_FORMAT, leak_delta.m_blocks),
+                     msg_tag_printf("bytes", "%" G_GINT64_FORMAT, leak_delta.m_bytes), NULL);
+
+          result = g_test_state.m_result;
+          g_test_state.m_leak_rerun = TRUE;
+          _test_case_run_single_test(self, test);
+          g_test_state.m_leak_rerun = FALSE;
+          g_test_state.m_result = result;
+          g_test_state.m_case = test;
+        }
+      else
+        _test_run_hooks(TEST_HOOK_LEAKINFO, test, (gsize)0);
+    }
+
+  if (alloc_sites)
+    {
+      log_warn("Allocation profile",
+               msg_tag_str("case", test->m_name),
+               msg_tag_str("suite", test->m_suite->m_name),
+               msg_tag_int("sites", alloc_sites->len), NULL);
+      alloc_profile_dump(alloc_sites, ALLOC_PROFILE_DUMP_SITES, LOG_WARNING);
+
+      g_array_free(alloc_sites, TRUE);
+    }
+
+  if (perf && perf_values.m_valid)
+    _test_run_hooks(TEST_HOOK_PERF_COUNTERS, test, &perf_values);
+
+  _test_run_hooks(TEST_HOOK_AFTER_TEST, test, g_test_state.m_result, &timing);
+  g_test_state.m_case = NULL;
+  g_test_state_shared = shared;
+  return g_test_state.m_result;
+}
+
+static gboolean
+_test_record_message(Message *msg, gpointer user_data)
+{
+  tinu_leakwatch_suspend();
+  g_mutex_lock(&g_test_record_lock);
+  test_record_message((TestRecord *)user_data, msg);
+  g_mutex_unlock(&g_test_record_lock);
+  tinu_leakwatch_resume();
+  return TRUE;
+}
+
+TestRecord *
+test_case_run_recorded(TestContext *self, TestCase *test)
+{
+  TestRecord *record = test_record_new(test);
+
+  g_test_state.m_context = self;
+  g_test_state.m_record = record;
+  log_capture(_test_record_message, record);
+
+  _test_case_run_single_test(self, test);
+
+  log_capture(NULL, NULL);
+  g_test_state.m_record = NULL;
+  return record;
+}
+
+static void
+_test_parallel_suite_done(TestParallelRun *run)
+{
+  log_format(run->m_suite_result ? LOG_DEBUG : LOG_WARNING, "Test suite run complete",
+            msg_tag_str("suite", run->m_suite->m_name),
+            msg_tag_bool("result", run->m_suite_result), NULL);
+
+  _test_run_hooks(TEST_HOOK_AFTER_SUITE, run->m_suite, run->m_suite_result);
+  run->m_result &= run->m_suite_result;
+  run->m_suite = NULL;
+}
+
+static void
+_test_parallel_done(guint index, TestRecord *record, gpointer user_data)
+{
+  TestParallelRun *run = (TestParallelRun *)user_data;
+
+  run->m_records[index] = record;
+
+  /* Records are replayed in the original order so the hooks see the same
+   * sequence of events as with a serial run */
+  while (run->m_next < run->m_tests->len && run->m_records[run->m_next])
+    {
+      record = run->m_records[run->m_next];
+      run->m_records[run->m_next++] = NULL;
+
+      if (run->m_suite != record->m_test->m_suite)
+        {
+          if (run->m_suite)
+            _test_parallel_suite_done(run);
+
+          run->m_suite = record->m_test->m_suite;
+          run->m_suite_result = TRUE;
+          _test_run_hooks(TEST_HOOK_BEFORE_SUITE, run->m_suite);
+        }
+
+      test_record_replay(record, run->m_context);
+      run->m_suite_result &= (record->m_result == TEST_PASSED);
+      test_record_free(record);
+    }
+}
+
+static gboolean
+_test_parallel_run(TestContext *self, TestSuite *only_suite)
+{
+  TestParallelRun run;
+  TestSuite *suite;
+  guint i, j;
+
+  memset(&run, 0, sizeof(run));
+  run.m_context = self;
+  run.m_tests = g_ptr_array_new();
+  run.m_result = TRUE;
+
+  for (i = 0; i < self->m_suites->len; i++)
+    {
+      suite = (TestSuite *)g_ptr_array_index(self->m_suites, i);
+      if (only_suite && suite != only_suite)
+        continue;
+
+      for (j = 0; j < suite->m_tests->len; j++)
+        g_ptr_array_add(run.m_tests, g_ptr_array_index(suite->m_tests, j));
+    }
+
+  run.m_records = g_new0(TestRecord *, run.m_tests->len);
+  g_test_state.m_context = self;
+
+  if (self->m_threads > 1)
+    {
+      if (!test_threads_run(self, run.m_tests, _test_parallel_done, &run))
+        run.m_result = FALSE;
+    }
+  else if (!test_jobs_run(self, run.m_tests, _test_parallel_done, &run))
+    run.m_result = FALSE;
+
+  if (run.m_suite)
+    _test_parallel_suite_done(&run);
+
+  for (i = 0; i < run.m_tests->len; i++)
+    {
+      if (run.m_records[i])
+        test_record_free(run.m_records[i]);
+    }
+
+  g_free(run.m_records);
+  g_ptr_array_free(run.m_tests, TRUE);
+  return run.m_result;
 }
 
 gboolean
@@ -279,7 +759,7 @@ _test_suite_run(TestContext *self, TestSuite *suite, TestCase *test)
   gint i;
   gboolean res = TRUE;
 
-  g_test_context_current = self;
+  g_test_state.m_context = self;
   _test_run_hooks(TEST_HOOK_BEFORE_SUITE, suite);
 
   if (test)
@@ -377,6 +857,12 @@ void
 test_context_init(TestContext *self)
 {
   self->m_suites = g_ptr_array_new();
+  self->m_jobs = 1;
+  self->m_threads = 1;
+  self->m_perf_counters = 0;
+  self->m_leakwatch_sites = LEAKWATCH_REPORT_SITES;
+  self->m_leak_screen = FALSE;
+  self->m_alloc_profile = FALSE;
   memset(self->m_hooks, 0, sizeof(self->m_hooks));
 }
 
@@ -575,6 +1061,9 @@ tinu_test_all_run(TestContext *self)
   gboolean res = TRUE, suite_res;
   gint i;
 
+  if (self->m_jobs > 1 || self->m_threads > 1)
+    return _test_parallel_run(self, NULL);
+
   for (i = 0; i < self->m_suites->len; i++)
     {
       suite_res = _test_suite_run(self, (TestSuite *)g_ptr_array_index(self->m_suites, i), NULL);
@@ -595,6 +1084,9 @@ tinu_test_suite_run(TestContext *self, const gchar *suite_name)
       return FALSE;
     }
 
+  if (self->m_jobs > 1 || self->m_threads > 1)
+    return _test_parallel_run(self, suite);
+
   return _test_suite_run(self, suite, NULL);
 }
 
@@ -622,17 +1114,57 @@ tinu_test_case_run(TestContext *self, const gchar *suite_name, const gchar *test
   return _test_suite_run(self, suite, test);
 }
 
+void
+test_run_hooks(TestContext *self, TestHookID hook_id, ...)
+{
+  va_list vl;
+
+  va_start(vl, hook_id);
+  _test_vrun_hooks(self, hook_id, vl);
+  va_end(vl);
+}
+
+TestContext *
+tinu_test_context_current(void)
+{
+  TestThreadState *state = _test_state_acquire();
+  TestContext *res = state->m_context;
+
+  _test_state_release(state);
+  return res;
+}
+
+void
+tinu_test_emit_hook(TestHookID hook_id, ...)
+{
+  va_list vl;
+
+  va_start(vl, hook_id);
+  _test_vemit_hooks(hook_id, vl);
+  va_end(vl);
+}
+
 gboolean
 tinu_test_assert(gboolean condition, const gchar *assert_type, const gchar *condstr,
   const gchar *file, const gchar *func, gint line, MessageTag *tag0, ...)
 {
   va_list vl;
   Message *msg;
+  TestThreadState *state;
 
   _test_run_hooks(TEST_HOOK_ASSERT, condition, file, func, line);
 
   if (!condition)
-    g_test_case_current_result = TEST_FAILED;
+    {
+      state = _test_state_acquire();
+      if (!state->m_context)
+        log_crit("Assertion failed outside of a test case, it is not counted",
+                 msg_tag_str("condition", condstr),
+                 msg_tag_str("file", file),
+                 msg_tag_int("line", line), NULL);
+      state->m_result = TEST_FAILED;
+      _test_state_release(state);
+    }
 
   if ((condition && g_log_max_priority >= LOG_DEBUG) ||
       (!condition && g_log_max_priority >= LOG_ERR))
@@ -659,6 +1191,156 @@ tinu_test_assert(gboolean condition, const gchar *assert_type, const gchar *cond
   return condition;
 }
 
+gboolean
+tinu_test_assert_budget(const LeakwatchBudget *budget, const gchar *codestr,
+  const gchar *file, const gchar *func, gint line)
+{
+  guint32 i;
+  gboolean res;
+
+  /* The messages are not allocations of an enclosing budget */
+  tinu_leakwatch_suspend();
+  res = tinu_test_assert(budget->m_allocs <= budget->m_max_allocs, "allocation budget", codestr,
+                         file, func, line,
+                         msg_tag_printf("allocs", "%" G_GUINT64_FORMAT, budget->m_allocs),
+                         msg_tag_printf("bytes", "%" G_GUINT64_FORMAT, budget->m_bytes),
+                         msg_tag_printf("max_allocs", "%" G_GUINT64_FORMAT, budget->m_max_allocs),
+                         NULL);
+
+  if (!res && g_log_max_priority >= LOG_ERR)
+    {
+      for (i = 0; i < budget->m_trace_count; i++)
+        {
+          log_error("  Allocation over the budget", msg_tag_int("index", budget->m_max_allocs + i + 1), NULL);
+          backtrace_dump_log(backtrace_lookup(budget->m_traces[i]), "    ", LOG_ERR);
+        }
+    }
+  tinu_leakwatch_resume();
+
+  return res;
+}
+
+static const AllocSite *
+_test_growth_site(GHashTable *sites, BacktraceId trace)
+{
+  static const AllocSite none = { 0 };
+  const AllocSite *res = g_hash_table_lookup(sites, GUINT_TO_POINTER(trace));
+
+  return res ? res : &none;
+}
+
+static GHashTable *
+_test_growth_index(GArray *snapshot)
+{
+  GHashTable *res = g_hash_table_new(g_direct_hash, g_direct_equal);
+  AllocSite *site;
+  guint i;
+
+  for (i = 0; i < snapshot->len; i++)
+    {
+      site = &g_array_index(snapshot, AllocSite, i);
+      g_hash_table_insert(res, GUINT_TO_POINTER(site->m_trace), site);
+    }
+
+  return res;
+}
+
+gboolean
+tinu_test_assert_no_growth(TestFunctionSimple func, gpointer ctx, guint iterations,
+  const gchar *funcstr, const gchar *file, const gchar *func_name, gint line)
+{
+  AllocProfile *profile;
+  GArray *snapshots[3];
+  GHashTable *index[2];
+  GPtrArray *growing;
+  const AllocSite *site, *first, *second;
+  gint64 growth1, growth2;
+  guint i, j;
+  gboolean res;
+
+  /* Watches are process-wide, the other test cases would be profiled too */
+  if (g_test_state.m_context && g_test_state.m_context->m_threads > 1)
+    {
+      log_warn("Heap growth cannot be checked while running test cases in threads",
+               msg_tag_str("function", func_name),
+               msg_tag_int("line", line), NULL);
+
+      for (i = 0; i < 3 * iterations; i++)
+        func(ctx);
+      return TRUE;
+    }
+
+  /* The first round warms the caches up */
+  for (i = 0; i < iterations; i++)
+    func(ctx);
+
+  profile = alloc_profile_start();
+  for (j = 0; j < 3; j++)
+    {
+      if (j > 0)
+        {
+          for (i = 0; i < iterations; i++)
+            func(ctx);
+        }
+
+      snapshots[j] = (j < 2 ? alloc_profile_snapshot(profile) : alloc_profile_stop(profile));
+    }
+
+  tinu_leakwatch_suspend();
+
+  /* A site grows if it kept growing at least half as fast in the third
+   * round as in the second one, caches level off */
+  growing = g_ptr_array_new();
+  index[0] = _test_growth_index(snapshots[0]);
+  index[1] = _test_growth_index(snapshots[1]);
+  for (i = 0; i < snapshots[2]->len; i++)
+    {
+      site = &g_array_index(snapshots[2], AllocSite, i);
+      first = _test_growth_site(index[0], site->m_trace);
+      second = _test_growth_site(index[1], site->m_trace);
+
+      growth1 = (gint64)second->m_live_bytes - (gint64)first->m_live_bytes;
+      growth2 = (gint64)site->m_live_bytes - (gint64)second->m_live_bytes;
+      if (growth1 > 0 && growth2 > 0 && 2 * growth2 >= growth1)
+        g_ptr_array_add(growing, (gpointer)site);
+    }
+
+  tinu_leakwatch_resume();
+
+  res = tinu_test_assert(growing->len == 0, "no heap growth", funcstr, file, func_name, line,
+                         msg_tag_int("iterations", iterations),
+                         msg_tag_int("growing_sites", growing->len), NULL);
+
+  if (!res && g_log_max_priority >= LOG_ERR)
+    {
+      for (i = 0; i < growing->len; i++)
+        {
+          site = (const AllocSite *)g_ptr_array_index(growing, i);
+          first = _test_growth_site(index[0], site->m_trace);
+          second = _test_growth_site(index[1], site->m_trace);
+
+          log_error("  Growing allocation site",
+                    msg_tag_printf("live_bytes", "%" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT
+                                   " -> %" G_GUINT64_FORMAT, first->m_live_bytes,
+                                   second->m_live_bytes, site->m_live_bytes),
+                    msg_tag_printf("live_blocks", "%" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT
+                                   " -> %" G_GUINT64_FORMAT, first->m_live_blocks,
+                                   second->m_live_blocks, site->m_live_blocks), NULL);
+          backtrace_dump_log(backtrace_lookup(site->m_trace), "    ", LOG_ERR);
+        }
+    }
+
+  tinu_leakwatch_suspend();
+  g_ptr_array_free(growing, TRUE);
+  for (j = 0; j < 2; j++)
+    g_hash_table_destroy(index[j]);
+  for (j = 0; j < 3; j++)
+    g_array_free(snapshots[j], TRUE);
+  tinu_leakwatch_resume();
+
+  return res;
+}
+
 const NameTable TestCaseResult_names[] =
 {
   { TEST_NONE,        "none",       4 },
@@ -679,6 +1361,10 @@ const NameTable TestHookID_names[] =
   { TEST_HOOK_AFTER_TEST,       "TEST_HOOK_AFTER_TEST",       20 },
   { TEST_HOOK_BEFORE_SUITE,     "TEST_HOOK_BEFORE_SUITE",     22 },
   { TEST_HOOK_AFTER_SUITE,      "TEST_HOOK_AFTER_SUITE",      21 },
+  { TEST_HOOK_LEAKINFO,         "TEST_HOOK_LEAKINFO",         18 },
+  { TEST_HOOK_BENCHMARK,        "TEST_HOOK_BENCHMARK",        19 },
+  { TEST_HOOK_PERF_COUNTERS,    "TEST_HOOK_PERF_COUNTERS",    23 },
+  { TEST_HOOK_HEAP_PROFILE,     "TEST_HOOK_HEAP_PROFILE",     22 },
   { TEST_HOOK_MAX,              "TEST_HOOK_MAX",              13 },
   { TEST_HOOK_ALL,              "TEST_HOOK_ALL",              13 },
   { 0,                          NULL,                          0 }
@@ -0,0 +1,223 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+#include <glib.h>
+
+#include <tinu/threads.h>
+#include <tinu/log.h>
+
+/* Test cases waiting to be run by a thread. The owner takes the test cases
+ * from the front, the other threads steal from the back. */
+typedef struct _ThreadDeque
+{
+  GMutex          m_lock;
+
+  guint          *m_items;
+  guint           m_front;
+  guint           m_back;
+} ThreadDeque;
+
+typedef struct _ThreadPool ThreadPool;
+
+typedef struct _ThreadWorker
+{
+  ThreadPool     *m_pool;
+  GThread        *m_thread;
+  gint            m_id;
+
+  ThreadDeque     m_deque;
+} ThreadWorker;
+
+struct _ThreadPool
+{
+  TestContext    *m_context;
+  GPtrArray      *m_tests;
+
+  ThreadWorker   *m_workers;
+  gint            m_count;
+
+  /* Finished test cases not yet passed to the callback */
+  GMutex          m_lock;
+  GCond           m_cond;
+  TestRecord    **m_records;
+  guint          *m_finished;
+  guint           m_finished_count;
+};
+
+static gboolean
+_threads_deque_pop(ThreadDeque *self, gboolean steal, guint *index)
+{
+  gboolean res = FALSE;
+
+  g_mutex_lock(&self->m_lock);
+  if (self->m_front < self->m_back)
+    {
+      *index = steal ? self->m_items[--self->m_back] : self->m_items[self->m_front++];
+      res = TRUE;
+    }
+  g_mutex_unlock(&self->m_lock);
+  return res;
+}
+
+static gboolean
+_threads_next(ThreadWorker *self, guint *index)
+{
+  ThreadPool *pool = self->m_pool;
+  gint i;
+
+  if (_threads_deque_pop(&self->m_deque, FALSE, index))
+    return TRUE;
+
+  for (i = 1; i < pool->m_count; i++)
+    {
+      if (_threads_deque_pop(&pool->m_workers[(self->m_id + i) % pool->m_count].m_deque, TRUE, index))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static gpointer
+_threads_worker_main(gpointer user_data)
+{
+  ThreadWorker *self = (ThreadWorker *)user_data;
+  ThreadPool *pool = self->m_pool;
+  TestRecord *record;
+  guint index;
+
+  while (_threads_next(self, &index))
+    {
+      record = test_case_run_recorded(pool->m_context,
+                                      (TestCase *)g_ptr_array_index(pool->m_tests, index));
+
+      g_mutex_lock(&pool->m_lock);
+      pool->m_records[index] = record;
+      pool->m_finished[pool->m_finished_count++] = index;
+      g_cond_signal(&pool->m_cond);
+      g_mutex_unlock(&pool->m_lock);
+    }
+  return NULL;
+}
+
+gboolean
+test_threads_run(TestContext *context, GPtrArray *tests, TestJobDoneCb done, gpointer user_data)
+{
+  ThreadPool pool;
+  ThreadWorker *worker;
+  GError *error = NULL;
+  guint reported = 0, index;
+  gint i, started;
+  gboolean res = TRUE;
+
+  if (tests->len == 0)
+    return TRUE;
+
+  pool.m_context = context;
+  pool.m_tests = tests;
+  pool.m_count = MIN((guint)context->m_threads, tests->len);
+  pool.m_workers = g_new0(ThreadWorker, pool.m_count);
+  pool.m_records = g_new0(TestRecord *, tests->len);
+  pool.m_finished = g_new0(guint, tests->len);
+  pool.m_finished_count = 0;
+  g_mutex_init(&pool.m_lock);
+  g_cond_init(&pool.m_cond);
+
+  /* Test cases are dealt round-robin, so the front of the list (reported
+   * first) is run first */
+  for (i = 0; i < pool.m_count; i++)
+    {
+      worker = &pool.m_workers[i];
+      worker->m_pool = &pool;
+      worker->m_id = i;
+      g_mutex_init(&worker->m_deque.m_lock);
+      worker->m_deque.m_items = g_new0(guint, tests->len / pool.m_count + 1);
+    }
+
+  for (index = 0; index < tests->len; index++)
+    {
+      worker = &pool.m_workers[index % pool.m_count];
+      worker->m_deque.m_items[worker->m_deque.m_back++] = index;
+    }
+
+  log_debug("Running test cases in threads",
+            msg_tag_int("threads", pool.m_count),
+            msg_tag_int("tests", tests->len), NULL);
+
+  for (started = 0; started < pool.m_count; started++)
+    {
+      worker = &pool.m_workers[started];
+      worker->m_thread = g_thread_try_new("tinu-worker", _threads_worker_main, worker, &error);
+      if (!worker->m_thread)
+        {
+          log_error("Cannot start worker thread",
+                    msg_tag_str("error", error->message), NULL);
+          g_clear_error(&error);
+          break;
+        }
+    }
+
+  if (started == 0)
+    {
+      res = FALSE;
+      goto exit;
+    }
+
+  /* The remaining test cases are stolen by the running threads */
+  g_mutex_lock(&pool.m_lock);
+  while (reported < tests->len)
+    {
+      while (reported == pool.m_finished_count)
+        g_cond_wait(&pool.m_cond, &pool.m_lock);
+
+      index = pool.m_finished[reported++];
+      g_mutex_unlock(&pool.m_lock);
+
+      done(index, pool.m_records[index], user_data);
+
+      g_mutex_lock(&pool.m_lock);
+    }
+  g_mutex_unlock(&pool.m_lock);
+
+  for (i = 0; i < started; i++)
+    g_thread_join(pool.m_workers[i].m_thread);
+
+exit:
+  for (i = 0; i < pool.m_count; i++)
+    {
+      g_mutex_clear(&pool.m_workers[i].m_deque.m_lock);
+      g_free(pool.m_workers[i].m_deque.m_items);
+    }
+
+  g_cond_clear(&pool.m_cond);
+  g_mutex_clear(&pool.m_lock);
+  g_free(pool.m_finished);
+  g_free(pool.m_records);
+  g_free(pool.m_workers);
+  return res;
+}
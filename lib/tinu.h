@@ -4,6 +4,8 @@
 #include <tinu/config.h>
 #include <tinu/main.h>
 #include <tinu/meta.h>
+#include <tinu/benchmark.h>
+#include <tinu/baseline.h>
 #include <tinu/leakwatch.h>
 #include <tinu/utils.h>
 
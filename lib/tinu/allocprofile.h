@@ -0,0 +1,109 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/** @file allocprofile.h
+ * @brief Allocation profiler
+ *
+ * Aggregates the allocations made while the profiler runs by their
+ * (interned) call stack, so the hot allocation paths of a test case can
+ * be found. The profiler is a leak watch callback, it sees every
+ * allocation of the process.
+ *
+ * Lifetimes are measured on an allocation clock: the lifetime of a block
+ * is the number of allocations made between its allocation and its
+ * release. When the leak watcher samples, only the sampled allocations
+ * are profiled and the figures are estimates.
+ */
+#ifndef _TINU_ALLOCPROFILE_H
+#define _TINU_ALLOCPROFILE_H
+
+#include <glib.h>
+
+#include <tinu/backtrace.h>
+
+__BEGIN_DECLS
+
+/** Number of sites dumped after a test case */
+#define ALLOC_PROFILE_DUMP_SITES 10
+
+/** @brief Allocations of a call site */
+typedef struct _AllocSite
+{
+  /** Stack of the allocating call */
+  BacktraceId       m_trace;
+
+  /** Number of allocations */
+  guint64           m_allocs;
+  /** Bytes requested by the allocations and by the reallocations of the
+   * allocated blocks */
+  guint64           m_bytes;
+  /** Number of reallocations of the blocks and the bytes they requested */
+  guint64           m_reallocs;
+  guint64           m_realloc_bytes;
+  /** Number of blocks released while profiling */
+  guint64           m_frees;
+  /** Mean lifetime of the released blocks (in allocations) */
+  gdouble           m_lifetime;
+  /** Blocks still allocated and their size */
+  guint64           m_live_blocks;
+  guint64           m_live_bytes;
+} AllocSite;
+
+typedef struct _AllocProfile AllocProfile;
+
+/** @brief Start profiling the allocations of the process
+ * @return The profiler
+ */
+AllocProfile *alloc_profile_start(void);
+
+/** @brief Stop and free the profiler
+ * @param self Profiler started with alloc_profile_start
+ * @return Array of AllocSite's sorted by bytes requested (descending),
+ * free with g_array_free
+ */
+GArray *alloc_profile_stop(AllocProfile *self);
+
+/** @brief Get the sites profiled so far
+ * @param self Running profiler
+ * @return Array of AllocSite's sorted by bytes requested (descending),
+ * free with g_array_free
+ */
+GArray *alloc_profile_snapshot(AllocProfile *self);
+
+/** @brief Log the top sites with their stacks
+ * @param sites Sites returned by alloc_profile_stop
+ * @param limit Number of sites to log (0 logs all of them)
+ * @param priority Log priority
+ */
+void alloc_profile_dump(GArray *sites, guint limit, gint priority);
+
+__END_DECLS
+
+#endif
@@ -35,6 +35,7 @@
 #include <stdio.h>
 
 #include <tinu/log.h>
+#include <tinu/names.h>
 #include <tinu/config.h>
 
 __BEGIN_DECLS
@@ -55,11 +56,53 @@ typedef void (*DumpCallback)(const BacktraceEntry *entry, gpointer ud);
 
 typedef struct _Backtrace Backtrace;
 
+/* Stack walkers. The frame pointer unwinder needs code built with
+ * -fno-omit-frame-pointer, the .eh_frame one reads the unwind tables the
+ * compilers emit by default. Both are available on x86-64 Linux only;
+ * backtrace() of the C library is the default. The frame pointer
+ * unwinder is async-signal-safe. The .eh_frame one is only with a C
+ * library providing _dl_find_object() (glibc 2.35), otherwise it finds
+ * the tables with dladdr(), which takes the loader lock. */
+typedef enum
+{
+  BACKTRACE_UNWINDER_LIBC = 0,
+  BACKTRACE_UNWINDER_FRAME_POINTER,
+  BACKTRACE_UNWINDER_EH_FRAME
+} BacktraceUnwinder;
+
+extern const NameTable BacktraceUnwinder_names[];
+
+gboolean backtrace_set_unwinder(BacktraceUnwinder unwinder);
+BacktraceUnwinder backtrace_get_unwinder(void);
+
+/* Keep the symbol and line index of the modules in 'dir', keyed by their
+ * build id, so later runs map them instead of parsing the debug
+ * information. Set before the first backtrace is resolved. */
+void backtrace_set_symbol_cache(const gchar *dir);
+
+/* Store at most 'depth' return addresses into 'buffer', the first one
+ * being in the caller after skipping 'skip' frames. Returns the number
+ * of addresses stored. */
+gint backtrace_unwind(gpointer *buffer, guint32 depth, guint32 skip);
+
 Backtrace *backtrace_create(guint32 skip);
 Backtrace *backtrace_create_depth(guint32 depth, guint32 skip);
 Backtrace *backtrace_reference(Backtrace *self);
 void backtrace_unreference(Backtrace *self);
 
+/* Interned backtraces: identical stacks are stored once and referred to
+ * by a 32 bit id, so comparing two stacks is an integer compare. The
+ * stored backtraces are immutable and live until the process exits
+ * (referencing them is a no-op). */
+typedef guint32 BacktraceId;
+
+#define BACKTRACE_ID_NONE                0
+
+BacktraceId backtrace_intern(const Backtrace *trace);
+BacktraceId backtrace_intern_current(guint32 depth, guint32 skip);
+const Backtrace *backtrace_lookup(BacktraceId id);
+guint32 backtrace_intern_count(void);
+
 guint32 backtrace_depth(const Backtrace *self);
 
 void backtrace_dump_log(const Backtrace *self, const gchar *msg_prefix, gint priority);
@@ -0,0 +1,81 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/** @file baseline.h
+ * @brief Benchmark baselines
+ *
+ * A baseline is the saved benchmark results of a previous run. It uses the
+ * same key=value format as the file reporting module:
+ *
+ *    baseline.version=1
+ *    suite.<suite>.test.<test>.benchmark.mean=12.345
+ *    ...
+ *
+ * so it can be loaded with reporting/tinu.py too. Comparing a run against
+ * a baseline reports the benchmarks that became significantly slower.
+ */
+#ifndef _TINU_BASELINE_H
+#define _TINU_BASELINE_H
+
+#include <glib.h>
+
+#include <tinu/statistics.h>
+
+__BEGIN_DECLS
+
+/** Version of the baseline file format */
+#define BASELINE_VERSION 1
+
+/** Default noise threshold (relative slowdown that is never reported) */
+#define BASELINE_DEFAULT_THRESHOLD 0.05
+
+/** @brief Save the benchmark results as a baseline
+ * @param stat Statistics of the run
+ * @param file_name Baseline file (overwritten)
+ * @return TRUE on success
+ */
+gboolean baseline_save(TestStatistics *stat, const gchar *file_name);
+
+/** @brief Compare the benchmark results against a baseline
+ * @param stat Statistics of the run
+ * @param file_name Baseline file
+ * @param threshold Noise threshold as a ratio (0.05 means 5%)
+ * @return Number of regressions found or -1 if the baseline could not be
+ * loaded.
+ *
+ * A benchmark regressed if its mean is slower than the baseline by more than
+ * the threshold and the difference is significant (one-sided Welch t-test,
+ * p < 0.01). Benchmarks missing from either side are skipped.
+ */
+gint baseline_compare(TestStatistics *stat, const gchar *file_name, gdouble threshold);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,154 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/** @file benchmark.h
+ * @brief Microbenchmarks
+ *
+ * Benchmarks are test cases that measure how long their body takes to run.
+ * The body is called with a number of iterations to run, which is
+ * calibrated automatically so that each sample takes about the configured
+ * sample time. After a warm-up phase (which lasts until consecutive
+ * samples are stable) a fixed number of samples is taken and their
+ * statistics are sent to the TEST_HOOK_BENCHMARK hooks (and through the
+ * statistics to the reporting modules).
+ *
+ * Usage:
+ *    static void
+ *    bench_lookup(TestCase *test_case, Benchmark *bench, gpointer context)
+ *    {
+ *      guint64 i;
+ *
+ *      for (i = 0; i < tinu_benchmark_iterations(bench); i++)
+ *        g_hash_table_lookup((GHashTable *)context, "key");
+ *    }
+ */
+#ifndef _TINU_BENCHMARK_H
+#define _TINU_BENCHMARK_H
+
+#include <glib.h>
+
+#include <tinu/test.h>
+
+__BEGIN_DECLS
+
+typedef struct _Benchmark Benchmark;
+
+/** @brief Benchmark function
+ * The body of the benchmark. It has to run the measured code
+ * tinu_benchmark_iterations() times.
+ */
+typedef void (*BenchmarkFunction)(TestCase *, Benchmark *, gpointer);
+
+/** @brief Result of a benchmark
+ *
+ * Times are in nanoseconds per iteration.
+ *
+ * @note Public because the TEST_HOOK_BENCHMARK hook uses it as a parameter.
+ */
+typedef struct _BenchmarkResult
+{
+  /** Number of samples taken */
+  guint32           m_samples;
+  /** Number of iterations in each sample */
+  guint64           m_iterations;
+
+  /** Mean time of an iteration */
+  gdouble           m_mean;
+  /** Median time of an iteration */
+  gdouble           m_median;
+  /** Standard deviation of the iteration time */
+  gdouble           m_stddev;
+  /** 99th percentile of the iteration time */
+  gdouble           m_p99;
+  /** Fastest sample */
+  gdouble           m_min;
+  /** Slowest sample */
+  gdouble           m_max;
+
+  /** Number of allocations per iteration (negative if not measured) */
+  gdouble           m_allocs;
+  /** Bytes allocated per iteration (negative if not measured) */
+  gdouble           m_alloc_bytes;
+} BenchmarkResult;
+
+/** @brief Get the number of iterations to run
+ * @param self Benchmark
+ */
+guint64 tinu_benchmark_iterations(Benchmark *self);
+/** @brief Get the user data given to benchmark_add
+ * @param self Benchmark
+ */
+gpointer tinu_benchmark_user_data(Benchmark *self);
+
+/** @brief Stop the timer
+ * @param self Benchmark
+ *
+ * Code run while the timer is stopped (e.g. per-iteration setup) is not
+ * measured and its allocations are not counted.
+ */
+void tinu_benchmark_pause(Benchmark *self);
+/** @brief Restart the timer
+ * @param self Benchmark
+ * @see tinu_benchmark_pause
+ */
+void tinu_benchmark_resume(Benchmark *self);
+
+/** @brief Set the benchmark parameters
+ * @param samples Number of samples to take (0 keeps the current value)
+ * @param sample_time Target duration of a sample in nanoseconds (0 keeps the
+ * current value)
+ */
+void benchmark_configure(guint32 samples, guint64 sample_time);
+
+/** @brief Add a benchmark to a test context
+ * @param self Test context
+ * @param suite_name Suite the benchmark belongs to
+ * @param bench_name Name of the benchmark
+ * @param setup Setup function (NULL if none), called once before the samples
+ * @param cleanup Cleanup function (NULL if none), called once after the samples
+ * @param func Benchmark body
+ * @param user_data User data, see tinu_benchmark_user_data
+ * @param user_data_cleanup Called to free user data
+ *
+ * The benchmark is added as a test case, so it is run, selected and reported
+ * the same way. The m_user_data member of the TestCase is used internally.
+ */
+void benchmark_add(TestContext *self,
+                   const gchar *suite_name,
+                   const gchar *bench_name,
+                   TestSetup setup,
+                   TestCleanup cleanup,
+                   BenchmarkFunction func,
+                   gpointer user_data,
+                   CleanupFunction user_data_cleanup);
+
+__END_DECLS
+
+#endif
@@ -69,7 +69,7 @@ public:
   };
 
 public:
-  CxxBacktrace(guint32 skip = 0, guint32 depth = 0);
+  CxxBacktrace(guint32 skip = 0, guint32 depth = MAX_DEPTH);
   CxxBacktrace(const CxxBacktrace &other);
   CxxBacktrace(Backtrace *trace);
   ~CxxBacktrace();
@@ -125,7 +125,7 @@ class CxxLeakwatch
 {
   friend void cxx_leakwatch_callback(LeakwatchOperation operation,
                                      gpointer oldptr, gpointer ptr, gsize size,
-                                     Backtrace *trace,
+                                     BacktraceId trace,
                                      gpointer user_data);
 
 public:
@@ -137,6 +137,19 @@ protected:
   virtual void notify_realloc(gpointer source, gpointer result, gsize size, const CxxBacktrace &trace) = 0;
   virtual void notify_free(gpointer pointer, const CxxBacktrace &trace) = 0;
 
+  /* Mappings and C++ allocations are reported as the malloc family
+   * operation they behave like unless these are overridden */
+  virtual void notify_map(gpointer result, gsize size, const CxxBacktrace &trace)
+  { notify_alloc(result, size, trace); }
+  virtual void notify_remap(gpointer source, gpointer result, gsize size, const CxxBacktrace &trace)
+  { notify_realloc(source, result, size, trace); }
+  virtual void notify_unmap(gpointer pointer, gsize size, const CxxBacktrace &trace)
+  { notify_free(pointer, trace); }
+  virtual void notify_new(gpointer result, gsize size, const CxxBacktrace &trace)
+  { notify_alloc(result, size, trace); }
+  virtual void notify_delete(gpointer pointer, const CxxBacktrace &trace)
+  { notify_free(pointer, trace); }
+
 private:
   gpointer m_handle;
 };
@@ -34,33 +34,133 @@
 #include <glib.h>
 
 #include <features.h>
+#include <pthread.h>
 
 __BEGIN_DECLS
 
+/* A row of the line table. Rows ending a sequence of instructions have
+ * no source (they only mark where the previous row ends). */
 typedef struct _DwarfEntry
 {
-  GQuark        m_source;
   gpointer      m_pointer;
+  GQuark        m_source;
   gint          m_lineno;
 } DwarfEntry;
 
+/* Number of compilation units whose line table is kept decoded, the
+ * least recently used ones are dropped beyond it */
+#define DWARF_MAX_DECODED_UNITS          64
+
+#define DWARF_UNIT_NONE                  G_MAXUINT32
+
+typedef enum
+{
+  DWARF_UNIT_PENDING = 0,
+  DWARF_UNIT_DECODED,
+  /* Decoded when loading (its range is only known from the lines), it
+   * is never dropped */
+  DWARF_UNIT_RESIDENT,
+  DWARF_UNIT_FAILED
+} DwarfUnitState;
+
+/* A compilation unit, its line table is decoded on the first lookup */
 typedef struct _DwarfCompUnit
 {
-  GSList       *m_entries;
+  guint64       m_offset;
+  DwarfUnitState m_state;
+
+  /* Sorted by address */
+  DwarfEntry   *m_entries;
+  guint32       m_count;
+
+  /* Decoded units, most recently used first */
+  guint32       m_lru_prev;
+  guint32       m_lru_next;
+} DwarfCompUnit;
+
+typedef struct _DwarfRange
+{
   gpointer      m_lowpc;
   gpointer      m_highpc;
-} DwarfCompUnit;
+  guint32       m_unit;
+} DwarfRange;
+
+/*
+ * Compact index of a module, the layout of the symbolization cache files.
+ * Addresses are the link-time ones, names are offsets into the string
+ * table.
+ */
+typedef struct _DwarfLine
+{
+  guint64       m_address;
+
+  /* Index into the file table, 0 at the end of a sequence */
+  guint32       m_file;
+  guint32       m_lineno;
+} DwarfLine;
+
+typedef struct _DwarfSymbol
+{
+  guint64       m_address;
+  guint64       m_size;
+  guint32       m_name;
+  guint32       m_reserved;
+} DwarfSymbol;
 
 typedef struct _DwarfHandle
 {
   gchar        *m_filename;
-  GSList       *m_entries;
+  gint          m_fd;
+  gpointer      m_debug;
+
+  /* Function symbols, sorted by address, read by the first symbol
+   * lookup (or the indexing) */
+  volatile gint m_symbols_read;
+  DwarfSymbol  *m_symbols;
+  guint32       m_symbol_count;
+  gchar        *m_strings;
+  gsize         m_strings_size;
+
+  /* The whole line table when the module is indexed (and the units are
+   * not used), sorted by address */
+  DwarfLine    *m_lines;
+  guint32       m_line_count;
+  guint32      *m_files;
+  guint32       m_file_count;
+
+  /* The cache file the index is mapped from */
+  gpointer      m_map;
+  gsize         m_map_size;
+
+  /* Lookups decode units and reorder the LRU list */
+  pthread_mutex_t m_lock;
+
+  DwarfCompUnit *m_units;
+  guint32       m_unit_count;
+
+  /* The address ranges of the units, sorted by the start address */
+  DwarfRange   *m_ranges;
+  guint32       m_range_count;
+
+  guint32       m_lru_head;
+  guint32       m_lru_tail;
+  guint32       m_decoded;
 } DwarfHandle;
 
 DwarfHandle *dw_new(const gchar *name);
 void dw_destroy(DwarfHandle *self);
 
-const DwarfEntry *dw_lookup(DwarfHandle *self, gpointer ptr, guint32 tolerance);
+/* Map the index of the module from 'cache_dir' if it was cached with the
+ * same build id, otherwise index the whole module and store it there for
+ * the next run */
+DwarfHandle *dw_new_cached(const gchar *name, const gchar *build_id, const gchar *cache_dir);
+
+gboolean dw_lookup_symbol(DwarfHandle *self, gpointer ptr, const gchar **name, gsize *offset);
+
+/* The rows found are copied, as their unit may be dropped any time. The
+ * results of dw_lookup_batch() not found have no source. */
+gboolean dw_lookup(DwarfHandle *self, gpointer ptr, DwarfEntry *result);
+void dw_lookup_batch(DwarfHandle *self, const gpointer *ptrs, DwarfEntry *results, gsize count);
 
 __END_DECLS
 
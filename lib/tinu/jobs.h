@@ -0,0 +1,80 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/** @file jobs.h
+ * @brief Parallel test execution
+ *
+ * Test cases can be run in a pool of worker processes. Each worker runs one
+ * test case at a time and sends the record of the run (see record.h) back to
+ * the main process, which hands out the next test case to the worker.
+ */
+#ifndef _TINU_JOBS_H
+#define _TINU_JOBS_H
+
+#include <glib.h>
+
+#include <tinu/test.h>
+#include <tinu/record.h>
+
+__BEGIN_DECLS
+
+/** @brief Job completion callback
+ * @param index Index of the test case in the list passed to test_jobs_run
+ * @param record Record of the test case run (owned by the callback)
+ * @param user_data User data given to test_jobs_run
+ *
+ * Called in the main process in the order the test cases finish.
+ */
+typedef void (*TestJobDoneCb)(guint index, TestRecord *record, gpointer user_data);
+
+/** @brief Get the number of jobs the tests can use
+ * @return Number of usable CPUs (at least one)
+ *
+ * The CPU affinity mask of the process and the CPU quota of its cgroup
+ * (both v1 and v2) are taken into account.
+ */
+gint test_jobs_auto(void);
+
+/** @brief Run test cases in worker processes
+ * @param context Test context (m_jobs is the maximal number of workers)
+ * @param tests List of TestCase pointers to run
+ * @param done Called with the record of each finished test case
+ * @param user_data User data passed to done
+ * @return FALSE if the worker pool could not be created
+ *
+ * Test cases are handed out dynamically: a worker gets the next test case
+ * as soon as it finished the previous one. If a worker dies while running
+ * a test case, the test case fails and a new worker is started.
+ */
+gboolean test_jobs_run(TestContext *context, GPtrArray *tests, TestJobDoneCb done, gpointer user_data);
+
+__END_DECLS
+
+#endif
@@ -41,32 +41,181 @@ typedef enum
 {
   LEAKWATCH_OPERATION_MALLOC,
   LEAKWATCH_OPERATION_REALLOC,
-  LEAKWATCH_OPERATION_FREE
+  LEAKWATCH_OPERATION_FREE,
+
+  /* Anonymous memory mappings. Only unmapping a mapping from its start
+   * address is recognized (it releases the whole mapping). */
+  LEAKWATCH_OPERATION_MMAP,
+  LEAKWATCH_OPERATION_MREMAP,
+  LEAKWATCH_OPERATION_MUNMAP,
+
+  /* Allocations of the C++ operators replaced by libtinucxx */
+  LEAKWATCH_OPERATION_NEW,
+  LEAKWATCH_OPERATION_DELETE
 } LeakwatchOperation;
 
+/* The malloc family operation an operation behaves like (MALLOC, REALLOC
+ * or FREE) */
+static inline LeakwatchOperation
+tinu_leakwatch_operation_kind(LeakwatchOperation operation)
+{
+  switch (operation)
+    {
+      case LEAKWATCH_OPERATION_MMAP :
+      case LEAKWATCH_OPERATION_NEW :
+        return LEAKWATCH_OPERATION_MALLOC;
+
+      case LEAKWATCH_OPERATION_MREMAP :
+        return LEAKWATCH_OPERATION_REALLOC;
+
+      case LEAKWATCH_OPERATION_MUNMAP :
+      case LEAKWATCH_OPERATION_DELETE :
+        return LEAKWATCH_OPERATION_FREE;
+
+      default :
+        return operation;
+    }
+}
+
 typedef void (*AllocCallback)(LeakwatchOperation operation,
                               gpointer oldptr, gpointer ptr, gsize size,
-                              Backtrace *trace,
+                              BacktraceId trace,
                               gpointer user_data);
 
+/* Allocation events are buffered per thread and delivered to the callbacks
+ * in batches, possibly from another thread (but never concurrently for the
+ * same watch). Unregistering a watch delivers all the pending events. */
 gpointer tinu_register_watch(AllocCallback callback, gpointer user_data);
 gboolean tinu_unregister_watch(gpointer handle);
 
+/* Set how allocations are recorded (call before registering watches).
+ * With a sample interval only a Poisson sample of the allocations (one per
+ * 'sample_interval' allocated bytes on average) is tracked by the simple
+ * watches and backtraced; callbacks still see every event, but only the
+ * sampled ones carry a backtrace. 'depth' bounds the recorded frames. */
+void tinu_leakwatch_configure(gsize sample_interval, guint32 depth);
+
+/* Estimated number of bytes represented by a tracked allocation (the size
+ * itself unless sampling) */
+gsize tinu_leakwatch_scale(gsize size);
+
+/* Deliver the pending allocation events of all threads */
+void tinu_leakwatch_flush(void);
+
+/* Stop reporting the allocations of the calling thread (nestable) */
+void tinu_leakwatch_suspend(void);
+void tinu_leakwatch_resume(void);
+
+/* Allocator of the C++ operators: libtinucxx replaces operator new and
+ * delete with these, so the C++ allocations are reported (as NEW and
+ * DELETE) whatever allocator the runtime would use. 'alignment' is 0 for
+ * the default alignment. */
+gpointer tinu_leakwatch_new(gsize size, gsize alignment);
+void tinu_leakwatch_delete(gpointer ptr);
+
 typedef struct _MemoryEntry
 {
   gpointer      m_ptr;
   gsize         m_size;
 
-  Backtrace    *m_origin;
-  Backtrace    *m_last;
+  BacktraceId   m_origin;
+  BacktraceId   m_last;
 } MemoryEntry;
 
 /* The hash table has gpointers as keys and 'struct _MemoryEntry's as values */
 gpointer tinu_leakwatch_simple(GHashTable **result);
 void tinu_leakwatch_simple_dump(GHashTable *result, gint loglevel);
 
+/* Number of allocation sites reported by default */
+#define LEAKWATCH_REPORT_SITES 20
+
+/* Log the leaks grouped by their allocating stacks (each stack is
+ * symbolized once), the sites leaking the most bytes first. Only the top
+ * 'limit' sites are shown (0 shows all of them). */
+void tinu_leakwatch_simple_report(GHashTable *result, gint loglevel, guint limit);
+
+/* Size classes of the allocation histogram: class i counts the allocations
+ * of [2^i, 2^(i+1)) bytes (class 0 includes empty ones, the last class
+ * everything larger) */
+#define LEAKWATCH_SIZE_CLASSES 32
+
+typedef struct _LeakwatchProfile
+{
+  guint64       m_allocs;
+  guint64       m_alloc_bytes;
+  /* Peak of the bytes held by the allocations made under the watch */
+  guint64       m_peak_bytes;
+  guint64       m_histogram[LEAKWATCH_SIZE_CLASSES];
+} LeakwatchProfile;
+
+/* Heap profile of a simple watch, estimated when sampling (must be called
+ * before the watch is unregistered) */
+gboolean tinu_leakwatch_simple_profile(gpointer handle, LeakwatchProfile *profile);
+
+typedef struct _LeakwatchTableStats
+{
+  /* Tracked allocations */
+  gsize         m_live;
+  /* Freed pointers kept until every older event is applied */
+  gsize         m_freed;
+  gsize         m_slots;
+  /* Bytes mapped for the slots and the entries */
+  gsize         m_mapped;
+
+  guint64       m_lookups;
+  /* Slots visited by the lookups */
+  guint64       m_probes;
+  guint32       m_max_probe;
+} LeakwatchTableStats;
+
+/* Occupancy and probe statistics of the pointer table of a simple watch
+ * (must be called before the watch is unregistered) */
+gboolean tinu_leakwatch_simple_stats(gpointer handle, LeakwatchTableStats *stats);
+
 gsize tinu_leakwatch_summary(GHashTable *result);
 
+typedef struct _LeakwatchCounters
+{
+  /* Net number of blocks and of their usable bytes allocated */
+  gint64        m_blocks;
+  gint64        m_bytes;
+} LeakwatchCounters;
+
+/* Net allocation counters: a cheap screening for leaks, the allocations of
+ * the whole process are counted with atomic adds only (no backtraces, no
+ * pointer table). Freeing blocks allocated before the start hides the
+ * same number of leaks. */
+void tinu_leakwatch_counters_start(LeakwatchCounters *start);
+void tinu_leakwatch_counters_stop(const LeakwatchCounters *start, LeakwatchCounters *delta);
+
+/* Number of stacks kept of the allocations over a budget */
+#define LEAKWATCH_BUDGET_TRACES 8
+
+typedef struct _LeakwatchBudget
+{
+  guint64       m_max_allocs;
+
+  /* Allocations (and reallocations) made and the bytes requested */
+  guint64       m_allocs;
+  guint64       m_bytes;
+
+  /* Stacks of the first allocations over the budget */
+  BacktraceId   m_traces[LEAKWATCH_BUDGET_TRACES];
+  guint32       m_trace_count;
+
+  struct _LeakwatchBudget *m_outer;
+} LeakwatchBudget;
+
+/* Count the allocations of the calling thread between start and stop,
+ * using no pointer table (see TINU_ASSERT_MAX_ALLOCS in test.h). Budgets
+ * can be nested, the budget must stay in place until it is stopped. */
+void tinu_leakwatch_budget_start(LeakwatchBudget *budget, guint64 max_allocs);
+void tinu_leakwatch_budget_stop(LeakwatchBudget *budget);
+
+/* Drop the budgets of the calling thread that were never stopped (the
+ * code running them crashed and its stack is gone) */
+void tinu_leakwatch_budget_reset(void);
+
 __END_DECLS
 
 #endif
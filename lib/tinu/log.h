@@ -145,6 +145,17 @@ void log_clear();
  */
 void log_divert(MessageHandler handler, gpointer user_data);
 
+/** @brief Capture the messages of the current thread
+ * @param handler Message handler (NULL to stop capturing)
+ * @param user_data User data passed to handler
+ *
+ * While capturing, every message of the calling thread that would be dispatched
+ * is passed only to the given handler instead of the registered ones. The message
+ * is destroyed after the handler returns, so it has to be copied if needed. This
+ * is used to record the messages of a test case running in a worker.
+ */
+void log_capture(MessageHandler handler, gpointer user_data);
+
 /** @brief Call message above given priority
  * @internal
  */
@@ -40,6 +40,7 @@
 #include <glib.h>
 
 #include <tinu/test.h>
+#include <tinu/benchmark.h>
 #include <tinu/statistics.h>
 #include <tinu/reporting.h>
 
@@ -94,6 +95,27 @@ void tinu_test_add_extended(const gchar *suite_name,
                             gpointer user_data,
                             CleanupFunction user_data_cleanup);
 
+/** @brief Add a benchmark to the framework
+ * @param suite_name Suite the benchmark belongs to
+ * @param bench_name Name of the benchmark
+ * @param setup Setup function (NULL if none)
+ * @param cleanup Cleanup function (NULL if none)
+ * @param func Benchmark body
+ * @param user_data User data, see tinu_benchmark_user_data
+ * @param user_data_cleanup Called to free user data
+ * @see benchmark_add
+ *
+ * Similar to benchmark_add but there is no test context required. It adds
+ * the benchmark to the main test context.
+ */
+void tinu_benchmark_add(const gchar *suite_name,
+                        const gchar *bench_name,
+                        TestSetup setup,
+                        TestCleanup cleanup,
+                        BenchmarkFunction func,
+                        gpointer user_data,
+                        CleanupFunction user_data_cleanup);
+
 /** @brief Add a reporting facility to the framework
  * @param module Report module descriptor
  *
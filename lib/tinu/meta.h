@@ -39,6 +39,7 @@
 #define _TINU_META_H
 
 #include <tinu/test.h>
+#include <tinu/benchmark.h>
 
 __BEGIN_DECLS
 
@@ -60,6 +61,8 @@ typedef struct _TinuMetaInfo
   TestCleanup   m_cleanup;
   /** Test case function. */
   TestFunction  m_case;
+  /** Benchmark function (if set, m_case is ignored). */
+  BenchmarkFunction m_benchmark;
 } TinuMetaInfo;
 
 /** @brief Create a test case function.
@@ -136,6 +139,33 @@ typedef struct _TinuMetaInfo
 #define TEST_CLEANUP(suite, testcase) \
   void test_cleanup_ ## suite ## _ ## testcase (TestCase *test_case, gpointer context)
 
+/** @brief Create a benchmark function.
+ * @param suite Name of the test suite
+ * @param benchmark Name of the benchmark
+ *
+ * The benchmark counterpart of TEST_FUNCTION. TEST_SETUP and TEST_CLEANUP
+ * can be used with the same names; they are called once around all the
+ * samples of the benchmark.
+ *
+ * The created function has three arguments:
+ *  * test_case - pointer to the current TestCase.
+ *  * bench - the Benchmark to get the iteration count from.
+ *  * context - the result of the setup function, or NULL.
+ *
+ * Usage:
+ *    TINU_BENCHMARK(suiteName, benchName)
+ *    {
+ *      guint64 i;
+ *
+ *      for (i = 0; i < tinu_benchmark_iterations(bench); i++)
+ *        // Measured code
+ *    }
+ *
+ * @see BenchmarkFunction
+ */
+#define TINU_BENCHMARK(suite, benchmark) \
+  void benchmark_function_ ## suite ## _ ## benchmark (TestCase *test_case, Benchmark *bench, gpointer context)
+
 /** @brief Add the tests described in the metainfo to the test list.
  * @param metainfo Metainfo array. Must be terminated by an item where the
  * suite and name are NULL.
@@ -0,0 +1,117 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/** @file perf.h
+ * @brief Performance counters
+ *
+ * Counts hardware and software events (cycles, cache misses, page faults,
+ * etc.) of the thread running a test case using the perf_event_open(2)
+ * interface of Linux. The counters of a test case are opened as a single
+ * group, so they are scheduled on the PMU together.
+ *
+ * If hardware counters are not accessible (e.g. because of the
+ * perf_event_paranoid setting or inside virtual machines) the hardware
+ * events are skipped and cycles is replaced by the task-clock software
+ * event.
+ */
+#ifndef _TINU_PERF_H
+#define _TINU_PERF_H
+
+#include <glib.h>
+
+#include <tinu/names.h>
+
+__BEGIN_DECLS
+
+typedef enum
+{
+  /** CPU cycles (hardware) */
+  PERF_COUNTER_CYCLES = 0,
+  /** Retired instructions (hardware) */
+  PERF_COUNTER_INSTRUCTIONS,
+  /** Last level cache misses (hardware) */
+  PERF_COUNTER_CACHE_MISSES,
+  /** Mispredicted branches (hardware) */
+  PERF_COUNTER_BRANCH_MISSES,
+  /** Page faults (software) */
+  PERF_COUNTER_PAGE_FAULTS,
+  /** Context switches (software) */
+  PERF_COUNTER_CONTEXT_SWITCHES,
+  /** Time the task was running in nanoseconds (software) */
+  PERF_COUNTER_TASK_CLOCK,
+
+  /** The last counter */
+  PERF_COUNTER_MAX,
+} PerfCounterID;
+
+/** Get the bit of the given counter in counter masks */
+#define PERF_COUNTER_BIT(id) (1U << (id))
+
+/** @brief Counter values of a test case
+ *
+ * @note Public because the TEST_HOOK_PERF_COUNTERS hook uses it as a
+ * parameter.
+ */
+typedef struct _PerfCounterValues
+{
+  /** Mask of the counters that could be measured (see PERF_COUNTER_BIT) */
+  guint32           m_valid;
+  /** Counter values indexed by PerfCounterID (scaled if the counters were
+   * multiplexed) */
+  guint64           m_values[PERF_COUNTER_MAX];
+} PerfCounterValues;
+
+typedef struct _PerfCounters PerfCounters;
+
+/** @brief Parse a comma separated list of counter names
+ * @param list Counter names (e.g. "cycles,page-faults")
+ * @param mask Counter mask result
+ * @return FALSE if a counter name is unknown
+ */
+gboolean perf_counters_parse(const gchar *list, guint32 *mask);
+
+/** @brief Open and start the counters for the calling thread
+ * @param mask Counters to open
+ * @return The opened counter group or NULL if none of the counters is
+ * available
+ */
+PerfCounters *perf_counters_start(guint32 mask);
+
+/** @brief Stop the counters and free the group
+ * @param self Counters started with perf_counters_start
+ * @param values Counter values result
+ */
+void perf_counters_stop(PerfCounters *self, PerfCounterValues *values);
+
+extern const NameTable PerfCounterID_names[];
+
+__END_DECLS
+
+#endif
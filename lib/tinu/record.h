@@ -0,0 +1,156 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/** @file record.h
+ * @brief Recorded test case execution
+ *
+ * A test record contains everything a test case emitted while it was running
+ * (hook invocations and log messages). Records are used to run test cases
+ * outside of the main flow (e.g. in a worker process) and replay the results
+ * later, so hooks and message handlers see the same events as in a serial run.
+ */
+#ifndef _TINU_RECORD_H
+#define _TINU_RECORD_H
+
+#include <glib.h>
+
+#include <tinu/test.h>
+#include <tinu/message.h>
+
+__BEGIN_DECLS
+
+/** Pseudo hook ID used for recorded log messages */
+#define TEST_RECORD_MESSAGE TEST_HOOK_MAX
+
+/** @brief Recorded event
+ *
+ * A single hook invocation or log message.
+ *
+ * @note Do not use directly. It may change at any time.
+ */
+typedef struct _TestRecordEvent
+{
+  /** Hook ID of the event (TEST_RECORD_MESSAGE for messages) */
+  TestHookID      m_hook_id;
+
+  /** Integer arguments of the hook */
+  gint64          m_int[3];
+  /** String arguments of the hook */
+  gchar          *m_str[2];
+  /** Structure argument of the hook (copied) */
+  gpointer        m_data;
+  /** Size of m_data */
+  guint32         m_data_size;
+
+  /** Recorded message (only for TEST_RECORD_MESSAGE) */
+  Message        *m_message;
+} TestRecordEvent;
+
+/** @brief Test record
+ *
+ * Contains the events of a single test case run.
+ *
+ * @note Do not use directly. It may change at any time.
+ */
+typedef struct _TestRecord
+{
+  /** The recorded test case */
+  TestCase       *m_test;
+  /** Result of the test case (as reported by TEST_HOOK_AFTER_TEST) */
+  TestCaseResult  m_result;
+
+  /** List of events (TestRecordEvent) */
+  GArray         *m_events;
+} TestRecord;
+
+/** @brief Create a new, empty test record
+ * @param test The test case recorded
+ */
+TestRecord *test_record_new(TestCase *test);
+/** @brief Free a test record
+ * @param self Test record
+ */
+void test_record_free(TestRecord *self);
+
+/** @brief Record a hook invocation
+ * @param self Test record
+ * @param hook_id Hook ID
+ * @param vl Hook arguments (as passed to TestHookCb)
+ */
+void test_record_vhook(TestRecord *self, TestHookID hook_id, va_list vl);
+/** @brief Record a hook invocation
+ * @see test_record_vhook
+ */
+void test_record_hook(TestRecord *self, TestHookID hook_id, ...);
+/** @brief Record a log message
+ * @param self Test record
+ * @param msg Message to store (copied)
+ */
+void test_record_message(TestRecord *self, const Message *msg);
+
+/** @brief Run a test case and record its events
+ * @param self Test context
+ * @param test Test case to run
+ * @return The record of the run
+ *
+ * The test case is run the same way as by tinu_test_case_run, but hooks are
+ * not called and messages are not dispatched: all of them are stored in the
+ * returned record instead. Suite hooks are not emitted.
+ */
+TestRecord *test_case_run_recorded(TestContext *self, TestCase *test);
+
+/** @brief Replay the events of a record
+ * @param self Test record
+ * @param context Test context whose hooks are called
+ *
+ * Hooks are called through test_run_hooks and messages are emitted with
+ * log_message in the original order.
+ */
+void test_record_replay(TestRecord *self, TestContext *context);
+
+/** @brief Serialize a record
+ * @param self Test record
+ * @param output Serialized data is appended to this string
+ *
+ * The serialized form is only meaningful for the same binary (e.g. between
+ * forked processes).
+ */
+void test_record_serialize(const TestRecord *self, GString *output);
+/** @brief Deserialize a record
+ * @param test The test case the record belongs to
+ * @param data Serialized record
+ * @param length Size of the serialized data
+ * @return The new record or NULL if the data is malformed
+ */
+TestRecord *test_record_deserialize(TestCase *test, const gchar *data, gsize length);
+
+__END_DECLS
+
+#endif
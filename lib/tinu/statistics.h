@@ -31,9 +31,10 @@
 #ifndef _TINU_STATISTICS_H
 #define _TINU_STATISTICS_H
 
-#include <time.h>
-
 #include <tinu/test.h>
+#include <tinu/benchmark.h>
+#include <tinu/perf.h>
+#include <tinu/leakwatch.h>
 
 #define HOOK_NOT_REGISTERED ((guint32)-1)
 
@@ -45,10 +46,10 @@ typedef struct _StatTestInfo
   /** Result of the test */
   TestCaseResult    m_result;
 
-  /** Start time of the test */
-  clock_t           m_start;
-  /** End time of the test */
-  clock_t           m_end;
+  /** Wall-clock time of the test in nanoseconds */
+  guint64           m_wall_time;
+  /** CPU time of the test in nanoseconds */
+  guint64           m_cpu_time;
 
   /** Number of assertions in the test */
   guint             m_assertions;
@@ -57,6 +58,15 @@ typedef struct _StatTestInfo
 
   /** Bytes leaked during test execution */
   gsize             m_leaked_bytes;
+
+  /** Benchmark results (NULL if the test case is not a benchmark) */
+  BenchmarkResult  *m_benchmark;
+
+  /** Performance counters (NULL if not measured) */
+  PerfCounterValues *m_perf;
+
+  /** Heap profile (NULL if the leak watcher was not used) */
+  LeakwatchProfile *m_heap;
 } StatTestInfo;
 
 typedef struct _StatSuiteInfo
@@ -67,10 +77,11 @@ typedef struct _StatSuiteInfo
   /** Result of the suite */
   gboolean          m_result;
 
-  /** Start time of the test */
-  clock_t           m_start;
-  /** End time of the test */
-  clock_t           m_end;
+  /** Wall-clock time of the suite in nanoseconds (sum of the test cases,
+   * so it does not depend on how many test cases were run in parallel) */
+  guint64           m_wall_time;
+  /** CPU time of the suite in nanoseconds (sum of the test cases) */
+  guint64           m_cpu_time;
 
   /** Number of assertions in the suite */
   guint             m_assertions;
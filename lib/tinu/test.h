@@ -44,6 +44,7 @@
 #include <tinu/log.h>
 #include <tinu/clist.h>
 #include <tinu/names.h>
+#include <tinu/leakwatch.h>
 
 __BEGIN_DECLS
 
@@ -108,6 +109,18 @@ typedef enum
   TEST_INTERNAL,
 } TestCaseResult;
 
+/** @brief Time spent running a test case
+ *
+ * @note Public because the TEST_HOOK_AFTER_TEST hook uses it as a parameter.
+ */
+typedef struct _TestCaseTiming
+{
+  /** Elapsed wall-clock time (CLOCK_MONOTONIC) in nanoseconds */
+  guint64           m_wall_time;
+  /** CPU time used by the thread running the test case in nanoseconds */
+  guint64           m_cpu_time;
+} TestCaseTiming;
+
 typedef enum
 {
   /** Hook indicating an assertion was evaluated */
@@ -120,7 +133,8 @@ typedef enum
 
   /** Hook indicating the beginning of a test execution */
   TEST_HOOK_BEFORE_TEST,
-  /** Hook indicating the ending of a test execution */
+  /** Hook indicating the ending of a test execution (arguments: the test
+   * case, its TestCaseResult and a const TestCaseTiming pointer) */
   TEST_HOOK_AFTER_TEST,
   /** Hook indicating the beginning of a suite execution */
   TEST_HOOK_BEFORE_SUITE,
@@ -130,6 +144,19 @@ typedef enum
   /** Hook called with leak-watching results */
   TEST_HOOK_LEAKINFO,
 
+  /** Hook called with the results of a benchmark (arguments: the test case
+   * and a const BenchmarkResult pointer, see benchmark.h) */
+  TEST_HOOK_BENCHMARK,
+
+  /** Hook called with the performance counters of a test case (arguments:
+   * the test case and a const PerfCounterValues pointer, see perf.h) */
+  TEST_HOOK_PERF_COUNTERS,
+
+  /** Hook called with the heap profile of a test case run with the leak
+   * watcher (arguments: the test case and a const LeakwatchProfile
+   * pointer, see leakwatch.h) */
+  TEST_HOOK_HEAP_PROFILE,
+
   /** The last hook */
   TEST_HOOK_MAX,
 
@@ -215,12 +242,30 @@ struct _TestContext
   gboolean        m_sighandle;
   /** Enables/disables built-in leak detection */
   gboolean        m_leakwatch;
+  /** Number of leaking allocation sites reported per test case (0 reports
+   * all of them) */
+  guint           m_leakwatch_sites;
+  /** Screen the test cases with cheap net allocation counters and only
+   * run the ones that seem to leak again with the leak watcher */
+  gboolean        m_leak_screen;
+  /** Enables/disables profiling the allocations of each test case by
+   * call site */
+  gboolean        m_alloc_profile;
 
   /** Directory to put the cores in (or NULL if no cores
    * should be stored
    */
   const gchar    *m_core_dir;
 
+  /** Number of test cases run in parallel (1 or less means serial execution) */
+  gint            m_jobs;
+  /** Number of threads running test cases (overrides m_jobs if greater than one) */
+  gint            m_threads;
+
+  /** Performance counters measured for each test case (mask of
+   * PERF_COUNTER_BIT values, 0 disables them) */
+  guint32         m_perf_counters;
+
   /** Test hook callbacks */
   CList          *m_hooks[TEST_HOOK_MAX];
 };
@@ -337,11 +382,38 @@ void test_unregister_hook(TestContext *self, TestHookID hook_id, TestHookCb hook
  */
 void test_unregister_multiple_hooks(TestContext *self, TestHookCb *hooks, gpointer user_data);
 
+/** @brief Call the hooks registered in the test context
+ * @param self Test context
+ * @param hook_id ID of the hook to call
+ * @param ... Hook arguments
+ *
+ * @note Do not use directly! This is used when the events of a test case
+ * are replayed (see record.h).
+ */
+void test_run_hooks(TestContext *self, TestHookID hook_id, ...);
+
+/** @brief Get the test context the calling thread runs test cases of
+ * @return The context or NULL if the thread has not run any test cases
+ */
+TestContext *tinu_test_context_current(void);
+
+/** @brief Call a hook from the running test case
+ * @param hook_id Hook ID
+ *
+ * The hook is called the same way as the built-in hooks of a test case run,
+ * i.e. it is recorded if the test case runs in a worker.
+ *
+ * @note Do not use directly.
+ */
+void tinu_test_emit_hook(TestHookID hook_id, ...);
+
 /** @brief Run all tests
  * @param self Test context
  * @return Wheter all tests succeeded.
  *
- * Runs all tests and collects the statistics
+ * Runs all tests and collects the statistics. If m_threads is greater than
+ * one, the test cases are distributed between m_threads threads, otherwise
+ * if m_jobs is greater than one, between m_jobs worker processes.
  */
 gboolean tinu_test_all_run(TestContext *self);
 /** @brief Run an individual suite
@@ -350,6 +422,7 @@ gboolean tinu_test_all_run(TestContext *self);
  * @return Wheter the test suite succeeded.
  *
  * This runs only a distinct test suite. Suites are accessed by name.
+ * Test cases are run in parallel the same way as with tinu_test_all_run.
  */
 gboolean tinu_test_suite_run(TestContext *self, const gchar *suite_name);
 /** @brief Run an individual test case
@@ -384,6 +457,38 @@ gboolean tinu_test_case_run(TestContext *self, const gchar *suite_name, const gc
 gboolean tinu_test_assert(gboolean condition, const gchar *assert_type, const gchar *condstr,
   const gchar *file, const gchar *func, gint line, MessageTag *tag0, ...);
 
+/** @brief Evaluate an allocation budget
+ * @param budget Budget stopped after running the checked code
+ * @param codestr The checked code converted to a string
+ * @param file The file where the assertion comes from
+ * @param func The function where the assertion comes from
+ * @param line The line where the assertion comes from
+ * @return TRUE if the code stayed within the budget
+ *
+ * On failure the stacks of the allocations over the budget are logged.
+ *
+ * @note Do not use directly! Use the macros.
+ */
+gboolean tinu_test_assert_budget(const LeakwatchBudget *budget, const gchar *codestr,
+  const gchar *file, const gchar *func, gint line);
+
+/** @brief Evaluate the heap growth of a repeated function
+ * @param func Function to repeat
+ * @param ctx Argument of the function
+ * @param iterations Number of calls in a round
+ * @param funcstr The function converted to a string
+ * @param file The file where the assertion comes from
+ * @param func_name The function where the assertion comes from
+ * @param line The line where the assertion comes from
+ * @return TRUE if no allocation site kept growing
+ *
+ * On failure the growing sites are logged with their stacks.
+ *
+ * @note Do not use directly! Use the macros.
+ */
+gboolean tinu_test_assert_no_growth(TestFunctionSimple func, gpointer ctx, guint iterations,
+  const gchar *funcstr, const gchar *file, const gchar *func_name, gint line);
+
 /** @brief `TRUE' (or positive) Assertion
  * @param cond Assertion condition
  *
@@ -452,6 +557,56 @@ gboolean tinu_test_assert(gboolean condition, const gchar *assert_type, const gc
                    msg_tag_int("int2", int2),   \
                    NULL)
 
+/** @brief Check that a piece of code allocates at most n times
+ * @param n Maximal number of allocations
+ * @param ... The code to run
+ *
+ * The code is run and the allocations (and reallocations) made by the
+ * calling thread meanwhile are counted. If there are more than n of them
+ * the assertion fails and the stacks of the allocations over the budget
+ * are logged. Evaluates to the result of the assertion, so it can be used
+ * with FATAL.
+ */
+#define TINU_ASSERT_MAX_ALLOCS(n, ...)                          \
+  ({                                                            \
+    LeakwatchBudget __tinu_budget;                              \
+    tinu_leakwatch_budget_start(&__tinu_budget, (n));           \
+    { __VA_ARGS__; }                                            \
+    tinu_leakwatch_budget_stop(&__tinu_budget);                 \
+    tinu_test_assert_budget(&__tinu_budget,                     \
+                            #__VA_ARGS__,                       \
+                            __FILE__,                           \
+                            __PRETTY_FUNCTION__,                \
+                            __LINE__);                          \
+  })
+
+/** @brief Check that a piece of code does not allocate
+ * @param ... The code to run
+ *
+ * Same as TINU_ASSERT_MAX_ALLOCS(0, ...).
+ */
+#define TINU_ASSERT_NO_ALLOC(...)                               \
+  TINU_ASSERT_MAX_ALLOCS(0, __VA_ARGS__)
+
+/** @brief Check that the heap does not keep growing when repeating a call
+ * @param func Function to call (a TestFunctionSimple)
+ * @param ctx Argument of the function
+ * @param iterations Number of calls in a round
+ *
+ * The function is called in three rounds. The first one warms up the
+ * caches, then the live bytes of every allocation site are compared
+ * after the second and the third round. The assertion fails if a site
+ * grows in both rounds and its growth does not slow down to less than
+ * half (caches level off, leaks grow with the number of calls). The
+ * growing sites are logged with their stacks.
+ */
+#define TINU_ASSERT_NO_GROWTH(func, ctx, iterations)            \
+  tinu_test_assert_no_growth((func), (ctx), (iterations),       \
+                             #func,                             \
+                             __FILE__,                          \
+                             __PRETTY_FUNCTION__,               \
+                             __LINE__)
+
 /** @brief Fail without checking
  *
  * This macro can be used to make TINU fail. Similar to calling
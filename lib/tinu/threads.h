@@ -0,0 +1,63 @@
+/* TINU - Unittesting framework
+*
+* Copyright (c) 2010, Viktor Hercinger <hercinger.viktor@gmail.com>
+* All rights reserved.
+* 
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of the original author (Viktor Hercinger) nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+* 
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+* Author(s): Viktor Hercinger <hercinger.viktor@gmail.com>
+*/
+
+/** @file threads.h
+ * @brief Threaded test execution
+ *
+ * Test cases can be run in a pool of threads inside the test process. This
+ * is cheaper than forking (see jobs.h), but the test cases have to be
+ * thread-safe. Each thread has its own deque of test cases and steals from
+ * the others once its own deque is empty.
+ */
+#ifndef _TINU_THREADS_H
+#define _TINU_THREADS_H
+
+#include <glib.h>
+
+#include <tinu/test.h>
+#include <tinu/jobs.h>
+
+__BEGIN_DECLS
+
+/** @brief Run test cases in worker threads
+ * @param context Test context (m_threads is the number of threads)
+ * @param tests List of TestCase pointers to run
+ * @param done Called with the record of each finished test case
+ * @param user_data User data passed to done
+ * @return FALSE if the thread pool could not be created
+ *
+ * The done callback is always called from the calling thread, so it does
+ * not have to be thread-safe.
+ */
+gboolean test_threads_run(TestContext *context, GPtrArray *tests, TestJobDoneCb done, gpointer user_data);
+
+__END_DECLS
+
+#endif
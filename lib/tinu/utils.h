@@ -31,6 +31,8 @@
 #ifndef _TINU_UTILS_H
 #define _TINU_UTILS_H
 
+#include <time.h>
+
 #include <glib.h>
 
 #include <tinu/log.h>
@@ -59,6 +61,12 @@ void     __free(gpointer ptr);
 
 gchar *core_file_name(const gchar *dir, const gchar *suite, const gchar *test);
 
+/** @brief Read a clock in nanoseconds
+ * @param clock_id Clock to read (e.g. CLOCK_MONOTONIC, CLOCK_THREAD_CPUTIME_ID)
+ * @return Value of the clock or 0 if it is not available
+ */
+guint64 tinu_clock_ns(clockid_t clock_id);
+
 #define t_assert(cond)                                                  \
   if (!(cond))                                                          \
     {                                                                   \
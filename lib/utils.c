@@ -89,8 +89,19 @@ __free(gpointer ptr)
 gchar *
 core_file_name(const gchar *dir, const gchar *suite, const gchar *test)
 {
-  static gchar res[1024];
+  static __thread gchar res[1024];
 
   snprintf(res, sizeof(res), "%s/core.%s.%s", dir, suite, test);
   return res;
 }
+
+guint64
+tinu_clock_ns(clockid_t clock_id)
+{
+  struct timespec ts;
+
+  if (clock_gettime(clock_id, &ts) == -1)
+    return 0;
+
+  return (guint64)ts.tv_sec * G_GUINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
@@ -62,14 +62,48 @@ class Test(object):
         self.result = ''
         self.asserts = Asserts()
         self.time = 0
+        self.cputime = 0
+        self.benchmark = None
+        self.perf = {}
+        self.heap = None
 
     def parse_item(self, key, value):
         if key == 'result':
             self.result = value
 
+        elif is_prefix(key, 'heap'):
+            _, rest = key.split('.', 1)
+            if self.heap is None:
+                self.heap = {'histogram': {}}
+
+            if is_prefix(rest, 'histogram'):
+                _, size = rest.split('.', 1)
+                self.heap['histogram'][int(size)] = int(value)
+
+            else:
+                self.heap[rest] = int(value)
+
+        elif is_prefix(key, 'perf'):
+            _, rest = key.split('.', 1)
+            self.perf[rest] = int(value)
+
+        elif is_prefix(key, 'benchmark'):
+            _, rest = key.split('.', 1)
+            if self.benchmark is None:
+                self.benchmark = {}
+
+            if rest in ('samples', 'iterations'):
+                self.benchmark[rest] = int(value)
+
+            else:
+                self.benchmark[rest] = float(value)
+
         if key == 'time':
             self.time = float(value)
 
+        elif key == 'cputime':
+            self.cputime = float(value)
+
         elif is_prefix(key, 'asserts'):
             _, rest = key.split('.', 1)
             self.asserts.parse_item(rest, value)
@@ -86,6 +120,8 @@ class Suite(object):
         self.tests = {}
         self.result = None
         self.asserts = Asserts()
+        self.time = 0
+        self.cputime = 0
 
     def parse_item(self, key, value):
         if is_prefix(key, 'test'):
@@ -99,6 +135,12 @@ class Suite(object):
         elif key == 'result':
             self.result = int(value)
 
+        elif key == 'time':
+            self.time = float(value)
+
+        elif key == 'cputime':
+            self.cputime = float(value)
+
         elif is_prefix(key, 'asserts'):
             _, rest = key.split('.', 1)
             self.asserts.parse_item(rest, value)
@@ -118,6 +160,7 @@ class TinuResult(object):
         self.summary = Summary()
         self.messages = Message()
         self.suites = {}
+        self.baseline_version = None
 
     def __parse(self, line_iterator):
         for line in line_iterator:
@@ -130,6 +173,10 @@ class TinuResult(object):
             elif cls == 'message':
                 self.messages.parse_item(rest, value)
 
+            elif cls == 'baseline':
+                if rest == 'version':
+                    self.baseline_version = int(value)
+
             elif cls == 'suite':
                 name, rest = rest.split('.', 1)
                 if not self.suites.has_key(name):
@@ -233,7 +280,16 @@ class ExampleBackend(Backend):
                 _('  Test case %s' % tname)
                 _('    Result       : %s' % case.result)
                 _('    Assert passes: %d/%d' % (case.asserts.passed, case.asserts.total))
-                _('    Time         : %.3lf' % case.time)
+                _('    Time         : %.6lf' % case.time)
+                _('    CPU time     : %.6lf' % case.cputime)
+
+                if case.heap is not None:
+                    _('    Heap         : peak %d B, %d allocations (%d B), leaked %d B' %
+                      (case.heap['peak'], case.heap['allocs'], case.heap['bytes'], case.heap['leaked']))
+
+                if case.benchmark is not None:
+                    _('    Benchmark    : mean %.3lf ns, median %.3lf ns, stddev %.3lf ns' %
+                      (case.benchmark['mean'], case.benchmark['median'], case.benchmark['stddev']))
 
         return res
 